@@ -0,0 +1,115 @@
+#ifndef BMI_REGISTRY_HPP
+#define BMI_REGISTRY_HPP
+
+#include "Manager.hpp"
+#include "Messages.hpp"
+#include "expected.hpp"
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace P2978
+{
+
+struct BMIRegistryStats
+{
+    uint32_t entries;
+    // Entries that no handle refers to. These are evicted first.
+    uint32_t idleEntries;
+    uint64_t mappedBytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+// Build-system mappings of the BMI files, shared by all the compilations. Every BMI is opened, stat'ed and mapped once,
+// and is then handed out with refcounted handles till it is evicted or invalidated. Files are keyed by the path, and
+// on POSIX also by the device and the inode, so another spelling of the same path reuses the mapping. Mappings that no
+// handle refers to are kept and are unmapped least-recently-used first once the mapped bytes exceed the budget. Thread
+// safe.
+class BMIRegistry
+{
+    struct Entry
+    {
+        // Path that the file was first acquired with.
+        std::string filePath;
+        Mapping mapping{};
+        uint32_t fileSize = 0;
+        uint32_t refCount = 0;
+        uint64_t device = 0;
+        uint64_t inode = 0;
+        // Keys of the entry in byPath.
+        std::vector<std::string> paths;
+        std::list<Entry>::iterator position;
+        // Position in idle if refCount is 0.
+        std::list<Entry *>::iterator idlePosition;
+        // Cleared by invalidate. Such an entry is unmapped once its last handle is released.
+        bool registered = true;
+    };
+
+    mutable std::mutex mutex;
+    std::list<Entry> entries;
+    std::map<std::string, Entry *, std::less<>> byPath;
+    std::map<std::pair<uint64_t, uint64_t>, Entry *> byFile;
+    // Least-recently-used first.
+    std::list<Entry *> idle;
+    uint64_t budget;
+    uint64_t mappedBytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    // Following are called with the lock held. Mappings to be closed are appended to unmapped and are closed after the
+    // lock is released.
+    void reference(Entry &entry);
+    void release(Entry &entry, std::vector<Mapping> &unmapped);
+    // Removes the entry from the maps. It is destroyed once no handle refers to it.
+    void unregister(Entry &entry, std::vector<Mapping> &unmapped);
+    void destroy(Entry &entry, std::vector<Mapping> &unmapped);
+    void evict(std::vector<Mapping> &unmapped);
+    static void closeMappings(const std::vector<Mapping> &unmapped);
+
+  public:
+    class Handle
+    {
+        friend class BMIRegistry;
+        BMIRegistry *registry = nullptr;
+        Entry *entry = nullptr;
+
+        Handle(BMIRegistry *registry_, Entry *entry_);
+
+      public:
+        Handle() = default;
+        Handle(const Handle &other);
+        Handle(Handle &&other) noexcept;
+        Handle &operator=(Handle other) noexcept;
+        ~Handle();
+
+        // To be sent in the BTC messages. The fileSize is filled, so the compiler does not stat the file.
+        [[nodiscard]] BMIFile getBMIFile() const;
+        [[nodiscard]] std::string_view getFile() const;
+        void reset();
+    };
+
+    // budget_ is the mapped bytes above which the idle mappings are evicted. Mappings that are referred to are never
+    // evicted, so the budget might be exceeded.
+    explicit BMIRegistry(uint64_t budget_ = UINT64_MAX);
+    BMIRegistry(const BMIRegistry &) = delete;
+    BMIRegistry &operator=(const BMIRegistry &) = delete;
+    // All the handles must be released before.
+    ~BMIRegistry();
+
+    // policy is used only if the file is not mapped already.
+    [[nodiscard]] tl::expected<Handle, std::string> acquire(std::string_view filePath,
+                                                            PagePolicy policy = defaultPagePolicy);
+    // Called once the BMI is rebuilt. Next acquire maps the new file. Handles of the old file stay valid.
+    void invalidate(std::string_view filePath);
+    void setBudget(uint64_t budget_);
+    [[nodiscard]] BMIRegistryStats getStats() const;
+};
+} // namespace P2978
+#endif // BMI_REGISTRY_HPP
@@ -0,0 +1,49 @@
+#ifndef BMI_STORE_HPP
+#define BMI_STORE_HPP
+
+#include "expected.hpp"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace P2978
+{
+
+struct BMIStoreStats
+{
+    uint64_t published;
+    // BMI files that were replaced with a link to an identical stored BMI.
+    uint64_t deduplicated;
+    uint64_t savedBytes;
+};
+
+// Content-addressed store of the BMI files. Compilers send the rapidhash of the BMI in the CTBLastMessage, and the
+// build-system publishes the BMI file with it. The first BMI of a hash and size is hard-linked in the store directory,
+// while a later identical BMI, e.g. of another configuration or of the previous build, is replaced with a hard-link to
+// the stored one. So, identical BMIs share one file, one page-cache and, with the BMIRegistry, one mapping. As the
+// rapidhash is not collision-resistant, the BMI is compared byte by byte with the stored one before it is replaced,
+// and is kept as is if these differ. Stored files are not modified after, as the compiler replaces the BMI file
+// instead of writing in it. The directory is the index, so it can be shared by the build-system processes. If the
+// file can not be linked, e.g. as the store is on another file-system, it is kept as is. Thread safe.
+class BMIStore
+{
+    std::string directory;
+    mutable std::mutex mutex;
+    uint64_t published = 0;
+    uint64_t deduplicated = 0;
+    uint64_t savedBytes = 0;
+
+  public:
+    // Directory must exist.
+    explicit BMIStore(std::string directory_);
+
+    // Called once the CTBLastMessage is received. Returns the path of the stored file that the BMI file is now a link
+    // of, or the filePath if it could not be stored. The returned path should be mapped, so the identical BMIs share
+    // the mapping on Windows too.
+    [[nodiscard]] tl::expected<std::string, std::string> publish(const std::string &filePath, uint32_t fileSize,
+                                                                 uint64_t hash);
+    [[nodiscard]] BMIStoreStats getStats() const;
+};
+} // namespace P2978
+#endif // BMI_STORE_HPP
@@ -0,0 +1,42 @@
+#ifndef BMI_WRITE_BEHIND_HPP
+#define BMI_WRITE_BEHIND_HPP
+
+#include "expected.hpp"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace P2978
+{
+
+struct BMIWriteBehindStats
+{
+    uint32_t pending;
+    uint64_t published;
+    uint64_t persisted;
+    uint64_t flushes;
+};
+
+// BMI files published by the compilers with BMIPublication::WRITE_BEHIND are only in the page-cache when the
+// CTBLastMessage is received. That is enough for the dependent compilations, which map these from the page-cache, so
+// the build-system persists them later, off the critical path. publish starts the write-back of the file without
+// waiting for it, and flush waits for the write-back of all the published files, e.g. once enough are pending or at
+// the end of the build. Thread safe.
+class BMIWriteBehind
+{
+    mutable std::mutex mutex;
+    std::vector<std::string> pending;
+    uint64_t published = 0;
+    uint64_t persisted = 0;
+    uint64_t flushes = 0;
+
+  public:
+    [[nodiscard]] tl::expected<void, std::string> publish(std::string_view filePath);
+    // Files that could not be persisted stay pending, and the first error is returned.
+    [[nodiscard]] tl::expected<void, std::string> flush();
+    [[nodiscard]] BMIWriteBehindStats getStats() const;
+};
+} // namespace P2978
+#endif // BMI_WRITE_BEHIND_HPP
@@ -0,0 +1,61 @@
+#ifndef BMI_WRITER_HPP
+#define BMI_WRITER_HPP
+
+#include "expected.hpp"
+
+#include <cstdint>
+#include <string>
+
+namespace P2978
+{
+
+// Writable mapping of the output BMI file, so the compiler serializes the BMI in place instead of in a std::string
+// that is then copied in the file. It grows by doubling if the final size is not known. Once the BMI is written, it is
+// passed to IPCManagerCompiler::sendCTBLastMessage that truncates the file to the written size and publishes it.
+// Move-only, as it owns the file and the mapping. These are released by the destructor if unmap is not called.
+class BMIWriter
+{
+    char *mapping = nullptr;
+    uint64_t size = 0;
+    uint64_t capacity = 0;
+#ifdef _WIN32
+    void *file = nullptr;
+    void *fileMapping = nullptr;
+    // Of the file-path. The name of the file-mapping is made from it.
+    uint64_t pathHash = 0;
+#else
+    int fd = -1;
+#endif
+
+    BMIWriter() = default;
+    [[nodiscard]] tl::expected<void, std::string> grow(uint64_t newCapacity);
+
+  public:
+    static constexpr uint64_t defaultCapacity = 1024 * 1024;
+
+    BMIWriter(const BMIWriter &) = delete;
+    BMIWriter &operator=(const BMIWriter &) = delete;
+    BMIWriter(BMIWriter &&other) noexcept;
+    BMIWriter &operator=(BMIWriter &&other) noexcept;
+    ~BMIWriter();
+
+    // Creates the file, replacing the existing one.
+    static tl::expected<BMIWriter, std::string> create(const std::string &filePath,
+                                                       uint64_t capacity = defaultCapacity);
+
+    // Returns the address to write at least bytes at, growing the mapping if needed. It is valid till the next
+    // reserve, as the mapping might move.
+    [[nodiscard]] tl::expected<char *, std::string> reserve(uint64_t bytes);
+    // Adds the bytes written at the address returned by reserve to the BMI.
+    void commit(uint64_t bytes);
+    [[nodiscard]] tl::expected<void, std::string> append(std::string_view bytes);
+    [[nodiscard]] std::string_view getBMI() const;
+
+    // Truncates the file to the written size, flushing it to the disk if sync. On Windows, the named file-mapping
+    // that the build-system opens is created. Returns the size.
+    [[nodiscard]] tl::expected<uint32_t, std::string> seal(bool sync);
+    // Called after the build-system replied to the CTBLastMessage, or to drop the BMI.
+    [[nodiscard]] tl::expected<void, std::string> unmap();
+};
+} // namespace P2978
+#endif // BMI_WRITER_HPP
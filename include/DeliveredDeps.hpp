@@ -0,0 +1,49 @@
+#ifndef DELIVERED_DEPS_HPP
+#define DELIVERED_DEPS_HPP
+
+#include "Messages.hpp"
+
+#include <cstdint>
+#include <set>
+#include <string>
+
+namespace P2978
+{
+
+struct DeliveredDepsStats
+{
+    uint32_t logicalNames;
+    uint32_t bmiFiles;
+    // Dependencies and header-files left out of the replies as these were delivered before.
+    uint64_t omittedDeps;
+    uint64_t omittedLogicalNames;
+};
+
+// Logical names and BMI files already sent to one compiler. IPCManagerCompiler keeps every logical name of every reply
+// in its responses cache and ignores the ones it has already, so these can be left out of the later replies of the
+// same connection. A compilation importing many modules with a common closure then receives, and maps, each dependency
+// once. To be called on every BTCModule and BTCNonModule in the order these are sent, just before sending. Replies sent
+// without it, e.g. from the ReplyCache, are still valid but are not tracked. Not thread safe.
+class DeliveredDeps
+{
+    std::set<std::string, std::less<>> logicalNames;
+    std::set<std::string, std::less<>> bmiFiles;
+    uint64_t omittedDeps = 0;
+    uint64_t omittedLogicalNames = 0;
+
+    // Returns false if the logicalName was delivered before.
+    bool deliver(std::string_view logicalName);
+    // Hashes of the names, if sent, are omitted with these.
+    void omitDelivered(std::vector<std::string_view> &names, std::vector<uint64_t> &hashes);
+    // Omits the delivered logical names of the dependency. Returns true if the whole dependency can be omitted.
+    bool isDelivered(const BMIFile &file, std::vector<std::string_view> &names, std::vector<uint64_t> &hashes);
+
+  public:
+    void omitDelivered(const CTBModule &request, BTCModule &reply);
+    void omitDelivered(const CTBNonModule &request, BTCNonModule &reply);
+    // Called if the compiler is restarted on the same connection.
+    void clear();
+    [[nodiscard]] DeliveredDepsStats getStats() const;
+};
+} // namespace P2978
+#endif // DELIVERED_DEPS_HPP
@@ -0,0 +1,123 @@
+#ifndef FLAT_MESSAGES_HPP
+#define FLAT_MESSAGES_HPP
+
+#include "Messages.hpp"
+#include "expected.hpp"
+
+#include <string>
+
+namespace P2978
+{
+// WireFormat::V2 encoding of the BTCModule and BTCNonModule.
+// Every field is a naturally aligned uint32_t or uint8_t and all the offsets are from the start of the message. Root
+// record is at offset 0. Vectors are arrays of fixed-size records, so element i is at offset + i * sizeof(record) and
+// the receiver can overlay these structs on the received bytes and jump to any dependency without parsing the ones
+// before it. Strings are stored after the records. File-paths are followed by the null character.
+
+inline constexpr uint32_t flatVersion = 2;
+
+struct FlatString
+{
+    uint32_t offset;
+    uint32_t size;
+};
+
+template <typename T> struct FlatVector
+{
+    uint32_t offset;
+    uint32_t count;
+};
+
+struct FlatBMIFile
+{
+    FlatString filePath;
+    uint32_t fileSize;
+};
+
+struct FlatModuleDep
+{
+    FlatBMIFile file;
+    FlatVector<FlatString> logicalNames;
+    uint8_t isHeaderUnit;
+    uint8_t isSystem;
+    uint8_t padding[2];
+};
+
+struct FlatHuDep
+{
+    FlatBMIFile file;
+    FlatVector<FlatString> logicalNames;
+    uint8_t isSystem;
+    uint8_t padding[3];
+};
+
+struct FlatHeaderFile
+{
+    FlatString logicalName;
+    FlatString filePath;
+    uint8_t isSystem;
+    uint8_t padding[3];
+};
+
+struct FlatBTCModule
+{
+    uint32_t version;
+    FlatBMIFile requested;
+    FlatVector<FlatModuleDep> modDeps;
+    uint8_t isSystem;
+    uint8_t padding[3];
+};
+
+struct FlatBTCNonModule
+{
+    uint32_t version;
+    FlatVector<FlatHeaderFile> headerFiles;
+    FlatString filePath;
+    // Following are meaningful only if isHeaderUnit.
+    uint32_t fileSize;
+    FlatVector<FlatString> logicalNames;
+    FlatVector<FlatHuDep> huDeps;
+    uint8_t isHeaderUnit;
+    uint8_t isSystem;
+    uint8_t padding[2];
+};
+
+// buffer is cleared first.
+void writeFlat(std::string &buffer, const BTCModule &moduleFile);
+void writeFlat(std::string &buffer, const BTCNonModule &nonModule);
+
+// Read-only view over a received WireFormat::V2 message. open checks the alignment, the version and that every offset
+// and size is within the message, so the accessors do no checks.
+class FlatMessage
+{
+    std::string_view message;
+
+    explicit FlatMessage(std::string_view message_);
+
+  public:
+    // message must be 4-byte aligned. The received messages are, as they are at the start of the receive buffer.
+    static tl::expected<FlatMessage, std::string> openBTCModule(std::string_view message_);
+    static tl::expected<FlatMessage, std::string> openBTCNonModule(std::string_view message_);
+
+    template <typename Root> const Root &root() const
+    {
+        return *reinterpret_cast<const Root *>(message.data());
+    }
+
+    template <typename T> const T &get(const FlatVector<T> &vector, const uint32_t i) const
+    {
+        return reinterpret_cast<const T *>(message.data() + vector.offset)[i];
+    }
+
+    std::string_view get(const FlatString &str) const
+    {
+        return {message.data() + str.offset, str.size};
+    }
+
+    BMIFile get(const FlatBMIFile &file) const
+    {
+        return {get(file.filePath), file.fileSize};
+    }
+};
+} // namespace P2978
+#endif // FLAT_MESSAGES_HPP
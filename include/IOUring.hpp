@@ -0,0 +1,88 @@
+#ifndef IO_URING_HPP
+#define IO_URING_HPP
+
+#include "expected.hpp"
+
+#include <cstdint>
+#include <string>
+
+#ifndef _WIN32
+#include <linux/io_uring.h>
+
+namespace P2978
+{
+
+// IORING_OP_READ_MULTISHOT of Linux 6.7. Older headers do not have it.
+inline constexpr uint8_t ioringOpReadMultishot = 49;
+
+// Minimal io_uring over the system calls, as liburing is not a dependency. Reads select their buffer from a ring of
+// buffers that is registered with the kernel once, so the same few buffers are reused for all the reads and no buffer
+// is held by an idle file descriptor. Used by IPCServerBS with IOEngine::IO_URING on one thread.
+class IOUring
+{
+    void *rings = nullptr;
+    uint64_t ringsSize = 0;
+    io_uring_sqe *sqes = nullptr;
+    uint64_t sqesSize = 0;
+
+    uint32_t *sqHead = nullptr;
+    uint32_t *sqTail = nullptr;
+    uint32_t sqMask = 0;
+    uint32_t sqEntries = 0;
+    // Tail of the prepared SQEs. Published to the kernel with the submission.
+    uint32_t sqLocalTail = 0;
+    uint32_t unsubmitted = 0;
+
+    uint32_t *cqHead = nullptr;
+    uint32_t *cqTail = nullptr;
+    uint32_t cqMask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    // Provided buffers. Tail of the buffer ring overlays the reserved field of its first entry.
+    io_uring_buf *bufferRing = nullptr;
+    uint64_t bufferRingSize = 0;
+    char *buffers = nullptr;
+    uint32_t bufferCount = 0;
+    uint32_t bufferSize = 0;
+    uint16_t bufferTail = 0;
+
+    [[nodiscard]] tl::expected<void, std::string> enter(uint32_t waitCount, int32_t timeout);
+    void addBuffer(uint16_t id);
+
+  public:
+    static constexpr uint16_t bufferGroup = 0;
+
+    uint64_t fd = 0;
+
+    // entries and bufferCount_ are rounded up to the power of 2.
+    static tl::expected<IOUring, std::string> create(uint32_t entries, uint32_t bufferCount_, uint32_t bufferSize_);
+
+    // Returns the next SQE, zeroed. Prepared SQEs are submitted first if the submission queue is full.
+    [[nodiscard]] tl::expected<io_uring_sqe *, std::string> getSqe();
+    // Submits the prepared SQEs and the recycled buffers in one system call and waits for at least one completion, or
+    // at most timeout milliseconds if it is not -1.
+    [[nodiscard]] tl::expected<void, std::string> submitAndWait(int32_t timeout);
+
+    // Calls f with every available completion and then marks these as consumed.
+    template <typename F> void forEachCompletion(F f)
+    {
+        uint32_t head = *cqHead;
+        const uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            f(cqes[head & cqMask]);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // Buffer of a completion with IORING_CQE_F_BUFFER.
+    [[nodiscard]] const char *getBuffer(uint16_t id) const;
+    // Returns the buffer to the kernel with the next submission.
+    void recycleBuffer(uint16_t id);
+
+    // Unmaps the rings and the buffers and closes the fd. Operations that are not complete are canceled.
+    [[nodiscard]] tl::expected<void, std::string> close();
+};
+} // namespace P2978
+#endif
+#endif // IO_URING_HPP
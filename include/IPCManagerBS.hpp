@@ -2,8 +2,11 @@
 #ifndef IPC_MANAGER_BS_HPP
 #define IPC_MANAGER_BS_HPP
 
+#include "BMIRegistry.hpp"
 #include "Manager.hpp"
 #include "Messages.hpp"
+#include "SessionDictionary.hpp"
+#include "SharedMemoryChannel.hpp"
 
 namespace P2978
 {
@@ -11,18 +14,81 @@ namespace P2978
 // IPC Manager BuildSystem
 class IPCManagerBS : public Manager
 {
+    friend class IPCServerBS;
+
+    // Returns the buffer to serialize the message in. It has space reserved for the frame header if needed.
+    // Reserved for the whole message in one allocation.
+    [[nodiscard]] GatherBuffer getBuffer(uint64_t payloadSize) const;
+    // Completes the message with frame header or delimiter and writes it. Pipes and shared memory are written without
+    // flattening the buffer.
+    [[nodiscard]] tl::expected<void, std::string> writeMessage(GatherBuffer &buffer, BTC type) const;
+    // requestId is only sent if type is BTC::PREFETCH.
+    template <typename Reply>
+    [[nodiscard]] tl::expected<void, std::string> sendReply(const Reply &reply, BTC type, uint32_t requestId) const;
+    template <typename Reply> [[nodiscard]] std::string serializePayload(const Reply &reply) const;
+
+    // WireFormat::V1_INTERNED. Strings sent on this connection. Sending a message adds to it. Copies of the manager
+    // write literals, so only one IPCManagerBS sends the interned strings on a connection.
+    mutable SessionDictionary dictionary;
+    // Returns nullptr if the wireFormat is not WireFormat::V1_INTERNED.
+    [[nodiscard]] SessionDictionary *getDictionary() const;
+
+    // CTB messages are received in this buffer in Framing::SEQPACKET and Framing::SHARED_MEMORY modes.
+    std::string receiveBuffer;
+
   public:
+    // In Framing::SEQPACKET mode, this is the build-system end of the socket-pair and CTB messages are also received on
+    // it.
     uint64_t writeFd = 0;
+    // Must be same as the one passed to the IPCManagerCompiler.
+    Framing framing = Framing::DELIMITER;
+    // Must be same as the one set on the IPCManagerCompiler.
+    WireFormat wireFormat = WireFormat::V1;
+    // If set, the messages are appended to it instead of being written, so IPCServerBS writes these without blocking.
+    // In Framing::SEQPACKET mode, the datagrams of the messages are appended as per Manager::appendDatagrams.
+    std::string *writeQueue = nullptr;
+#ifndef _WIN32
+    // Used instead of writeFd in Framing::SHARED_MEMORY mode.
+    SharedMemoryChannel channel;
+#endif
 
     tl::expected<void, std::string> writeInternal(std::string_view buffer) const override;
 
-    explicit IPCManagerBS(uint64_t writeFd_);
-    static tl::expected<void, std::string> receiveMessage(char (&ctbBuffer)[320], CTB &messageType, std::string_view serverReadString) ;
+    explicit IPCManagerBS(uint64_t writeFd_, Framing framing_ = Framing::DELIMITER);
+#ifndef _WIN32
+    // Framing::SHARED_MEMORY. channel_.fd is to be passed to the compiler.
+    explicit IPCManagerBS(const SharedMemoryChannel &channel_);
+#endif
+    // wireFormat must be the one of the connection, as the hashes are only sent in WireFormat::V1_HASHED.
+    static tl::expected<void, std::string> receiveMessage(char (&ctbBuffer)[320], CTB &messageType,
+                                                          std::string_view serverReadString,
+                                                          WireFormat wireFormat = WireFormat::V1);
+    // Framing::SEQPACKET and Framing::SHARED_MEMORY only. Receives the next CTB message and parses it in place. The
+    // strings in ctbBuffer are valid till the next call.
+    [[nodiscard]] tl::expected<void, std::string> receiveMessage(char (&ctbBuffer)[320], CTB &messageType);
     [[nodiscard]] tl::expected<void, std::string> sendMessage(const BTCModule &moduleFile) const;
     [[nodiscard]] tl::expected<void, std::string> sendMessage(const BTCNonModule &nonModule) const;
+    // Replies for CTBPrefetch with its requestId.
+    [[nodiscard]] tl::expected<void, std::string> sendMessage(const BTCModule &moduleFile, uint32_t requestId) const;
+    [[nodiscard]] tl::expected<void, std::string> sendMessage(const BTCNonModule &nonModule, uint32_t requestId) const;
+    [[nodiscard]] tl::expected<void, std::string> sendMessage(const BTCBatch &batch) const;
+    // Payload of the reply without the framing. It is the same for all the connections with this wireFormat, so it can
+    // be serialized once and kept in the ReplyCache. In WireFormat::V1_INTERNED, its strings are literals.
+    [[nodiscard]] std::string serializeReply(const BTCModule &moduleFile) const;
+    [[nodiscard]] std::string serializeReply(const BTCNonModule &nonModule) const;
+    // Sends the payload of serializeReply as type BTC::MODULE or BTC::NON_MODULE, or as BTC::PREFETCH with the
+    // requestId. payload is written without being copied, except in Framing::SEQPACKET mode.
+    [[nodiscard]] tl::expected<void, std::string> sendSerializedReply(std::string_view payload, BTC type,
+                                                                      uint32_t requestId = 0) const;
     [[nodiscard]] tl::expected<void, std::string> sendMessage(const BTCLastMessage &lastMessage) const;
-    static tl::expected<Mapping, std::string> createSharedMemoryBMIFile(BMIFile &bmiFile);
+    static tl::expected<Mapping, std::string> createSharedMemoryBMIFile(BMIFile &bmiFile,
+                                                                        PagePolicy policy = defaultPagePolicy);
     static tl::expected<void, std::string> closeBMIFileMapping(const Mapping &processMappingOfBMIFile);
+    // Registry shared by the whole build-system process. Instead of createSharedMemoryBMIFile for every reply, the
+    // BMI files are acquired from it, so each is mapped once for the whole build.
+    static BMIRegistry &getBMIRegistry();
+    // WireFormat::V1_INTERNED. Strings interned on this connection and the bytes saved.
+    [[nodiscard]] const SessionDictionaryStats &getDictionaryStats() const;
 };
 } // namespace P2978
 #endif // IPC_MANAGER_BS_HPP
@@ -2,31 +2,32 @@
 #ifndef IPC_MANAGER_COMPILER_HPP
 #define IPC_MANAGER_COMPILER_HPP
 
+#include "BMIWriter.hpp"
+#include "FlatMessages.hpp"
 #include "Manager.hpp"
+#include "ResponseTable.hpp"
+#include "SessionDictionary.hpp"
+#include "SharedMemoryChannel.hpp"
+#include "StringArena.hpp"
 #include "expected.hpp"
 
+#include <list>
+#include <map>
+#include <unordered_map>
+
 struct CompilerTest;
 struct BuildSystemTest;
 namespace P2978
 {
 
-inline std::vector<std::string *> allocations;
-
-enum class FileType : uint8_t
-{
-    MODULE,
-    HEADER_UNIT,
-    HEADER_FILE
-};
-
-struct Response
+// How sendCTBLastMessage publishes the BMI file.
+enum class BMIPublication : uint8_t
 {
-    std::string_view filePath;
-    // if type == HEADER_FILE, then fileSize has no meaning
-    Mapping mapping;
-    FileType type;
-    bool isSystem;
-    Response(std::string_view filePath_, const Mapping &mapping_, FileType type_, bool isSystem_);
+    // BMI file is flushed to the disk before the build-system is told.
+    SYNC,
+    // BMI file is only written in the page-cache, which is enough for the dependent compilations. Build-system persists
+    // it later with BMIWriteBehind.
+    WRITE_BEHIND,
 };
 
 // IPC Manager Compiler
@@ -35,8 +36,12 @@ class IPCManagerCompiler : Manager
     friend struct ::CompilerTest;
     friend struct ::BuildSystemTest;
 
-    tl::expected<std::string_view, std::string> readInternal(char (&buffer)[4096]) const;
+    // type is the expected message type. It is only checked in Framing::LENGTH_PREFIXED mode.
+    // Returned string_view points into the receiveBuffer and is valid only till the next call.
+    tl::expected<std::string_view, std::string> readInternal(char (&buffer)[4096], BTC type);
     tl::expected<void, std::string> writeInternal(std::string_view buffer) const override;
+    // Appends the payload size and delimiter if needed and writes the CTB message.
+    [[nodiscard]] tl::expected<void, std::string> writeMessage(std::string &buffer) const;
 
     struct BMIFileMapping
     {
@@ -44,45 +49,189 @@ class IPCManagerCompiler : Manager
         Mapping mapping;
     };
 
+    // Every BMI file is mapped once, however many replies and paths it is reached through. The mapping is shared by
+    // all the responses that have it.
+    struct SharedMapping
+    {
+        // file is empty till the first use in the lazyMapping mode.
+        Mapping mapping;
+        uint32_t fileSize = 0;
+        // Logical-names whose response has the mapping. The mapping of a received file is kept even if it is 0.
+        uint32_t references = 0;
+        // Index of the response in the responses that the logical-names of the file are inserted with.
+        uint32_t response = UINT32_MAX;
+        // Keys in the mappingsByPath. More than one if the file is reached through more than one path.
+        std::vector<std::string_view> filePaths;
+        std::list<SharedMapping>::iterator position;
+#ifndef _WIN32
+        uint64_t device = 0;
+        uint64_t inode = 0;
+#endif
+    };
+    std::list<SharedMapping> sharedMappings;
+    std::unordered_map<std::string_view, SharedMapping *> mappingsByPath;
+#ifndef _WIN32
+    // By the device and inode of the file.
+    std::map<std::pair<uint64_t, uint64_t>, SharedMapping *> mappedFiles;
+#endif
+
+    // Returns nullptr if the wireFormat is not WireFormat::V1_INTERNED.
+    SessionDictionary *getDictionary();
+    // Reads a string of the V1 reply, as a token of the dictionary in WireFormat::V1_INTERNED.
+    tl::expected<std::string_view, std::string> readReplyString(std::string_view message, uint32_t &bytesRead,
+                                                                bool isPath);
     tl::expected<BMIFileMapping, std::string> readProcessMappingOfBMIFile(std::string_view message,
                                                                           uint32_t &bytesRead);
+    tl::expected<BMIFileMapping, std::string> mapBMIFile(const BMIFile &file);
+    // Adds the response if the logicalName is not cached. The response references the mapping. hash is the
+    // hashLogicalName of the logicalName.
+    [[nodiscard]] tl::expected<void, std::string> addResponse(std::string_view logicalName, uint64_t hash,
+                                                              const BMIFileMapping &mapping, FileType type,
+                                                              bool isSystem);
+    void addHeaderFile(std::string_view logicalName, uint64_t hash, std::string_view filePath, bool isSystem);
+    // Maps the file if it is not mapped yet.
+    tl::expected<void, std::string> map(SharedMapping &shared, PagePolicy policy);
+    // Removes the file from the caches and closes its mapping.
+    tl::expected<void, std::string> eraseMapping(SharedMapping &shared);
+    // Sets the mapping of the response, mapping the file if it is not mapped yet.
+    tl::expected<void, std::string> mapResponse(Response &response);
     tl::expected<void, std::string> readLogicalNames(std::string_view message, uint32_t &bytesRead,
                                                      const BMIFileMapping &mapping, FileType type, bool isSystem);
 
+    // Parse the reply without checking that the whole message is consumed, as it might be a part of the BTCBatch.
+    tl::expected<void, std::string> readBTCModule(const CTBModule &moduleName, std::string_view message,
+                                                  uint32_t &bytesRead);
+    tl::expected<void, std::string> readBTCNonModule(const CTBNonModule &nonModule, std::string_view message,
+                                                     uint32_t &bytesRead);
+
+    // WireFormat::V2. Dependencies are read in place from the verified message.
+    tl::expected<void, std::string> readFlatLogicalNames(const FlatMessage &flat,
+                                                         const FlatVector<FlatString> &logicalNames,
+                                                         const BMIFileMapping &mapping, FileType type, bool isSystem);
+    tl::expected<void, std::string> readFlatBTCModule(const CTBModule &moduleName, std::string_view message);
+    tl::expected<void, std::string> readFlatBTCNonModule(const CTBNonModule &nonModule, std::string_view message);
+
     // Called by sendCTBLastMessage. Build-system will send this after it has created the BMI file-mapping.
-    [[nodiscard]] tl::expected<void, std::string> receiveBTCLastMessage() const;
+    [[nodiscard]] tl::expected<void, std::string> receiveBTCLastMessage();
     // This function is called by findResponse if it did not find the module in the IPCManagerCompiler::responses cache.
     [[nodiscard]] tl::expected<void, std::string> receiveBTCModule(const CTBModule &moduleName);
     // This function is called by findResponse if it did not find the header-unit or header-file in the
     // IPCManagerCompiler::responses cache.
     [[nodiscard]] tl::expected<void, std::string> receiveBTCNonModule(const CTBNonModule &nonModule);
-
-    // Internal cache for the possible future requests.
-    std::unordered_map<std::string_view, Response> responses;
+    // This function is called by findResponses for all the requests not in the IPCManagerCompiler::responses cache.
+    [[nodiscard]] tl::expected<void, std::string> receiveBTCBatch(const CTBBatch &batch);
+    // Receives one BTC::PREFETCH reply and dispatches it to its pending request.
+    [[nodiscard]] tl::expected<void, std::string> receivePrefetchReply();
+    [[nodiscard]] tl::expected<void, std::string> waitForPrefetch(uint32_t requestId);
+    // Called before the requests whose reply is not a BTC::PREFETCH, so that reply is not received out of order.
+    [[nodiscard]] tl::expected<void, std::string> waitForAllPrefetches();
+    // Returns nullptr if the build-system needs to be requested.
+    Response *findCached(std::string_view logicalName, uint64_t hash, FileType type);
+
+    // Internal cache for the possible future requests. Build-system might leave out of a reply the dependencies that
+    // are in it already (DeliveredDeps), so a reply only adds to it and its absent dependencies are not an error.
+    ResponseTable responses;
+
+    struct PendingRequest
+    {
+        // Saved in the arena.
+        std::string_view logicalName;
+        uint64_t hash;
+        FileType type;
+    };
+    // Reply-dispatch table of the prefetches that are not replied yet.
+    std::unordered_map<uint32_t, PendingRequest> pendingRequests;
+    // Request IDs of the pending logical-names, by FileType, as a logical-name might be pending as more than one type.
+    std::unordered_map<std::string_view, uint32_t> pendingLogicalNames[3];
+    uint32_t nextRequestId = 1;
+    // Compiler does not read the replies while sending the prefetches. This bounds the replies in the pipe. It counts
+    // the requests, not the bytes of their replies, as these are not known before. A reply is a few paths, so 64 of
+    // these usually fit in a pipe. Larger ones only make a build-system that writes with blocking wait till the
+    // compiler reads these. That does not deadlock, as 64 prefetches fit in the output pipe, so the compiler reaches
+    // the reads.
+    static constexpr uint32_t maxPendingRequests = 64;
+
+    // Every message is received in this buffer. Strings kept after the parsing are copied in the arena.
+    std::string receiveBuffer;
+    // Framing::DELIMITER. Bytes read after the end of the last message.
+    std::string unreadInput;
+    StringArena arena;
+    // WireFormat::V1_INTERNED. Strings received on this connection.
+    SessionDictionary dictionary;
 
     //  Compiler can use this function to read the BMI file. BMI should be read using this function to conserve memory.
-    static tl::expected<Mapping, std::string> readSharedMemoryBMIFile(const BMIFile &file);
+    static tl::expected<Mapping, std::string> readSharedMemoryBMIFile(const BMIFile &file,
+                                                                      PagePolicy policy = defaultPagePolicy);
+
+    [[nodiscard]] tl::expected<void, std::string> sendCTBLastMessage(uint32_t fileSize, uint64_t hash) const;
 
-    [[nodiscard]] tl::expected<void, std::string> sendCTBLastMessage(uint32_t fileSize) const;
+    Framing framing = Framing::DELIMITER;
+    // Socket used instead of stdin and stdout in Framing::SEQPACKET mode.
+    uint64_t channelFd = 0;
+#ifndef _WIN32
+    // Used instead of stdin and stdout in Framing::SHARED_MEMORY mode.
+    SharedMemoryChannel channel;
+#endif
 
   public:
+    // Must be same as the one set on the IPCManagerBS. In WireFormat::V1_HASHED, the requests carry the hashLogicalName
+    // of their logical-names, so the build-system does not hash these again.
+    WireFormat wireFormat = WireFormat::V1;
+    // If set, the BMI files are not mapped while the reply is parsed, but on the first findResponse, findResponses or
+    // getBMIFileMapping that needs these. Compiler might not need many of the dependencies in the reply.
+    bool lazyMapping = false;
+    BMIPublication bmiPublication = BMIPublication::SYNC;
+
+    // framing_ must be same as the one the build-system passed to the IPCManagerBS. In Framing::SEQPACKET mode,
+    // channelFd_ is the inherited socket that the build-system passes on the command-line.
+    explicit IPCManagerCompiler(Framing framing_ = Framing::DELIMITER, uint64_t channelFd_ = 0);
+#ifndef _WIN32
+    // Framing::SHARED_MEMORY. channel_ is opened with the memfd that the build-system passes on the command-line.
+    explicit IPCManagerCompiler(const SharedMemoryChannel &channel_);
+#endif
+
     // Compiler process can use this function to close the BMI file-mapping to reduce references to shared memory file.
     // Not needed as it will be cleared at process exit.
     static tl::expected<void, std::string> closeBMIFileMapping(const Mapping &processMappingOfBMIFile);
+    // Drops the cached response of the logicalName. Its BMI file-mapping is closed once no other response has it.
+    tl::expected<void, std::string> closeBMIFileMapping(std::string_view logicalName);
+    // Closes the BMI file-mappings that no cached response has, e.g. of the dependencies that were sent without a new
+    // logical-name.
+    tl::expected<void, std::string> closeUnreferencedBMIFiles();
 
     // Cache mapping between the file-path and bmi-file-mapping. Only to be queried by the compiler. Passed path must be
-    // lexically normal and lower-case on Windows.
-    std::unordered_map<std::string, Mapping> filePathProcessMapping;
+    // lexically normal and lower-case on Windows. In the lazyMapping mode, only the mapped files are in it.
+    std::unordered_map<std::string_view, Mapping> filePathProcessMapping;
+    // Same as the filePathProcessMapping, but maps the BMI file of a reply if it is not mapped yet.
+    [[nodiscard]] tl::expected<Mapping, std::string> getBMIFileMapping(std::string_view filePath);
+    // Maps the BMI file of the cached response with PagePolicy::WILL_NEED, so the kernel reads it in the background.
+    // Called in the lazyMapping mode for the BMI files the compiler is likely to need next.
+    [[nodiscard]] tl::expected<void, std::string> willNeedBMIFile(std::string_view logicalName);
 
     // TODO
     // For FileType:HEADER_FILE, it could also return FileType::MODULE, but Clang currently does not support it.
     // For FileType::HEADER_FILE, it can return FileType::HEADER_UNIT, otherwise it will return the request
     // response. Either it will return from the cache or it will fetch it from the build-system
     [[nodiscard]] tl::expected<Response, std::string> findResponse(std::string_view logicalName, FileType type);
+    // Sends the request and returns without waiting for the reply, so the compiler can continue while the build-system
+    // resolves it. A later findResponse for the logicalName only waits for the reply of this request. Returns the
+    // request ID, or 0 if the response is already cached.
+    [[nodiscard]] tl::expected<uint32_t, std::string> prefetch(std::string_view logicalName, FileType type);
+    // Same as findResponse for every request, but all the requests not in the cache are sent in one CTBBatch, so
+    // these take one round trip instead of one each. Responses are in the same order as the requests.
+    [[nodiscard]] tl::expected<std::vector<Response>, std::string> findResponses(
+        const std::vector<std::pair<std::string_view, FileType>> &requests);
 
     // This function should be called only if the compilation succeeded
     [[nodiscard]] tl::expected<void, std::string> sendCTBLastMessage(const std::string &bmiFile,
-                                                                     const std::string &filePath) const;
+                                                                     const std::string &filePath);
+    // Same, but the BMI is already written in the file by the writer, which is sealed and unmapped.
+    [[nodiscard]] tl::expected<void, std::string> sendCTBLastMessage(BMIWriter &writer);
+
+    // Memory used by the strings kept in the responses and filePathProcessMapping caches.
+    [[nodiscard]] const ArenaStats &getArenaStats() const;
+    // WireFormat::V1_INTERNED. Strings interned on this connection and the bytes saved.
+    [[nodiscard]] const SessionDictionaryStats &getDictionaryStats() const;
 };
 
 inline IPCManagerCompiler *managerCompiler;
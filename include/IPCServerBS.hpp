@@ -0,0 +1,225 @@
+#ifndef IPC_SERVER_BS_HPP
+#define IPC_SERVER_BS_HPP
+
+#include "IOUring.hpp"
+#include "IPCManagerBS.hpp"
+#include "Messages.hpp"
+#include "WorkerPool.hpp"
+#include "expected.hpp"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace P2978
+{
+#ifndef _WIN32
+
+enum class IOEngine : uint8_t
+{
+    // Readiness of the connections is polled and these are read and written with a system call each.
+    EPOLL,
+    // Reads stay armed on every compiler output and complete in the registered buffers. Replies of all the connections
+    // are written with one submission per poll. Framing::SEQPACKET is not supported.
+    IO_URING,
+};
+
+// Event-loop of the build-system for many concurrent compilations on one thread. The output of every compiler is read
+// without blocking and the CTB messages are framed incrementally per connection and dispatched to the callbacks.
+// Replies are sent from the callbacks with Connection::manager, which queues these. Queued replies are written without
+// blocking, so a compiler that does not read its input does not stall the others. Framing::SHARED_MEMORY is not
+// supported, as its messages are not received through a file descriptor.
+class IPCServerBS
+{
+  public:
+    class Connection;
+    // Sends the reply with the manager, which serializes it in memory when called on a worker.
+    using ReplyBuilder = std::function<tl::expected<void, std::string>(const IPCManagerBS &manager)>;
+
+  private:
+    // Reply built on a worker. Owned by its connection till it is written.
+    struct ReplyTask
+    {
+        // Next in the stack of the finished tasks.
+        ReplyTask *next = nullptr;
+        Connection *connection = nullptr;
+        // Copy of the connection manager that appends the reply to output.
+        IPCManagerBS manager;
+        ReplyBuilder build;
+        std::string output;
+        std::string error;
+        bool finished = false;
+
+        ReplyTask(Connection &connection_, ReplyBuilder build_);
+    };
+
+    struct Workers
+    {
+        WorkerPool pool;
+        // Lock-free stack of the finished tasks. Taken whole by the I/O thread.
+        std::atomic<ReplyTask *> finished = nullptr;
+        // Written by the worker that pushes on the empty stack, so the I/O thread wakes up for the replies.
+        uint64_t eventFd;
+        // IOEngine::IO_URING reads the eventFd in this.
+        uint64_t eventValue = 0;
+        bool readArmed = false;
+
+        Workers(uint32_t threadCount, uint64_t eventFd_);
+    };
+
+  public:
+    class Connection
+    {
+        friend class IPCServerBS;
+
+        enum class SourceType : uint8_t
+        {
+            OUTPUT,
+            // Framing::SEQPACKET socket. Messages are received and the replies are written on it.
+            SOCKET,
+            // manager.writeFd, while the replies wait for it to be writable.
+            INPUT,
+        };
+        // epoll_event::data.ptr of the file descriptors of the connection.
+        struct Source
+        {
+            Connection *connection;
+            SourceType type;
+        };
+        Source outputSource;
+        Source socketSource;
+        Source inputSource;
+
+        // Compiler output that is not framed yet. Reused for the whole connection.
+        std::string input;
+        // input before this is already searched for the delimiter.
+        uint64_t searched = 0;
+        // Framing::SEQPACKET messages are received in this. A message of many datagrams might take more than one poll.
+        std::string datagramBuffer;
+        bool outputClosed = false;
+        bool socketClosed = false;
+        bool closed = false;
+
+        // Replies are queued in this by the manager and are moved to writing once the ones before are written. writing
+        // is written from the offset written. In Framing::SEQPACKET mode, these hold the datagrams of the replies.
+        std::string queuedReplies;
+        std::string writing;
+        uint64_t written = 0;
+        // Operations in the kernel and the replies on the workers. These point to the connection, so it is only
+        // destroyed after these complete.
+        uint32_t pendingOperations = 0;
+        bool readArmed = false;
+        // IOEngine::IO_URING write is in the kernel, or IOEngine::EPOLL waits for the manager.writeFd to be writable.
+        bool writeArmed = false;
+        // IOEngine::IO_URING. Armed operations of a closed connection are canceled once.
+        bool readCancelSubmitted = false;
+        bool writeCancelSubmitted = false;
+
+        // Replies of buildReply in the order of the calls. Written once the ones before are.
+        std::deque<std::unique_ptr<ReplyTask>> replyTasks;
+
+      public:
+        // Replies are sent with this. In Framing::SEQPACKET mode, the messages are also received on its writeFd.
+        IPCManagerBS manager;
+        // Compiler stdout. Except in Framing::SEQPACKET mode, the CTB messages are interleaved with the output.
+        uint64_t outputFd;
+        // For the build-system to associate its state with the connection.
+        void *userData = nullptr;
+
+        Connection(const IPCManagerBS &manager_, uint64_t outputFd_);
+    };
+
+    // Strings in the messages point into the connection buffer and are valid only till the callback returns.
+    std::function<void(Connection &, const CTBModule &)> onModule;
+    std::function<void(Connection &, const CTBNonModule &)> onNonModule;
+    std::function<void(Connection &, const CTBPrefetch &)> onPrefetch;
+    std::function<void(Connection &, const CTBBatch &)> onBatch;
+    std::function<void(Connection &, const CTBLastMessage &)> onLastMessage;
+    // Compiler output other than the messages. Except in Framing::SEQPACKET mode, output that is not followed by a
+    // message is only known to be output at the end, so it is passed with the next message or when the compiler exits.
+    std::function<void(Connection &, std::string_view)> onOutput;
+    // Called once the compiler has exited, or with the error if the connection failed. The connection is destroyed
+    // after the callback returns, or with IOEngine::IO_URING once its operations in the kernel are canceled. File
+    // descriptors are not closed.
+    std::function<void(Connection &, const std::string &error)> onClose;
+
+  private:
+    // Set in the server returned by create and moved with it, so only one server closes the file descriptors.
+    struct Ownership
+    {
+        bool owned = false;
+
+        Ownership() = default;
+        Ownership(Ownership &&other) noexcept;
+        Ownership &operator=(Ownership &&other) = delete;
+    };
+    Ownership ownership;
+    IOEngine engine = IOEngine::EPOLL;
+    uint64_t epollFd = 0;
+    IOUring ring;
+    // Cleared if the kernel does not have IORING_OP_READ_MULTISHOT. Single reads are armed again after each completion
+    // then.
+    bool multishot = true;
+    std::vector<std::unique_ptr<Connection>> connections;
+    // Every read of the compiler output is done in this with IOEngine::EPOLL.
+    std::vector<char> readBuffer;
+    // Destroyed before the connections, as the running tasks point to these.
+    std::unique_ptr<Workers> workers;
+
+    explicit IPCServerBS(IOEngine engine_);
+    void closeConnection(Connection &connection, const std::string &error);
+    void dispatch(Connection &connection, std::string_view message);
+    void frameMessages(Connection &connection);
+    void receiveOutput(Connection &connection, const char *data, uint32_t size);
+    void endOutput(Connection &connection);
+    void readOutput(Connection &connection);
+    void receiveDatagram(Connection &connection);
+    void receiveReplies();
+    // Queues the replies of the finished tasks of the connection in order.
+    void writeReplies(Connection &connection);
+    // IOEngine::EPOLL. Writes the queued replies till the manager.writeFd is full, and waits for it to be writable
+    // then.
+    void flushReplies(Connection &connection);
+    // Returns false if the manager.writeFd is full.
+    [[nodiscard]] tl::expected<bool, std::string> writeQueued(Connection &connection);
+    void armWrite(Connection &connection, bool arm);
+    [[nodiscard]] tl::expected<void, std::string> submitOperations();
+    void complete(const io_uring_cqe &cqe);
+    [[nodiscard]] tl::expected<void, std::string> pollRing(int32_t timeout);
+
+  public:
+    // Replies are built on workerCount threads with buildReply. If 0, these are built on the calling thread.
+    static tl::expected<IPCServerBS, std::string> create(IOEngine engine_ = IOEngine::EPOLL, uint32_t workerCount = 0);
+
+    // With IOEngine::EPOLL, outputFd and manager.writeFd are made non-blocking. In Framing::SEQPACKET mode, the
+    // build-system must have closed its copy of the compiler end of the socket, as otherwise the end of the connection
+    // is not detected.
+    [[nodiscard]] tl::expected<Connection *, std::string> addConnection(const IPCManagerBS &manager,
+                                                                        uint64_t outputFd);
+    // Waits at most timeout milliseconds, or indefinitely if -1, and processes the connections that are ready. With
+    // IOEngine::EPOLL, the replies sent from the callbacks are written at the end of the poll, and with
+    // IOEngine::IO_URING with the next one.
+    [[nodiscard]] tl::expected<void, std::string> poll(int32_t timeout);
+    // Calls build on a worker, so the other connections are served while it maps the BMI files. build must copy the
+    // strings of the message it replies to, as these are only valid in the callback. Replies of a connection are
+    // written in the order of these calls, so while one of its replies is on a worker, the connection must be replied
+    // to only with this. In Framing::SEQPACKET mode, build sends one message. In WireFormat::V1_INTERNED, the strings
+    // of the replies built on a worker are sent in full, as only Connection::manager interns these.
+    void buildReply(Connection &connection, ReplyBuilder build);
+    // Polls till all the connections are closed.
+    [[nodiscard]] tl::expected<void, std::string> run();
+    [[nodiscard]] uint32_t getConnectionCount() const;
+    // Stops the workers and closes the epoll file descriptor or the io_uring. Connections that are not closed yet are
+    // dropped without onClose. Called by the destructor if not called before.
+    [[nodiscard]] tl::expected<void, std::string> close();
+
+    IPCServerBS(IPCServerBS &&) = default;
+    IPCServerBS &operator=(IPCServerBS &&) = delete;
+    ~IPCServerBS();
+};
+#endif
+} // namespace P2978
+#endif // IPC_SERVER_BS_HPP
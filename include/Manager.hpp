@@ -8,6 +8,10 @@
 #include <string>
 #include <vector>
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
 namespace tl
 {
 template <typename T, typename U> class expected;
@@ -21,6 +25,42 @@ inline const char *delimiter = "DELIMITER"
                                "\x5A\xA5\x5A\xA5\x5A\xA5\x5A\xA5\x5A\xA5\x5A\xA5\x5A\xA5"
                                "DELIMITER";
 
+// In Framing::LENGTH_PREFIXED mode, every BTC message is preceded by this header. 4 bytes hold the payload size and
+// are followed by 1 byte of BTC type.
+inline constexpr uint32_t frameHeaderSize = 5;
+
+enum class Framing : uint8_t
+{
+    // Every message is followed by its 4 bytes payload size and the delimiter. Compiler reads its stdin until a
+    // delimiter preceded by the size of the bytes before it is received.
+    DELIMITER,
+    // Every BTC message is preceded by the frame header, so the compiler reads the payload in one exactly-sized read.
+    // CTB messages are still followed by payload size and delimiter as they are interleaved with the compiler output.
+    LENGTH_PREFIXED,
+    // Messages in both directions are sent as datagrams on a SOCK_SEQPACKET socket that the build-system creates with
+    // socketpair and passes to the compiler. Kernel preserves the message boundaries, so there is no header or
+    // delimiter and the compiler output is not interleaved with the messages. Not supported on Windows.
+    SEQPACKET,
+    // Messages in both directions are sent through the shared memory rings of the SharedMemoryChannel. Not supported on
+    // Windows.
+    SHARED_MEMORY,
+};
+
+// Encoding of the BTCModule and BTCNonModule payloads. Must be same on both sides.
+enum class WireFormat : uint8_t
+{
+    // Fields are written back-to-back in declaration order and are parsed sequentially.
+    V1,
+    // Aligned records with offsets, see FlatMessages.hpp.
+    V2,
+    // V1, but the strings are sent as the tokens of the per-connection SessionDictionary, so a repeated path or
+    // logical-name takes a few bytes.
+    V1_INTERNED,
+    // V1, but the requests, header-files and dependencies also have the hashed flag, followed by the hashLogicalName of
+    // their logical-names if it is set, so the receiver does not hash these again.
+    V1_HASHED,
+};
+
 enum class ErrorCategory : uint8_t
 {
     NONE,
@@ -30,6 +70,12 @@ enum class ErrorCategory : uint8_t
     READ_FILE_ZERO_BYTES_READ,
     INCORRECT_BTC_LAST_MESSAGE,
     UNKNOWN_CTB_TYPE,
+    UNEXPECTED_BTC_TYPE,
+    CHANNEL_CLOSED,
+    UNSUPPORTED_FRAMING,
+    MODULE_CYCLE,
+    UNKNOWN_BMI_FILE,
+    BMI_FILE_TOO_LARGE,
 };
 
 std::string getErrorString();
@@ -50,6 +96,67 @@ struct Mapping
 #endif
 };
 
+// How the pages of a BMI file-mapping are read in. Ignored on Windows.
+enum class PagePolicy : uint8_t
+{
+    // Whole file is read before the mapping is returned (MAP_POPULATE).
+    POPULATE,
+    // Pages are read on the first access.
+    NONE,
+    // Kernel starts reading the whole file in the background (MADV_WILLNEED).
+    WILL_NEED,
+    // Pages are read ahead aggressively and the ones behind are freed early (MADV_SEQUENTIAL).
+    SEQUENTIAL,
+    // Only the accessed pages are read (MADV_RANDOM).
+    RANDOM,
+    // Mapping is aligned to 2MB and has MADV_HUGEPAGE, so the page-cache of the file can be mapped with huge pages.
+    HUGE_PAGE,
+};
+
+// Policy of the BMI file-mappings of the process, for the calls that are not passed one.
+inline PagePolicy defaultPagePolicy = PagePolicy::POPULATE;
+
+#ifndef _WIN32
+// Maps fileSize bytes of fd read-only as per the policy. fd can be closed after.
+tl::expected<Mapping, std::string> mapFile(int fd, uint32_t fileSize, PagePolicy policy);
+#endif
+
+// Message serialized as a list of segments for the gather-write. Scalars and small strings are copied in the scratch,
+// while larger strings point to the caller's memory, which must stay valid till the message is written.
+class GatherBuffer
+{
+    struct Segment
+    {
+        // If nullptr, segment is in the scratch at the offset.
+        const char *data;
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    std::string scratch;
+    std::vector<Segment> segments;
+
+  public:
+    // Copying a smaller string is cheaper than the kernel processing one more iovec.
+    static constexpr uint32_t copyThreshold = 128;
+
+    uint32_t size = 0;
+
+    // Reserves the scratch for count more bytes.
+    void reserve(uint32_t count);
+    void append(const char *bytes, uint32_t count);
+    void push_back(char c);
+    // Copied if smaller than copyThreshold.
+    void appendReference(std::string_view str);
+    // Overwrites the already appended bytes at the offset. Used for the frame header. Segments of appendReference are
+    // copied in the scratch before these are written, so the referenced strings are not modified.
+    void overwrite(uint32_t offset, const char *bytes, uint32_t count);
+    void flatten(std::string &buffer) const;
+#ifndef _WIN32
+    void getIovecs(std::vector<iovec> &iovecs) const;
+#endif
+};
+
 class Manager
 {
   public:
@@ -57,25 +164,36 @@ class Manager
     virtual ~Manager() = default;
 #ifndef _WIN32
     static tl::expected<void, std::string> writeAll(const int fd, const char *buffer, const uint32_t count);
+    // Writes all the iovecs, in batches of IOV_MAX. iovecs are modified on partial writes.
+    static tl::expected<void, std::string> writevAll(int fd, iovec *iovecs, uint32_t count);
+
+    // Framing::SEQPACKET messages are split in datagrams of at most maxDatagramSize bytes, so these are within the
+    // default socket buffer size. Every datagram is preceded by 1 byte telling whether more datagrams of the message
+    // follow. Most messages fit in one datagram.
+    static constexpr uint32_t maxDatagramSize = 64 * 1024;
+    static tl::expected<void, std::string> sendDatagrams(int fd, std::string_view message);
+    // Appends the datagrams of the message to the queue, each preceded by its 4 bytes size, so these can be sent later
+    // one send each without blocking.
+    static void appendDatagrams(std::string &queue, std::string_view message);
+    // Returned string_view points into the buffer.
+    static tl::expected<std::string_view, std::string> receiveDatagrams(int fd, std::string &buffer);
 #endif
 
-    static std::string getBufferWithType(CTB type);
+    // Buffer is reserved for the whole message of payloadSize.
+    static std::string getBufferWithType(CTB type, uint64_t payloadSize);
     static void writeUInt32(std::string &buffer, uint32_t value);
+    static void writeUInt32(GatherBuffer &buffer, uint32_t value);
+    static void writeUInt64(std::string &buffer, uint64_t value);
+    static void writeUInt64(GatherBuffer &buffer, uint64_t value);
     static void writeString(std::string &buffer, const std::string_view &str);
+    static void writeString(GatherBuffer &buffer, const std::string_view &str);
     // path is used in system calls. so it is followed by null character while the normal string is not.
     static void writePath(std::string &buffer, const std::string_view &str);
-    static void writeBMIFile(std::string &buffer, const BMIFile &file);
-    static void writeModuleDep(std::string &buffer, const ModuleDep &dep);
-    static void writeHuDep(std::string &buffer, const HuDep &dep);
-    static void writeHeaderFile(std::string &buffer, const HeaderFile &dep);
-    static void writeVectorOfStrings(std::string &buffer, const std::vector<std::string_view> &strs);
-    static void writeVectorOfProcessMappingOfBMIFiles(std::string &buffer, const std::vector<BMIFile> &files);
-    static void writeVectorOfModuleDep(std::string &buffer, const std::vector<ModuleDep> &deps);
-    static void writeVectorOfHuDeps(std::string &buffer, const std::vector<HuDep> &deps);
-    static void writeVectorOfHeaderFiles(std::string &buffer, const std::vector<HeaderFile> &headerFiles);
+    static void writePath(GatherBuffer &buffer, const std::string_view &str);
 
     static tl::expected<bool, std::string> readBool(std::string_view message, uint32_t &bytesRead);
     static tl::expected<uint32_t, std::string> readUInt32(std::string_view message, uint32_t &bytesRead);
+    static tl::expected<uint64_t, std::string> readUInt64(std::string_view message, uint32_t &bytesRead);
     static tl::expected<std::string_view, std::string> readString(std::string_view message, uint32_t &bytesRead);
 
     // path is used in system calls. so it is followed by null character while the normal string is not.
@@ -94,6 +212,15 @@ template <typename T> T &getInitializedObjectFromBuffer(char (&buffer)[320])
     return t;
 }
 
+// rapidhash of the logical-name, as sent with it if the message is hashed.
+uint64_t hashLogicalName(std::string_view logicalName);
+// Appends the hashes of the names.
+void hashLogicalNames(const std::vector<std::string_view> &names, std::vector<uint64_t> &hashes);
+// Sets the hashes of all the logical-names of the reply, so the compiler does not hash these. Called by the
+// build-system once per reply, e.g. before it is serialized for the ReplyCache.
+void hashLogicalNames(BTCModule &reply);
+void hashLogicalNames(BTCNonModule &reply);
+
 inline std::string to16charHexString(const uint64_t v)
 {
     static auto lut = "0123456789abcdef";
@@ -15,6 +15,9 @@ namespace P2978
 // string_view representing the filePath is followed by null terminator.
 // vector is 4 bytes that hold the size of the array, followed by the array.
 // All fields are sent in declaration order, even if meaningless.
+// In WireFormat::V1_HASHED, logical-names might be followed by their rapidhash (hashLogicalName), so the receiver does
+// not hash them again. The hash or the hashes are only sent if hashed is set. In other wire formats, neither hashed nor
+// the hashes are sent.
 
 // Compiler to Build System
 // This is the first byte of the compiler to build-system message.
@@ -23,12 +26,16 @@ enum class CTB : uint8_t
     MODULE = 0,
     NON_MODULE = 1,
     LAST_MESSAGE = 2,
+    BATCH = 3,
+    PREFETCH = 4,
 };
 
 // This is sent when the compiler needs a module.
 struct CTBModule
 {
     std::string_view moduleName;
+    bool hashed = false;
+    uint64_t hash = 0;
 };
 
 // This is sent when the compiler needs something else than a module.
@@ -37,6 +44,8 @@ struct CTBNonModule
 {
     bool isHeaderUnit = false;
     std::string_view logicalName;
+    bool hashed = false;
+    uint64_t hash = 0;
 };
 
 // This is the last message sent by the compiler if the compiler
@@ -48,16 +57,47 @@ struct CTBLastMessage
     // and Linux without a filesystem call.
     // Meaningless if the compilation does not produce BMI.
     uint32_t fileSize = UINT32_MAX;
+    // rapidhash of the BMI file, so the build-system can deduplicate the BMI files without reading these.
+    bool hashed = false;
+    uint64_t hash = 0;
+};
+
+// This is sent when the compiler needs multiple files at once. Replied with one BTCBatch, so the files are resolved in
+// one round trip. As it is constructed in the ctbBuffer, the build-system should destroy it after use.
+struct CTBBatch
+{
+    std::vector<CTBModule> modules;
+    std::vector<CTBNonModule> nonModules;
+};
+
+// This is sent by IPCManagerCompiler::prefetch. Compiler does not wait for the reply and might send more requests
+// before it. So, in Framing::DELIMITER and Framing::LENGTH_PREFIXED modes, one read of the compiler output might have
+// more than one message.
+struct CTBPrefetch
+{
+    uint32_t requestId = 0;
+    bool isModule = false;
+    // Meaningless if isModule.
+    bool isHeaderUnit = false;
+    std::string_view logicalName;
+    bool hashed = false;
+    uint64_t hash = 0;
 };
 
 // Build System to Compiler
 // Unlike CTB, this is not written as the first byte
 // since the compiler knows what message it will receive.
+// In Framing::LENGTH_PREFIXED mode, it is written in the frame header
+// that precedes the message.
 enum class BTC : uint8_t
 {
     MODULE = 0,
     NON_MODULE = 1,
     LAST_MESSAGE = 2,
+    BATCH = 3,
+    // Reply for CTBPrefetch. It is the 4 bytes requestId of the request followed by the BTCModule or BTCNonModule.
+    // Replies might be sent in any order.
+    PREFETCH = 4,
 };
 
 struct BMIFile
@@ -72,6 +112,9 @@ struct ModuleDep
     BMIFile file;
     // whether header-unit / module belongs to system (ignore warnings).
     bool isSystem = true;
+    // Hashes of the logicalNames. Sent before these, so the compiler inserts every name as it is read.
+    bool hashed = false;
+    std::vector<uint64_t> logicalNameHashes;
     // if isHeaderUnit == true, then the following might
     // contain more than one values, as header-unit can be
     // composed of multiple header-files. And if later,
@@ -93,6 +136,8 @@ struct HuDep
     BMIFile file;
     // whether header-unit / header-file belongs to system (ignore warnings).
     bool isSystem = true;
+    bool hashed = false;
+    std::vector<uint64_t> logicalNameHashes;
     // A header-unit can be composed of
     // multiple header-files. And if later,
     // any of the following logicalNames is included or
@@ -105,6 +150,8 @@ struct HeaderFile
     std::string_view logicalName;
     std::string_view filePath;
     bool isSystem = true;
+    bool hashed = false;
+    uint64_t hash = 0;
 };
 
 // Reply for CTBNonModule
@@ -120,6 +167,9 @@ struct BTCNonModule
     // if isHeaderUnit == false, the following are meaning-less and are not sent.
     // if isHeaderUnit == true, fileSize of the requested file.
     uint32_t fileSize;
+    // Must only be set if isHeaderUnit.
+    bool hashed = false;
+    std::vector<uint64_t> logicalNameHashes;
     // A header-unit can be composed of
     // multiple header-files. And if later,
     // any of the following logicalNames is included or
@@ -128,6 +178,14 @@ struct BTCNonModule
     std::vector<HuDep> huDeps;
 };
 
+// Reply for CTBBatch. Replies are in the same order as the requests. In WireFormat::V2, every reply is preceded by
+// its 4 bytes size and is padded to the 4 bytes alignment.
+struct BTCBatch
+{
+    std::vector<BTCModule> modules;
+    std::vector<BTCNonModule> nonModules;
+};
+
 // Reply for CTBLastMessage if the compilation succeeded.
 struct BTCLastMessage
 {
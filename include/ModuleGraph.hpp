@@ -0,0 +1,106 @@
+#ifndef MODULE_GRAPH_HPP
+#define MODULE_GRAPH_HPP
+
+#include "Messages.hpp"
+#include "expected.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace P2978
+{
+
+struct ModuleGraphStats
+{
+    uint32_t modules;
+    // Closures that are computed and not stale.
+    uint32_t closures;
+    // Distinct closures among these. Modules with the same closure share one.
+    uint32_t distinctClosures;
+};
+
+// Above fullClosureLimit modules, only the direct dependencies are sent, unless the closure is at most maxExpansion
+// times the direct dependencies. Compiler asks for the rest of the modules when it needs these.
+struct ModuleGraphPolicy
+{
+    uint32_t fullClosureLimit = 512;
+    uint32_t maxExpansion = 16;
+    // Sets the hashes of the logical-names, which the graph computes once per name. Only sent in WireFormat::V1_HASHED.
+    bool hashNames = false;
+};
+
+// Module DAG of the build-system that keeps the transitive closure of every module for BTCModule::modDeps. Closures are
+// bitsets over the module ids. A closure is the union of the closures of the direct dependencies, so it is computed in
+// O(dependencies * modules / 64) once and is reused by every request and by the closures of the dependents. Changing
+// the dependencies of a module only marks its closure and the closures of its dependents as stale, and these are
+// recomputed on the next request. Equal closures are shared. Not thread safe.
+class ModuleGraph
+{
+    // Only the bits are kept. Ids are read from these while the reply is filled, so a closure costs a bit per module
+    // and the closures of the dependencies are shared instead of being copied as id lists.
+    struct Closure
+    {
+        // Trailing zero words are trimmed, so equal sets have equal bits.
+        std::vector<uint64_t> bits;
+        // Set bits.
+        uint32_t size = 0;
+    };
+
+    struct Module
+    {
+        // Logical names of a header-unit, or the module name.
+        std::vector<std::string> logicalNames;
+        // hashLogicalName of the logicalNames.
+        std::vector<uint64_t> logicalNameHashes;
+        std::string filePath;
+        uint32_t fileSize = UINT32_MAX;
+        bool isHeaderUnit = false;
+        bool isSystem = true;
+        std::vector<uint32_t> dependencies;
+        std::vector<uint32_t> dependents;
+        // nullptr if stale.
+        std::shared_ptr<const Closure> closure;
+        // Set while its closure is being computed, to detect the cycles.
+        bool computing = false;
+    };
+
+    std::vector<Module> modules;
+    std::map<std::string, uint32_t, std::less<>> ids;
+    // Closures by the hash of their bits.
+    std::unordered_multimap<uint64_t, std::weak_ptr<const Closure>> interned;
+
+    // Computes the stale closures of the module and its dependencies depth-first with an explicit stack, so a deep
+    // chain of imports does not overflow the call stack.
+    [[nodiscard]] tl::expected<const Closure *, std::string> getClosure(uint32_t id);
+    // Closure of the module from the closures of its direct dependencies, which are computed already.
+    void computeClosure(uint32_t id);
+    void markStale(uint32_t id);
+    void fillModuleDep(uint32_t id, ModuleDep &dep, bool hashNames) const;
+
+  public:
+    static constexpr uint32_t invalidId = UINT32_MAX;
+
+    // Returns the id of the module, adding it if it is not known. A header-unit is added with its first logical name.
+    uint32_t addModule(std::string_view logicalName, bool isHeaderUnit = false);
+    [[nodiscard]] uint32_t findModule(std::string_view logicalName) const;
+    // Another logical name that the header-unit can be imported with.
+    void addLogicalName(uint32_t id, std::string_view logicalName);
+    // Called once the BMI is built.
+    void setBMI(uint32_t id, std::string_view filePath, uint32_t fileSize, bool isSystem);
+    // Replaces the direct dependencies. Closures of the module and its dependents are recomputed on the next request.
+    void setDependencies(uint32_t id, const std::vector<uint32_t> &dependencies);
+
+    // Number of modules in the transitive closure, without the module itself.
+    [[nodiscard]] tl::expected<uint32_t, std::string> getClosureSize(uint32_t id);
+    // Fills requested and modDeps of the reply as per the policy. Returns false if only the direct dependencies were
+    // filled. Strings of the reply point into the graph and are valid till it is modified.
+    [[nodiscard]] tl::expected<bool, std::string> fillReply(uint32_t id, BTCModule &reply,
+                                                            const ModuleGraphPolicy &policy = {});
+    [[nodiscard]] ModuleGraphStats getStats() const;
+};
+} // namespace P2978
+#endif // MODULE_GRAPH_HPP
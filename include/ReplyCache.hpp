@@ -0,0 +1,71 @@
+#ifndef REPLY_CACHE_HPP
+#define REPLY_CACHE_HPP
+
+#include "Manager.hpp"
+#include "Messages.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace P2978
+{
+
+struct ReplyCacheStats
+{
+    uint32_t entries;
+    uint64_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+};
+
+// Serialized replies shared by all the compilations of the build. Many compilations request the same module or
+// header-unit, so its reply is serialized once with IPCManagerBS::serializeReply and every later request is answered
+// by IPCManagerBS::sendSerializedReply with the same immutable payload. Replies carry the size of every BMI file in
+// them, so these are invalidated once any of those BMI files is rebuilt. Thread safe.
+class ReplyCache
+{
+  public:
+    using Payload = std::shared_ptr<const std::string>;
+
+  private:
+    struct Entry
+    {
+        Payload payload;
+        // BMI files in the reply. Keys of the entry in byBMI.
+        std::vector<std::string> bmiPaths;
+    };
+
+    mutable std::mutex mutex;
+    std::map<std::string, Entry, std::less<>> entries;
+    // Keys of the replies that have the BMI file.
+    std::map<std::string, std::vector<std::string>, std::less<>> byBMI;
+    uint64_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+
+    Payload insert(std::string key, std::string payload, std::vector<std::string> bmiPaths);
+    void erase(std::map<std::string, Entry, std::less<>>::iterator it);
+
+  public:
+    // Payload depends on the WireFormat as well, so it is part of the key.
+    static std::string getKey(const CTBModule &request, WireFormat wireFormat);
+    static std::string getKey(const CTBNonModule &request, WireFormat wireFormat);
+
+    // nullptr if not cached.
+    [[nodiscard]] Payload find(std::string_view key);
+    // Replaces the payload if the key is cached already. reply is the one serialized in payload.
+    Payload insert(std::string key, std::string payload, const BTCModule &reply);
+    Payload insert(std::string key, std::string payload, const BTCNonModule &reply);
+    // Called once the BMI file is rebuilt. Replies that have it are dropped. Payloads that are being sent stay valid.
+    void invalidate(std::string_view bmiPath);
+    void clear();
+    [[nodiscard]] ReplyCacheStats getStats() const;
+};
+} // namespace P2978
+#endif // REPLY_CACHE_HPP
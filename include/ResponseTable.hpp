@@ -0,0 +1,83 @@
+#ifndef RESPONSE_TABLE_HPP
+#define RESPONSE_TABLE_HPP
+
+#include "Manager.hpp"
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace P2978
+{
+
+enum class FileType : uint8_t
+{
+    MODULE,
+    HEADER_UNIT,
+    HEADER_FILE
+};
+
+struct Response
+{
+    std::string_view filePath;
+    // if type == HEADER_FILE, then fileSize has no meaning
+    Mapping mapping;
+    FileType type;
+    bool isSystem;
+    Response(std::string_view filePath_, const Mapping &mapping_, FileType type_, bool isSystem_);
+};
+
+// Cache of the responses of the IPCManagerCompiler, keyed by the logical-name. It is an open-addressing table with
+// linear probing, whose slots are kept in separate arrays, so a probe reads the control bytes and only compares the
+// keys whose hash matches. Responses are stored apart from the slots, so all the logical-names of a BMI file refer to
+// one response. Hashes are the hashLogicalName of the logical-name, so the ones received with the reply are used as is.
+// Keys are not copied and must outlive the table.
+class ResponseTable
+{
+    static constexpr uint8_t emptySlot = 0;
+    static constexpr uint8_t erasedSlot = 1;
+    // Full slots have the high bit set and the 7 high bits of the hash in the low bits.
+    std::vector<uint8_t> control;
+    std::vector<uint64_t> hashes;
+    std::vector<std::string_view> keys;
+    std::vector<uint32_t> indices;
+    std::vector<Response> responses;
+    uint32_t size = 0;
+    uint32_t erased = 0;
+
+    // Returns the slot of the key, or UINT32_MAX if it is not in the table.
+    [[nodiscard]] uint32_t findSlot(std::string_view key, uint64_t hash) const;
+    void rehash(uint32_t capacity);
+
+  public:
+    static uint64_t hash(std::string_view key);
+
+    // Makes room for count more keys, so these are inserted without a rehash. Called with the counts in the reply
+    // before its logical-names are inserted.
+    void reserve(uint32_t count);
+    // Returns the index that the keys of the response are inserted with.
+    uint32_t addResponse(const Response &response);
+    // Reference is valid till the next addResponse.
+    [[nodiscard]] Response &getResponse(uint32_t index);
+
+    [[nodiscard]] Response *find(std::string_view key);
+    [[nodiscard]] Response *find(std::string_view key, uint64_t hash);
+    // key must not be in the table.
+    void insert(std::string_view key, uint64_t hash, uint32_t index);
+    // Returns the response of the erased key, or nullptr if the key is not in the table. The response is not freed.
+    Response *erase(std::string_view key);
+    [[nodiscard]] uint32_t getSize() const;
+
+    template <typename Function> void forEach(Function &&function) const
+    {
+        for (uint32_t i = 0; i < control.size(); ++i)
+        {
+            if (control[i] & 0x80)
+            {
+                function(keys[i], responses[indices[i]]);
+            }
+        }
+    }
+};
+} // namespace P2978
+#endif // RESPONSE_TABLE_HPP
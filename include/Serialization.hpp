@@ -0,0 +1,354 @@
+#ifndef SERIALIZATION_HPP
+#define SERIALIZATION_HPP
+
+#include "Manager.hpp"
+#include "Messages.hpp"
+#include "SessionDictionary.hpp"
+#include "expected.hpp"
+
+#include <tuple>
+#include <type_traits>
+
+namespace P2978
+{
+
+// Wire format of every message struct is described once in Schema<T>::fields, a tuple of the fields in the order they
+// are sent. serializedSize, serialize and deserialize are generated from it at compile-time. If the dictionary is
+// passed, the strings are written and read as its tokens (WireFormat::V1_INTERNED). The hash fields are only written
+// and read in WireFormat::V1_HASHED.
+
+enum class Encoding : uint8_t
+{
+    DEFAULT,
+    // string_view followed by the null character.
+    PATH,
+};
+
+template <typename Class, typename Member, Encoding encoding_ = Encoding::DEFAULT> struct Field
+{
+    static constexpr Encoding encoding = encoding_;
+    Member Class::*member;
+    // If not nullptr, the field is only sent if this is true. It must be sent before this field.
+    bool Class::*condition;
+    // If set, the field is only sent in WireFormat::V1_HASHED.
+    bool hashedOnly = false;
+};
+
+template <typename Class, typename Member>
+constexpr Field<Class, Member> field(Member Class::*member, bool Class::*condition = nullptr)
+{
+    return {member, condition};
+}
+
+template <typename Class>
+constexpr Field<Class, std::string_view, Encoding::PATH> pathField(std::string_view Class::*member)
+{
+    return {member, nullptr};
+}
+
+template <typename Class, typename Member>
+constexpr Field<Class, Member> hashField(Member Class::*member, bool Class::*condition = nullptr)
+{
+    return {member, condition, true};
+}
+
+template <typename T> struct Schema;
+
+template <> struct Schema<CTBModule>
+{
+    static constexpr auto fields = std::make_tuple(field(&CTBModule::moduleName), hashField(&CTBModule::hashed),
+                                                   hashField(&CTBModule::hash, &CTBModule::hashed));
+};
+
+template <> struct Schema<CTBNonModule>
+{
+    static constexpr auto fields =
+        std::make_tuple(field(&CTBNonModule::isHeaderUnit), field(&CTBNonModule::logicalName),
+                        hashField(&CTBNonModule::hashed), hashField(&CTBNonModule::hash, &CTBNonModule::hashed));
+};
+
+template <> struct Schema<CTBLastMessage>
+{
+    static constexpr auto fields =
+        std::make_tuple(field(&CTBLastMessage::fileSize), hashField(&CTBLastMessage::hashed),
+                        hashField(&CTBLastMessage::hash, &CTBLastMessage::hashed));
+};
+
+template <> struct Schema<CTBBatch>
+{
+    static constexpr auto fields = std::make_tuple(field(&CTBBatch::modules), field(&CTBBatch::nonModules));
+};
+
+template <> struct Schema<CTBPrefetch>
+{
+    static constexpr auto fields =
+        std::make_tuple(field(&CTBPrefetch::requestId), field(&CTBPrefetch::isModule),
+                        field(&CTBPrefetch::isHeaderUnit), field(&CTBPrefetch::logicalName),
+                        hashField(&CTBPrefetch::hashed), hashField(&CTBPrefetch::hash, &CTBPrefetch::hashed));
+};
+
+template <> struct Schema<BMIFile>
+{
+    static constexpr auto fields = std::make_tuple(pathField(&BMIFile::filePath), field(&BMIFile::fileSize));
+};
+
+template <> struct Schema<ModuleDep>
+{
+    static constexpr auto fields = std::make_tuple(
+        field(&ModuleDep::isHeaderUnit), field(&ModuleDep::file), field(&ModuleDep::isSystem),
+        hashField(&ModuleDep::hashed), hashField(&ModuleDep::logicalNameHashes, &ModuleDep::hashed),
+        field(&ModuleDep::logicalNames));
+};
+
+template <> struct Schema<BTCModule>
+{
+    static constexpr auto fields =
+        std::make_tuple(field(&BTCModule::requested), field(&BTCModule::isSystem), field(&BTCModule::modDeps));
+};
+
+template <> struct Schema<HuDep>
+{
+    static constexpr auto fields =
+        std::make_tuple(field(&HuDep::file), field(&HuDep::isSystem), hashField(&HuDep::hashed),
+                        hashField(&HuDep::logicalNameHashes, &HuDep::hashed), field(&HuDep::logicalNames));
+};
+
+template <> struct Schema<HeaderFile>
+{
+    static constexpr auto fields =
+        std::make_tuple(field(&HeaderFile::logicalName), pathField(&HeaderFile::filePath), field(&HeaderFile::isSystem),
+                        hashField(&HeaderFile::hashed), hashField(&HeaderFile::hash, &HeaderFile::hashed));
+};
+
+template <> struct Schema<BTCNonModule>
+{
+    static constexpr auto fields = std::make_tuple(
+        field(&BTCNonModule::isHeaderUnit), field(&BTCNonModule::isSystem), field(&BTCNonModule::headerFiles),
+        pathField(&BTCNonModule::filePath), field(&BTCNonModule::fileSize, &BTCNonModule::isHeaderUnit),
+        hashField(&BTCNonModule::hashed, &BTCNonModule::isHeaderUnit),
+        hashField(&BTCNonModule::logicalNameHashes, &BTCNonModule::hashed),
+        field(&BTCNonModule::logicalNames, &BTCNonModule::isHeaderUnit),
+        field(&BTCNonModule::huDeps, &BTCNonModule::isHeaderUnit));
+};
+
+template <> struct Schema<BTCBatch>
+{
+    static constexpr auto fields = std::make_tuple(field(&BTCBatch::modules), field(&BTCBatch::nonModules));
+};
+
+template <typename T> uint64_t serializedSize(const T &t, WireFormat wireFormat = WireFormat::V1);
+template <typename Buffer, typename T>
+void serialize(Buffer &buffer, const T &t, SessionDictionary *dictionary = nullptr,
+               WireFormat wireFormat = WireFormat::V1);
+template <typename T>
+tl::expected<void, std::string> deserialize(std::string_view message, uint32_t &bytesRead, T &t,
+                                            SessionDictionary *dictionary = nullptr,
+                                            WireFormat wireFormat = WireFormat::V1);
+
+namespace detail
+{
+template <typename T> struct IsVector : std::false_type
+{
+};
+template <typename T> struct IsVector<std::vector<T>> : std::true_type
+{
+};
+
+template <Encoding encoding, typename T> uint64_t valueSize(const T &value, const WireFormat wireFormat)
+{
+    if constexpr (std::is_same_v<T, bool>)
+    {
+        return 1;
+    }
+    else if constexpr (std::is_same_v<T, uint32_t>)
+    {
+        return 4;
+    }
+    else if constexpr (std::is_same_v<T, uint64_t>)
+    {
+        return 8;
+    }
+    else if constexpr (std::is_same_v<T, std::string_view>)
+    {
+        return 4 + value.size() + (encoding == Encoding::PATH);
+    }
+    else if constexpr (IsVector<T>::value)
+    {
+        uint64_t size = 4;
+        for (const auto &element : value)
+        {
+            size += valueSize<Encoding::DEFAULT>(element, wireFormat);
+        }
+        return size;
+    }
+    else
+    {
+        return serializedSize(value, wireFormat);
+    }
+}
+
+template <Encoding encoding, typename Buffer, typename T>
+void writeValue(Buffer &buffer, const T &value, SessionDictionary *dictionary, const WireFormat wireFormat)
+{
+    if constexpr (std::is_same_v<T, bool>)
+    {
+        buffer.push_back(value);
+    }
+    else if constexpr (std::is_same_v<T, uint32_t>)
+    {
+        Manager::writeUInt32(buffer, value);
+    }
+    else if constexpr (std::is_same_v<T, uint64_t>)
+    {
+        Manager::writeUInt64(buffer, value);
+    }
+    else if constexpr (std::is_same_v<T, std::string_view>)
+    {
+        if (dictionary)
+        {
+            dictionary->write(buffer, value, encoding == Encoding::PATH);
+        }
+        else if constexpr (encoding == Encoding::PATH)
+        {
+            Manager::writePath(buffer, value);
+        }
+        else
+        {
+            Manager::writeString(buffer, value);
+        }
+    }
+    else if constexpr (IsVector<T>::value)
+    {
+        Manager::writeUInt32(buffer, value.size());
+        for (const auto &element : value)
+        {
+            writeValue<Encoding::DEFAULT>(buffer, element, dictionary, wireFormat);
+        }
+    }
+    else
+    {
+        serialize(buffer, value, dictionary, wireFormat);
+    }
+}
+
+template <Encoding encoding, typename T>
+tl::expected<void, std::string> readValue(const std::string_view message, uint32_t &bytesRead, T &value,
+                                          SessionDictionary *dictionary, const WireFormat wireFormat)
+{
+    if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, uint32_t> || std::is_same_v<T, uint64_t> ||
+                  std::is_same_v<T, std::string_view>)
+    {
+        tl::expected<T, std::string> r;
+        if constexpr (std::is_same_v<T, bool>)
+        {
+            r = Manager::readBool(message, bytesRead);
+        }
+        else if constexpr (std::is_same_v<T, uint32_t>)
+        {
+            r = Manager::readUInt32(message, bytesRead);
+        }
+        else if constexpr (std::is_same_v<T, uint64_t>)
+        {
+            r = Manager::readUInt64(message, bytesRead);
+        }
+        else if (dictionary)
+        {
+            r = dictionary->read(message, bytesRead, encoding == Encoding::PATH);
+        }
+        else if constexpr (encoding == Encoding::PATH)
+        {
+            r = Manager::readPath(message, bytesRead);
+        }
+        else
+        {
+            r = Manager::readString(message, bytesRead);
+        }
+        if (!r)
+        {
+            return tl::unexpected(r.error());
+        }
+        value = *r;
+        return {};
+    }
+    else if constexpr (IsVector<T>::value)
+    {
+        const auto &r = Manager::readUInt32(message, bytesRead);
+        if (!r)
+        {
+            return tl::unexpected(r.error());
+        }
+        // Every element is at least 1 byte. This protects against reserving for a corrupt count.
+        if (*r > message.size() - bytesRead)
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+        }
+        value.resize(*r);
+        for (auto &element : value)
+        {
+            if (const auto &r2 = readValue<Encoding::DEFAULT>(message, bytesRead, element, dictionary, wireFormat); !r2)
+            {
+                return tl::unexpected(r2.error());
+            }
+        }
+        return {};
+    }
+    else
+    {
+        return deserialize(message, bytesRead, value, dictionary, wireFormat);
+    }
+}
+
+template <typename Class, typename FieldT> bool isSent(const Class &t, const FieldT &f, const WireFormat wireFormat)
+{
+    return (!f.hashedOnly || wireFormat == WireFormat::V1_HASHED) && (!f.condition || t.*f.condition);
+}
+} // namespace detail
+
+// Exact size of the serialized t. Buffers can be reserved with it once. With the dictionary, it is only an estimate.
+template <typename T> uint64_t serializedSize(const T &t, const WireFormat wireFormat)
+{
+    return std::apply(
+        [&](const auto &...fields) {
+            return (uint64_t{0} + ... +
+                    (detail::isSent(t, fields, wireFormat)
+                         ? detail::valueSize<std::decay_t<decltype(fields)>::encoding>(t.*fields.member, wireFormat)
+                         : 0));
+        },
+        Schema<T>::fields);
+}
+
+// Buffer is either std::string or GatherBuffer.
+template <typename Buffer, typename T>
+void serialize(Buffer &buffer, const T &t, SessionDictionary *dictionary, const WireFormat wireFormat)
+{
+    std::apply(
+        [&](const auto &...fields) {
+            ((detail::isSent(t, fields, wireFormat)
+                  ? detail::writeValue<std::decay_t<decltype(fields)>::encoding>(buffer, t.*fields.member,
+                                                                                 dictionary, wireFormat)
+                  : void()),
+             ...);
+        },
+        Schema<T>::fields);
+}
+
+// Reads t from the message starting at bytesRead. Every read is bounds-checked.
+template <typename T>
+tl::expected<void, std::string> deserialize(std::string_view message, uint32_t &bytesRead, T &t,
+                                            SessionDictionary *dictionary, const WireFormat wireFormat)
+{
+    tl::expected<void, std::string> result;
+    std::apply(
+        [&](const auto &...fields) {
+            (void)(((result = detail::isSent(t, fields, wireFormat)
+                                  ? detail::readValue<std::decay_t<decltype(fields)>::encoding>(
+                                        message, bytesRead, t.*fields.member, dictionary, wireFormat)
+                                  : tl::expected<void, std::string>{}) &&
+                    ...));
+        },
+        Schema<T>::fields);
+    return result;
+}
+
+} // namespace P2978
+#endif // SERIALIZATION_HPP
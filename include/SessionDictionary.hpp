@@ -0,0 +1,78 @@
+#ifndef SESSION_DICTIONARY_HPP
+#define SESSION_DICTIONARY_HPP
+
+#include "Manager.hpp"
+#include "StringArena.hpp"
+#include "expected.hpp"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace P2978
+{
+
+struct SessionDictionaryStats
+{
+    uint32_t entries = 0;
+    // Strings written or read as a reference to an entry.
+    uint64_t references = 0;
+    // Bytes of these strings that were not sent.
+    uint64_t bytesSaved = 0;
+};
+
+// Per-connection table of the strings of the WireFormat::V1_INTERNED replies. Build-system writes every string as a
+// varint token and the compiler reads it, so both sides build the same table over the connection:
+//   0: literal. Size and bytes follow. It is not added to the table.
+//   1: new entry. Size and bytes follow and the string gets the next id.
+//   2: new path entry. Token of its directory, up to the last separator, is followed by size and bytes of the
+//      file-name. So the paths in a directory share the directory entry.
+//   id + 3: string of the entry sent before.
+// Paths are followed by null character in the literal tokens as well.
+class SessionDictionary
+{
+    static constexpr uint64_t literalToken = 0;
+    static constexpr uint64_t entryToken = 1;
+    static constexpr uint64_t pathToken = 2;
+    static constexpr uint64_t firstReference = 3;
+
+    // Strings of the entries, kept as long as the dictionary.
+    StringArena arena;
+    // Build-system side. Keys point into the arena.
+    std::unordered_map<std::string_view, uint32_t> ids;
+    // Compiler side. By id.
+    std::vector<std::string_view> entries;
+    // Directory and file-name of a path are joined in it before it is saved.
+    std::string scratch;
+    SessionDictionaryStats stats;
+
+    template <typename Buffer> void writeToken(Buffer &buffer, std::string_view str, bool isPath);
+    tl::expected<std::string_view, std::string> readToken(std::string_view message, uint32_t &bytesRead, bool isPath,
+                                                          bool isDirectory);
+
+  public:
+    // If not set, strings are written as literals, e.g. for the ReplyCache payloads that are shared by the
+    // connections.
+    bool intern = true;
+
+    SessionDictionary() = default;
+    // Copy writes literals. Its table would be numbered apart from the one the peer keeps for the connection, e.g.
+    // IPCServerBS serializes the replies on the workers with copies of the IPCManagerBS of the connection.
+    SessionDictionary(const SessionDictionary &other);
+    SessionDictionary &operator=(const SessionDictionary &other);
+    SessionDictionary(SessionDictionary &&) = default;
+    SessionDictionary &operator=(SessionDictionary &&) = default;
+
+    static void writeVarint(std::string &buffer, uint64_t value);
+    static void writeVarint(GatherBuffer &buffer, uint64_t value);
+    static tl::expected<uint64_t, std::string> readVarint(std::string_view message, uint32_t &bytesRead);
+
+    void write(std::string &buffer, std::string_view str, bool isPath);
+    void write(GatherBuffer &buffer, std::string_view str, bool isPath);
+    // Returned string points into the message if it is a literal, else it is valid as long as the dictionary. Path is
+    // followed by null character.
+    tl::expected<std::string_view, std::string> read(std::string_view message, uint32_t &bytesRead, bool isPath);
+    [[nodiscard]] const SessionDictionaryStats &getStats() const;
+};
+} // namespace P2978
+#endif // SESSION_DICTIONARY_HPP
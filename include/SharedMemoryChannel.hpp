@@ -0,0 +1,80 @@
+#ifndef SHARED_MEMORY_CHANNEL_HPP
+#define SHARED_MEMORY_CHANNEL_HPP
+
+#include "expected.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+namespace P2978
+{
+#ifndef _WIN32
+
+// Header of a single-producer single-consumer byte ring. It lives in the shared memory and is followed by the data.
+struct RingHeader
+{
+    // Free-running positions. These are also the futex words that the producer and the consumer sleep on.
+    alignas(64) std::atomic<uint32_t> head;
+    std::atomic<uint32_t> producerWaiting;
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> consumerWaiting;
+    alignas(64) std::atomic<uint32_t> closed;
+    // Process that writes in the ring. The peer fails its wait once this exits. 0 if not known yet.
+    std::atomic<uint32_t> producerPid;
+    // Power of 2.
+    uint32_t capacity;
+};
+
+// Transport of the Framing::SHARED_MEMORY. Both directions are rings in one memfd that the build-system creates and the
+// compiler inherits. Every message is written in the ring as 4 bytes size followed by the payload. Messages larger
+// than the ring are streamed through it. Side waiting for the peer spins briefly and then sleeps on a futex, so no
+// system call is made if the peer is already waiting or is quick to respond. While sleeping, it checks every 100 ms
+// that the peer has not exited, so a crashed peer does not hang it.
+class SharedMemoryChannel
+{
+    RingHeader *readRing = nullptr;
+    char *readData = nullptr;
+    RingHeader *writeRing = nullptr;
+    char *writeData = nullptr;
+    void *mapping = nullptr;
+    uint64_t mappingSize = 0;
+
+    static tl::expected<SharedMemoryChannel, std::string> map(uint64_t fd_, uint64_t size, bool isBuildSystem);
+    [[nodiscard]] tl::expected<void, std::string> writeBytes(const char *bytes, uint32_t count) const;
+    [[nodiscard]] tl::expected<void, std::string> readBytes(char *bytes, uint32_t count) const;
+
+  public:
+    static constexpr uint32_t defaultCapacity = 1024 * 1024;
+
+    // memfd. Build-system passes this to the compiler on the command-line. It is close-on-exec, so the build-system
+    // clears FD_CLOEXEC only in the child of the compiler that owns the channel, after the fork.
+    uint64_t fd = 0;
+
+    // Called by the build-system. capacity of each ring is rounded up to the power of 2.
+    static tl::expected<SharedMemoryChannel, std::string> create(uint32_t capacity = defaultCapacity);
+    // Called by the compiler with the inherited fd.
+    static tl::expected<SharedMemoryChannel, std::string> open(uint64_t fd_);
+    // Called by the build-system with the pid of the compiler once it is started, so an exit before open is noticed as
+    // well. Compiler sets its pid in open.
+    void setPeer(uint32_t pid) const;
+
+    [[nodiscard]] tl::expected<void, std::string> write(std::string_view message) const;
+    // Writes the message gathered from the iovecs. size is the sum of their lengths.
+    [[nodiscard]] tl::expected<void, std::string> write(const std::vector<iovec> &iovecs, uint32_t size) const;
+    // Returned string_view points into the buffer.
+    [[nodiscard]] tl::expected<std::string_view, std::string> read(std::string &buffer) const;
+
+    // After this, the reads and writes of both sides fail once they need to wait for the peer.
+    void close() const;
+    // Unmaps and closes the fd.
+    [[nodiscard]] tl::expected<void, std::string> unmap() const;
+};
+#endif
+} // namespace P2978
+#endif // SHARED_MEMORY_CHANNEL_HPP
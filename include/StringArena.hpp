@@ -0,0 +1,39 @@
+#ifndef STRING_ARENA_HPP
+#define STRING_ARENA_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace P2978
+{
+
+struct ArenaStats
+{
+    // Strings larger than the page-size get a page of their own.
+    uint32_t pages = 0;
+    uint32_t strings = 0;
+    uint64_t bytesReserved = 0;
+    // Includes the null character following every string.
+    uint64_t bytesUsed = 0;
+};
+
+// Bump allocator for the logical-names and file-paths that are kept after parsing a message, by the IPCManagerCompiler
+// and the SessionDictionary. Strings are never freed individually and live as long as the arena.
+class StringArena
+{
+    static constexpr uint32_t pageSize = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> pages;
+    char *current = nullptr;
+    uint32_t remaining = 0;
+    ArenaStats stats;
+
+  public:
+    // Returned string is followed by null character, so file-paths can be passed to system calls.
+    std::string_view save(std::string_view str);
+    [[nodiscard]] const ArenaStats &getStats() const;
+};
+} // namespace P2978
+#endif // STRING_ARENA_HPP
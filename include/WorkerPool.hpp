@@ -0,0 +1,52 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace P2978
+{
+
+// Work-stealing thread pool. Every worker has its own queue that the submissions are spread over. A worker takes the
+// oldest task of its own queue, and steals the newest one of another queue once its own is empty, so a slow task only
+// delays the tasks queued behind it on the same worker till the others are idle.
+class WorkerPool
+{
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    // Tasks in all the queues. Idle workers sleep till it is non-zero.
+    std::atomic<uint32_t> queued = 0;
+    std::mutex sleepMutex;
+    std::condition_variable sleeping;
+    bool stopping = false;
+    // Only the submitting thread uses it.
+    uint32_t nextWorker = 0;
+
+    [[nodiscard]] bool take(uint32_t index, std::function<void()> &task);
+    void work(uint32_t index);
+
+  public:
+    explicit WorkerPool(uint32_t threadCount);
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+    // Waits for the running tasks. Queued tasks are dropped.
+    ~WorkerPool();
+
+    // Called from one thread.
+    void submit(std::function<void()> task);
+};
+} // namespace P2978
+#endif // WORKER_POOL_HPP
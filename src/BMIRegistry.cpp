@@ -0,0 +1,295 @@
+
+#include "BMIRegistry.hpp"
+#include "IPCManagerBS.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace P2978
+{
+
+BMIRegistry::Handle::Handle(BMIRegistry *registry_, Entry *entry_) : registry(registry_), entry(entry_)
+{
+}
+
+BMIRegistry::Handle::Handle(const Handle &other) : registry(other.registry), entry(other.entry)
+{
+    if (entry)
+    {
+        std::lock_guard lock(registry->mutex);
+        registry->reference(*entry);
+    }
+}
+
+BMIRegistry::Handle::Handle(Handle &&other) noexcept : registry(other.registry), entry(other.entry)
+{
+    other.registry = nullptr;
+    other.entry = nullptr;
+}
+
+BMIRegistry::Handle &BMIRegistry::Handle::operator=(Handle other) noexcept
+{
+    std::swap(registry, other.registry);
+    std::swap(entry, other.entry);
+    return *this;
+}
+
+BMIRegistry::Handle::~Handle()
+{
+    reset();
+}
+
+BMIFile BMIRegistry::Handle::getBMIFile() const
+{
+    BMIFile file;
+    file.filePath = entry->filePath;
+    file.fileSize = entry->fileSize;
+    return file;
+}
+
+std::string_view BMIRegistry::Handle::getFile() const
+{
+    return entry->mapping.file;
+}
+
+void BMIRegistry::Handle::reset()
+{
+    if (!entry)
+    {
+        return;
+    }
+    std::vector<Mapping> unmapped;
+    {
+        std::lock_guard lock(registry->mutex);
+        registry->release(*entry, unmapped);
+    }
+    closeMappings(unmapped);
+    registry = nullptr;
+    entry = nullptr;
+}
+
+BMIRegistry::BMIRegistry(const uint64_t budget_) : budget(budget_)
+{
+}
+
+BMIRegistry::~BMIRegistry()
+{
+    for (const Entry &entry : entries)
+    {
+        (void)IPCManagerBS::closeBMIFileMapping(entry.mapping);
+    }
+}
+
+void BMIRegistry::reference(Entry &entry)
+{
+    if (!entry.refCount && entry.registered)
+    {
+        idle.erase(entry.idlePosition);
+    }
+    ++entry.refCount;
+}
+
+void BMIRegistry::release(Entry &entry, std::vector<Mapping> &unmapped)
+{
+    if (--entry.refCount)
+    {
+        return;
+    }
+    if (!entry.registered)
+    {
+        destroy(entry, unmapped);
+        return;
+    }
+    idle.emplace_back(&entry);
+    entry.idlePosition = std::prev(idle.end());
+    evict(unmapped);
+}
+
+void BMIRegistry::unregister(Entry &entry, std::vector<Mapping> &unmapped)
+{
+    for (const std::string &path : entry.paths)
+    {
+        byPath.erase(path);
+    }
+#ifndef _WIN32
+    byFile.erase({entry.device, entry.inode});
+#endif
+    entry.registered = false;
+    if (!entry.refCount)
+    {
+        idle.erase(entry.idlePosition);
+        destroy(entry, unmapped);
+    }
+}
+
+void BMIRegistry::destroy(Entry &entry, std::vector<Mapping> &unmapped)
+{
+    mappedBytes -= entry.fileSize;
+    unmapped.emplace_back(entry.mapping);
+    entries.erase(entry.position);
+}
+
+void BMIRegistry::evict(std::vector<Mapping> &unmapped)
+{
+    while (mappedBytes > budget && !idle.empty())
+    {
+        ++evictions;
+        unregister(*idle.front(), unmapped);
+    }
+}
+
+void BMIRegistry::closeMappings(const std::vector<Mapping> &unmapped)
+{
+    // Fails only for an invalid mapping, which these are not.
+    for (const Mapping &mapping : unmapped)
+    {
+        (void)IPCManagerBS::closeBMIFileMapping(mapping);
+    }
+}
+
+tl::expected<BMIRegistry::Handle, std::string> BMIRegistry::acquire(const std::string_view filePath,
+                                                                   const PagePolicy policy)
+{
+    {
+        std::lock_guard lock(mutex);
+        if (const auto it = byPath.find(filePath); it != byPath.end())
+        {
+            ++hits;
+            reference(*it->second);
+            return Handle(this, it->second);
+        }
+    }
+
+    // Mapped without the lock, so the other threads are not blocked by it. If another thread maps the same file
+    // meanwhile, this mapping is dropped.
+    std::string path(filePath);
+    Mapping mapping{};
+    uint32_t fileSize;
+    uint64_t device = 0;
+    uint64_t inode = 0;
+#ifdef _WIN32
+    BMIFile file;
+    file.filePath = path;
+    if (auto r = IPCManagerBS::createSharedMemoryBMIFile(file, policy); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    else
+    {
+        mapping = *r;
+    }
+    fileSize = file.fileSize;
+#else
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        const std::string error = getErrorString();
+        close(fd);
+        return tl::unexpected(error);
+    }
+    fileSize = st.st_size;
+    device = st.st_dev;
+    inode = st.st_ino;
+    const auto &r = mapFile(fd, fileSize, policy);
+    if (close(fd) == -1 || !r)
+    {
+        const std::string error = r ? getErrorString() : r.error();
+        if (r)
+        {
+            (void)IPCManagerBS::closeBMIFileMapping(*r);
+        }
+        return tl::unexpected(error);
+    }
+    mapping = *r;
+#endif
+
+    std::vector<Mapping> unmapped;
+    Handle handle;
+    {
+        std::lock_guard lock(mutex);
+        Entry *entry = nullptr;
+        if (const auto it = byPath.find(path); it != byPath.end())
+        {
+            entry = it->second;
+        }
+#ifndef _WIN32
+        else if (const auto it2 = byFile.find({device, inode}); it2 != byFile.end())
+        {
+            entry = it2->second;
+            entry->paths.emplace_back(path);
+            byPath.emplace(std::move(path), entry);
+        }
+#endif
+
+        if (entry)
+        {
+            ++hits;
+            unmapped.emplace_back(mapping);
+            reference(*entry);
+            handle = Handle(this, entry);
+        }
+        else
+        {
+            ++misses;
+            Entry &e = entries.emplace_back();
+            e.position = std::prev(entries.end());
+            e.filePath = path;
+            e.mapping = mapping;
+            e.fileSize = fileSize;
+            e.device = device;
+            e.inode = inode;
+            e.paths.emplace_back(path);
+            byPath.emplace(std::move(path), &e);
+#ifndef _WIN32
+            byFile.emplace(std::pair{device, inode}, &e);
+#endif
+            e.refCount = 1;
+            mappedBytes += fileSize;
+            handle = Handle(this, &e);
+            evict(unmapped);
+        }
+    }
+    closeMappings(unmapped);
+    return handle;
+}
+
+void BMIRegistry::invalidate(const std::string_view filePath)
+{
+    std::vector<Mapping> unmapped;
+    {
+        std::lock_guard lock(mutex);
+        if (const auto it = byPath.find(filePath); it != byPath.end())
+        {
+            unregister(*it->second, unmapped);
+        }
+    }
+    closeMappings(unmapped);
+}
+
+void BMIRegistry::setBudget(const uint64_t budget_)
+{
+    std::vector<Mapping> unmapped;
+    {
+        std::lock_guard lock(mutex);
+        budget = budget_;
+        evict(unmapped);
+    }
+    closeMappings(unmapped);
+}
+
+BMIRegistryStats BMIRegistry::getStats() const
+{
+    std::lock_guard lock(mutex);
+    return {static_cast<uint32_t>(entries.size()), static_cast<uint32_t>(idle.size()), mappedBytes, hits, misses,
+            evictions};
+}
+} // namespace P2978
@@ -0,0 +1,144 @@
+
+#include "BMIStore.hpp"
+#include "Manager.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <utility>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace P2978
+{
+
+BMIStore::BMIStore(std::string directory_) : directory(std::move(directory_))
+{
+}
+
+// False if either could not be read.
+static bool isSameContent(const std::string &first, const std::string &second)
+{
+    std::ifstream firstStream(first, std::ios::binary);
+    std::ifstream secondStream(second, std::ios::binary);
+    std::string firstChunk(64 * 1024, '\0');
+    std::string secondChunk(64 * 1024, '\0');
+    while (firstStream && secondStream)
+    {
+        firstStream.read(firstChunk.data(), firstChunk.size());
+        secondStream.read(secondChunk.data(), secondChunk.size());
+        if (firstStream.gcount() != secondStream.gcount() ||
+            memcmp(firstChunk.data(), secondChunk.data(), firstStream.gcount()))
+        {
+            return false;
+        }
+    }
+    return firstStream.eof() && secondStream.eof();
+}
+
+tl::expected<std::string, std::string> BMIStore::publish(const std::string &filePath, const uint32_t fileSize,
+                                                         const uint64_t hash)
+{
+    std::string objectPath = directory;
+    objectPath.push_back('/');
+    objectPath.append(to16charHexString(hash));
+    objectPath.push_back('-');
+    objectPath.append(std::to_string(fileSize));
+    // Other file is linked at this path and then renamed to the filePath, so the filePath always exists.
+    const std::string tempPath = filePath + ".bmistore";
+
+#ifdef _WIN32
+    if (CreateHardLinkA(objectPath.c_str(), filePath.c_str(), nullptr))
+    {
+        std::lock_guard lock(mutex);
+        ++published;
+        return objectPath;
+    }
+    if (GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        std::lock_guard lock(mutex);
+        ++published;
+        return filePath;
+    }
+    // Fails if the file is still mapped, in which case it is kept.
+    if (!isSameContent(filePath, objectPath) || !CreateHardLinkA(tempPath.c_str(), objectPath.c_str(), nullptr))
+    {
+        std::lock_guard lock(mutex);
+        ++published;
+        return filePath;
+    }
+    if (!MoveFileExA(tempPath.c_str(), filePath.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileA(tempPath.c_str());
+        std::lock_guard lock(mutex);
+        ++published;
+        return filePath;
+    }
+#else
+    if (link(filePath.c_str(), objectPath.c_str()) == 0)
+    {
+        std::lock_guard lock(mutex);
+        ++published;
+        return objectPath;
+    }
+    if (errno != EEXIST)
+    {
+        if (errno == EXDEV || errno == EPERM || errno == EMLINK)
+        {
+            std::lock_guard lock(mutex);
+            ++published;
+            return filePath;
+        }
+        return tl::unexpected(getErrorString());
+    }
+
+    struct stat fileStat{}, objectStat{};
+    if (stat(filePath.c_str(), &fileStat) == -1 || stat(objectPath.c_str(), &objectStat) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    // Published again without being rebuilt.
+    if (fileStat.st_dev == objectStat.st_dev && fileStat.st_ino == objectStat.st_ino)
+    {
+        std::lock_guard lock(mutex);
+        ++published;
+        return objectPath;
+    }
+    if (!isSameContent(filePath, objectPath))
+    {
+        std::lock_guard lock(mutex);
+        ++published;
+        return filePath;
+    }
+
+    if ((unlink(tempPath.c_str()) == -1 && errno != ENOENT) || link(objectPath.c_str(), tempPath.c_str()) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    if (rename(tempPath.c_str(), filePath.c_str()) == -1)
+    {
+        const std::string error = getErrorString();
+        unlink(tempPath.c_str());
+        return tl::unexpected(error);
+    }
+#endif
+
+    std::lock_guard lock(mutex);
+    ++published;
+    ++deduplicated;
+    savedBytes += fileSize;
+    return objectPath;
+}
+
+BMIStoreStats BMIStore::getStats() const
+{
+    std::lock_guard lock(mutex);
+    return {published, deduplicated, savedBytes};
+}
+} // namespace P2978
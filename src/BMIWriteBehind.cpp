@@ -0,0 +1,103 @@
+
+#include "BMIWriteBehind.hpp"
+#include "Manager.hpp"
+
+#include <iterator>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace P2978
+{
+
+tl::expected<void, std::string> BMIWriteBehind::publish(const std::string_view filePath)
+{
+    std::string path(filePath);
+#ifdef __linux__
+    // Only starts the write-back of the dirty pages, without waiting for it.
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE) == -1)
+    {
+        const std::string error = getErrorString();
+        close(fd);
+        return tl::unexpected(error);
+    }
+    if (close(fd) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+#endif
+    std::lock_guard lock(mutex);
+    ++published;
+    pending.emplace_back(std::move(path));
+    return {};
+}
+
+tl::expected<void, std::string> BMIWriteBehind::flush()
+{
+    std::vector<std::string> batch;
+    {
+        std::lock_guard lock(mutex);
+        batch.swap(pending);
+        ++flushes;
+    }
+
+    // Files are synced without the lock, so publish is not blocked meanwhile.
+    std::string error;
+    std::vector<std::string> failed;
+    for (std::string &path : batch)
+    {
+#ifdef _WIN32
+        const HANDLE hFile = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        const bool synced = hFile != INVALID_HANDLE_VALUE && FlushFileBuffers(hFile);
+        if (!synced && error.empty())
+        {
+            error = getErrorString();
+        }
+        if (hFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(hFile);
+        }
+#else
+        const int fd = open(path.c_str(), O_RDONLY);
+        const bool synced = fd != -1 && fdatasync(fd) != -1;
+        if (!synced && error.empty())
+        {
+            error = getErrorString();
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+#endif
+        if (!synced)
+        {
+            failed.emplace_back(std::move(path));
+        }
+    }
+
+    std::lock_guard lock(mutex);
+    persisted += batch.size() - failed.size();
+    pending.insert(pending.end(), std::make_move_iterator(failed.begin()), std::make_move_iterator(failed.end()));
+    if (!error.empty())
+    {
+        return tl::unexpected(error);
+    }
+    return {};
+}
+
+BMIWriteBehindStats BMIWriteBehind::getStats() const
+{
+    std::lock_guard lock(mutex);
+    return {static_cast<uint32_t>(pending.size()), published, persisted, flushes};
+}
+} // namespace P2978
@@ -0,0 +1,273 @@
+
+#include "BMIWriter.hpp"
+#include "Manager.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#ifdef _WIN32
+#include "rapidhash.h"
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace P2978
+{
+
+BMIWriter::BMIWriter(BMIWriter &&other) noexcept
+    : mapping(std::exchange(other.mapping, nullptr)), size(std::exchange(other.size, 0)),
+      capacity(std::exchange(other.capacity, 0)),
+#ifdef _WIN32
+      file(std::exchange(other.file, nullptr)), fileMapping(std::exchange(other.fileMapping, nullptr)),
+      pathHash(other.pathHash)
+#else
+      fd(std::exchange(other.fd, -1))
+#endif
+{
+}
+
+BMIWriter &BMIWriter::operator=(BMIWriter &&other) noexcept
+{
+    if (this != &other)
+    {
+        (void)unmap();
+        mapping = std::exchange(other.mapping, nullptr);
+        size = std::exchange(other.size, 0);
+        capacity = std::exchange(other.capacity, 0);
+#ifdef _WIN32
+        file = std::exchange(other.file, nullptr);
+        fileMapping = std::exchange(other.fileMapping, nullptr);
+        pathHash = other.pathHash;
+#else
+        fd = std::exchange(other.fd, -1);
+#endif
+    }
+    return *this;
+}
+
+BMIWriter::~BMIWriter()
+{
+    (void)unmap();
+}
+
+tl::expected<BMIWriter, std::string> BMIWriter::create(const std::string &filePath, const uint64_t capacity)
+{
+    BMIWriter writer;
+    // The file might be a hard-link to a BMI in the BMIStore, which must not be truncated.
+#ifdef _WIN32
+    if (!DeleteFileA(filePath.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    writer.file = CreateFileA(filePath.c_str(), GENERIC_READ | GENERIC_WRITE,
+                              0, // no sharing during setup
+                              nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (writer.file == INVALID_HANDLE_VALUE)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    writer.pathHash = rapidhash(filePath.data(), filePath.size());
+#else
+    if (unlink(filePath.c_str()) == -1 && errno != ENOENT)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    writer.fd = open(filePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (writer.fd == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+#endif
+    if (const auto &r = writer.grow(std::max<uint64_t>(capacity, 1)); !r)
+    {
+        (void)writer.unmap();
+        return tl::unexpected(r.error());
+    }
+    return writer;
+}
+
+tl::expected<void, std::string> BMIWriter::grow(const uint64_t newCapacity)
+{
+#ifdef _WIN32
+    // View can not be extended, so it is mapped again from a larger file-mapping.
+    if (mapping)
+    {
+        UnmapViewOfFile(mapping);
+        CloseHandle(fileMapping);
+        mapping = nullptr;
+    }
+    LARGE_INTEGER fileSize;
+    fileSize.QuadPart = newCapacity;
+    fileMapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, fileSize.HighPart, fileSize.LowPart, nullptr);
+    if (!fileMapping)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    mapping = static_cast<char *>(MapViewOfFile(fileMapping, FILE_MAP_WRITE, 0, 0, newCapacity));
+    if (!mapping)
+    {
+        return tl::unexpected(getErrorString());
+    }
+#else
+    if (ftruncate(fd, newCapacity) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    void *m;
+    if (mapping)
+    {
+#ifdef __linux__
+        m = mremap(mapping, capacity, newCapacity, MREMAP_MAYMOVE);
+#else
+        munmap(mapping, capacity);
+        mapping = nullptr;
+        m = mmap(nullptr, newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#endif
+    }
+    else
+    {
+        m = mmap(nullptr, newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (m == MAP_FAILED)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    mapping = static_cast<char *>(m);
+#endif
+    capacity = newCapacity;
+    return {};
+}
+
+tl::expected<char *, std::string> BMIWriter::reserve(const uint64_t bytes)
+{
+    if (size + bytes > UINT32_MAX)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::BMI_FILE_TOO_LARGE));
+    }
+    if (size + bytes > capacity)
+    {
+        if (const auto &r = grow(std::max(size + bytes, std::min<uint64_t>(capacity * 2, UINT32_MAX))); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+    }
+    return mapping + size;
+}
+
+void BMIWriter::commit(const uint64_t bytes)
+{
+    size += bytes;
+}
+
+tl::expected<void, std::string> BMIWriter::append(const std::string_view bytes)
+{
+    const auto &r = reserve(bytes.size());
+    if (!r)
+    {
+        return tl::unexpected(r.error());
+    }
+    memcpy(*r, bytes.data(), bytes.size());
+    commit(bytes.size());
+    return {};
+}
+
+std::string_view BMIWriter::getBMI() const
+{
+    return {mapping, size};
+}
+
+tl::expected<uint32_t, std::string> BMIWriter::seal(const bool sync)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(mapping);
+    CloseHandle(fileMapping);
+    mapping = nullptr;
+    fileMapping = nullptr;
+
+    LARGE_INTEGER fileSize;
+    fileSize.QuadPart = size;
+    if (!SetFilePointerEx(file, fileSize, nullptr, FILE_BEGIN) || !SetEndOfFile(file))
+    {
+        return tl::unexpected(getErrorString());
+    }
+    if (sync && !FlushFileBuffers(file))
+    {
+        return tl::unexpected(getErrorString());
+    }
+
+    // mappingName is needed as the Windows kernel object names can't have \\ in them.
+    char mappingName[17];
+    static constexpr char hex[] = "0123456789abcdef";
+    for (int i = 0; i < 8; i++)
+    {
+        const uint8_t byte = pathHash >> (56 - i * 8) & 0xFF;
+        mappingName[i * 2] = hex[byte >> 4];
+        mappingName[i * 2 + 1] = hex[byte & 0xF];
+    }
+    mappingName[16] = '\0';
+    fileMapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, fileSize.HighPart, fileSize.LowPart, mappingName);
+    if (!fileMapping)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    CloseHandle(file);
+    file = nullptr;
+#else
+    // Pages past the size are dropped by the truncation.
+    if (sync && size && msync(mapping, size, MS_SYNC) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    if (ftruncate(fd, size) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    if (close(fd) == -1)
+    {
+        fd = -1;
+        return tl::unexpected(getErrorString());
+    }
+    fd = -1;
+#endif
+    return size;
+}
+
+tl::expected<void, std::string> BMIWriter::unmap()
+{
+#ifdef _WIN32
+    if (mapping)
+    {
+        UnmapViewOfFile(mapping);
+    }
+    if (fileMapping)
+    {
+        CloseHandle(fileMapping);
+    }
+    if (file)
+    {
+        CloseHandle(file);
+    }
+    mapping = nullptr;
+    fileMapping = nullptr;
+    file = nullptr;
+#else
+    if (mapping && munmap(mapping, capacity) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    mapping = nullptr;
+    if (fd != -1 && close(fd) == -1)
+    {
+        fd = -1;
+        return tl::unexpected(getErrorString());
+    }
+    fd = -1;
+#endif
+    return {};
+}
+} // namespace P2978
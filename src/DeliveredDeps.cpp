@@ -0,0 +1,99 @@
+
+#include "DeliveredDeps.hpp"
+
+#include <algorithm>
+
+namespace P2978
+{
+
+bool DeliveredDeps::deliver(const std::string_view logicalName)
+{
+    if (logicalNames.find(logicalName) != logicalNames.end())
+    {
+        ++omittedLogicalNames;
+        return false;
+    }
+    logicalNames.emplace(logicalName);
+    return true;
+}
+
+void DeliveredDeps::omitDelivered(std::vector<std::string_view> &names, std::vector<uint64_t> &hashes)
+{
+    const bool hashed = hashes.size() == names.size();
+    uint64_t kept = 0;
+    for (uint64_t i = 0; i < names.size(); ++i)
+    {
+        if (deliver(names[i]))
+        {
+            names[kept] = names[i];
+            if (hashed)
+            {
+                hashes[kept] = hashes[i];
+            }
+            ++kept;
+        }
+    }
+    names.resize(kept);
+    if (hashed)
+    {
+        hashes.resize(kept);
+    }
+}
+
+bool DeliveredDeps::isDelivered(const BMIFile &file, std::vector<std::string_view> &names,
+                                std::vector<uint64_t> &hashes)
+{
+    omitDelivered(names, hashes);
+    // The compiler also keeps the mapping of every BMI file in filePathProcessMapping, so a dependency with a new
+    // BMI file is sent even if it has no new logical name.
+    const bool newFile = bmiFiles.emplace(file.filePath).second;
+    return names.empty() && !newFile;
+}
+
+// Names are delivered in the same order as IPCManagerCompiler adds these to its responses cache, so the cache is the
+// same as if the whole reply was sent.
+void DeliveredDeps::omitDelivered(const CTBModule &request, BTCModule &reply)
+{
+    logicalNames.emplace(request.moduleName);
+    bmiFiles.emplace(reply.requested.filePath);
+    const uint64_t size = reply.modDeps.size();
+    reply.modDeps.erase(std::remove_if(reply.modDeps.begin(), reply.modDeps.end(),
+                                       [&](ModuleDep &dep) {
+                                           return isDelivered(dep.file, dep.logicalNames, dep.logicalNameHashes);
+                                       }),
+                        reply.modDeps.end());
+    omittedDeps += size - reply.modDeps.size();
+}
+
+void DeliveredDeps::omitDelivered(const CTBNonModule &request, BTCNonModule &reply)
+{
+    const uint64_t size = reply.headerFiles.size() + reply.huDeps.size();
+    reply.headerFiles.erase(std::remove_if(reply.headerFiles.begin(), reply.headerFiles.end(),
+                                           [&](const HeaderFile &h) { return !deliver(h.logicalName); }),
+                            reply.headerFiles.end());
+    logicalNames.emplace(request.logicalName);
+    if (reply.isHeaderUnit)
+    {
+        bmiFiles.emplace(reply.filePath);
+        omitDelivered(reply.logicalNames, reply.logicalNameHashes);
+        reply.huDeps.erase(std::remove_if(reply.huDeps.begin(), reply.huDeps.end(),
+                                          [&](HuDep &dep) {
+                                              return isDelivered(dep.file, dep.logicalNames, dep.logicalNameHashes);
+                                          }),
+                           reply.huDeps.end());
+    }
+    omittedDeps += size - reply.headerFiles.size() - reply.huDeps.size();
+}
+
+void DeliveredDeps::clear()
+{
+    logicalNames.clear();
+    bmiFiles.clear();
+}
+
+DeliveredDepsStats DeliveredDeps::getStats() const
+{
+    return {static_cast<uint32_t>(logicalNames.size()), static_cast<uint32_t>(bmiFiles.size()), omittedDeps,
+            omittedLogicalNames};
+}
+} // namespace P2978
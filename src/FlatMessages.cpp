@@ -0,0 +1,258 @@
+
+#include "FlatMessages.hpp"
+#include "Manager.hpp"
+
+#include <cstring>
+
+namespace P2978
+{
+
+namespace
+{
+// Records are written first and strings after them. References to the records are not kept across the writes, as
+// the buffer might be reallocated.
+class FlatWriter
+{
+    std::string &buffer;
+
+  public:
+    explicit FlatWriter(std::string &buffer_) : buffer(buffer_)
+    {
+    }
+
+    // Returns the offset of count zero-initialized records.
+    template <typename T> uint32_t allocate(const uint32_t count)
+    {
+        buffer.resize((buffer.size() + alignof(T) - 1) & ~(alignof(T) - 1));
+        const uint32_t offset = buffer.size();
+        buffer.resize(offset + count * sizeof(T));
+        return offset;
+    }
+
+    template <typename T> T &at(const uint32_t offset)
+    {
+        return *reinterpret_cast<T *>(buffer.data() + offset);
+    }
+
+    FlatString writeString(const std::string_view str, const bool isPath)
+    {
+        const FlatString flat{static_cast<uint32_t>(buffer.size()), static_cast<uint32_t>(str.size())};
+        buffer.append(str);
+        if (isPath)
+        {
+            buffer.push_back('\0');
+        }
+        return flat;
+    }
+
+    FlatBMIFile writeBMIFile(const BMIFile &file)
+    {
+        return {writeString(file.filePath, true), file.fileSize};
+    }
+
+    FlatVector<FlatString> writeStrings(const std::vector<std::string_view> &strs)
+    {
+        const uint32_t offset = allocate<FlatString>(strs.size());
+        for (uint32_t i = 0; i < strs.size(); ++i)
+        {
+            const FlatString str = writeString(strs[i], false);
+            at<FlatString>(offset + i * sizeof(FlatString)) = str;
+        }
+        return {offset, static_cast<uint32_t>(strs.size())};
+    }
+
+    FlatVector<FlatHuDep> writeHuDeps(const std::vector<HuDep> &deps)
+    {
+        const uint32_t offset = allocate<FlatHuDep>(deps.size());
+        for (uint32_t i = 0; i < deps.size(); ++i)
+        {
+            const FlatBMIFile file = writeBMIFile(deps[i].file);
+            const FlatVector<FlatString> logicalNames = writeStrings(deps[i].logicalNames);
+            auto &dep = at<FlatHuDep>(offset + i * sizeof(FlatHuDep));
+            dep.file = file;
+            dep.logicalNames = logicalNames;
+            dep.isSystem = deps[i].isSystem;
+        }
+        return {offset, static_cast<uint32_t>(deps.size())};
+    }
+};
+
+class FlatVerifier
+{
+    std::string_view message;
+
+  public:
+    explicit FlatVerifier(const std::string_view message_) : message(message_)
+    {
+    }
+
+    bool check(const FlatString &str, const bool isPath) const
+    {
+        if (str.offset > message.size() || static_cast<uint64_t>(str.size) + isPath > message.size() - str.offset)
+        {
+            return false;
+        }
+        return !isPath || message[str.offset + str.size] == '\0';
+    }
+
+    template <typename T> bool check(const FlatVector<T> &vector) const
+    {
+        return vector.offset % alignof(T) == 0 && vector.offset <= message.size() &&
+               vector.count <= (message.size() - vector.offset) / sizeof(T);
+    }
+
+    template <typename T> const T &get(const FlatVector<T> &vector, const uint32_t i) const
+    {
+        return reinterpret_cast<const T *>(message.data() + vector.offset)[i];
+    }
+
+    bool checkStrings(const FlatVector<FlatString> &strs) const
+    {
+        if (!check(strs))
+        {
+            return false;
+        }
+        for (uint32_t i = 0; i < strs.count; ++i)
+        {
+            if (!check(get(strs, i), false))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename Dep> bool checkDeps(const FlatVector<Dep> &deps) const
+    {
+        if (!check(deps))
+        {
+            return false;
+        }
+        for (uint32_t i = 0; i < deps.count; ++i)
+        {
+            const Dep &dep = get(deps, i);
+            if (!check(dep.file.filePath, true) || !checkStrings(dep.logicalNames))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+template <typename Root> tl::expected<void, std::string> checkRoot(const std::string_view message)
+{
+    if (reinterpret_cast<uintptr_t>(message.data()) % alignof(Root) || message.size() < sizeof(Root) ||
+        reinterpret_cast<const Root *>(message.data())->version != flatVersion)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    return {};
+}
+} // namespace
+
+void writeFlat(std::string &buffer, const BTCModule &moduleFile)
+{
+    buffer.clear();
+    FlatWriter writer(buffer);
+    writer.allocate<FlatBTCModule>(1);
+    const uint32_t modDepsOffset = writer.allocate<FlatModuleDep>(moduleFile.modDeps.size());
+    for (uint32_t i = 0; i < moduleFile.modDeps.size(); ++i)
+    {
+        const ModuleDep &modDep = moduleFile.modDeps[i];
+        const FlatBMIFile file = writer.writeBMIFile(modDep.file);
+        const FlatVector<FlatString> logicalNames = writer.writeStrings(modDep.logicalNames);
+        auto &dep = writer.at<FlatModuleDep>(modDepsOffset + i * sizeof(FlatModuleDep));
+        dep.file = file;
+        dep.logicalNames = logicalNames;
+        dep.isHeaderUnit = modDep.isHeaderUnit;
+        dep.isSystem = modDep.isSystem;
+    }
+    const FlatBMIFile requested = writer.writeBMIFile(moduleFile.requested);
+
+    auto &root = writer.at<FlatBTCModule>(0);
+    root.version = flatVersion;
+    root.requested = requested;
+    root.modDeps = {modDepsOffset, static_cast<uint32_t>(moduleFile.modDeps.size())};
+    root.isSystem = moduleFile.isSystem;
+}
+
+void writeFlat(std::string &buffer, const BTCNonModule &nonModule)
+{
+    buffer.clear();
+    FlatWriter writer(buffer);
+    writer.allocate<FlatBTCNonModule>(1);
+    const uint32_t headerFilesOffset = writer.allocate<FlatHeaderFile>(nonModule.headerFiles.size());
+    for (uint32_t i = 0; i < nonModule.headerFiles.size(); ++i)
+    {
+        const HeaderFile &headerFile = nonModule.headerFiles[i];
+        const FlatString logicalName = writer.writeString(headerFile.logicalName, false);
+        const FlatString filePath = writer.writeString(headerFile.filePath, true);
+        auto &flat = writer.at<FlatHeaderFile>(headerFilesOffset + i * sizeof(FlatHeaderFile));
+        flat.logicalName = logicalName;
+        flat.filePath = filePath;
+        flat.isSystem = headerFile.isSystem;
+    }
+    const FlatString filePath = writer.writeString(nonModule.filePath, true);
+    FlatVector<FlatString> logicalNames{};
+    FlatVector<FlatHuDep> huDeps{};
+    if (nonModule.isHeaderUnit)
+    {
+        logicalNames = writer.writeStrings(nonModule.logicalNames);
+        huDeps = writer.writeHuDeps(nonModule.huDeps);
+    }
+
+    auto &root = writer.at<FlatBTCNonModule>(0);
+    root.version = flatVersion;
+    root.headerFiles = {headerFilesOffset, static_cast<uint32_t>(nonModule.headerFiles.size())};
+    root.filePath = filePath;
+    root.fileSize = nonModule.fileSize;
+    root.logicalNames = logicalNames;
+    root.huDeps = huDeps;
+    root.isHeaderUnit = nonModule.isHeaderUnit;
+    root.isSystem = nonModule.isSystem;
+}
+
+FlatMessage::FlatMessage(const std::string_view message_) : message(message_)
+{
+}
+
+tl::expected<FlatMessage, std::string> FlatMessage::openBTCModule(const std::string_view message_)
+{
+    if (const auto &r = checkRoot<FlatBTCModule>(message_); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    const FlatVerifier verifier(message_);
+    const auto &root = *reinterpret_cast<const FlatBTCModule *>(message_.data());
+    if (!verifier.check(root.requested.filePath, true) || !verifier.checkDeps(root.modDeps))
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    return FlatMessage(message_);
+}
+
+tl::expected<FlatMessage, std::string> FlatMessage::openBTCNonModule(const std::string_view message_)
+{
+    if (const auto &r = checkRoot<FlatBTCNonModule>(message_); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    const FlatVerifier verifier(message_);
+    const auto &root = *reinterpret_cast<const FlatBTCNonModule *>(message_.data());
+    if (!verifier.check(root.filePath, true) || !verifier.check(root.headerFiles) ||
+        !verifier.checkStrings(root.logicalNames) || !verifier.checkDeps(root.huDeps))
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    for (uint32_t i = 0; i < root.headerFiles.count; ++i)
+    {
+        const FlatHeaderFile &headerFile = verifier.get(root.headerFiles, i);
+        if (!verifier.check(headerFile.logicalName, false) || !verifier.check(headerFile.filePath, true))
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+        }
+    }
+    return FlatMessage(message_);
+}
+} // namespace P2978
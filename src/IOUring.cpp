@@ -0,0 +1,213 @@
+
+#include "IOUring.hpp"
+#include "Manager.hpp"
+
+#ifndef _WIN32
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace P2978
+{
+
+tl::expected<IOUring, std::string> IOUring::create(const uint32_t entries, const uint32_t bufferCount_,
+                                                   const uint32_t bufferSize_)
+{
+    io_uring_params params{};
+    // Completions of the reads and the writes of all the connections are queued together.
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * 4;
+    const int ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+
+    IOUring ring;
+    ring.fd = ringFd;
+    const auto fail = [&ring] {
+        const std::string error = getErrorString();
+        (void)ring.close();
+        return tl::unexpected(error);
+    };
+
+    // Both the rings are in one mapping with IORING_FEAT_SINGLE_MMAP, which all the kernels with
+    // IORING_SETUP_DEFER_TASKRUN have.
+    ring.ringsSize = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    void *m = mmap(nullptr, ring.ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                   IORING_OFF_SQ_RING);
+    if (m == MAP_FAILED)
+    {
+        return fail();
+    }
+    ring.rings = m;
+    ring.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m = mmap(nullptr, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (m == MAP_FAILED)
+    {
+        return fail();
+    }
+    ring.sqes = static_cast<io_uring_sqe *>(m);
+
+    char *rings = static_cast<char *>(ring.rings);
+    ring.sqHead = reinterpret_cast<uint32_t *>(rings + params.sq_off.head);
+    ring.sqTail = reinterpret_cast<uint32_t *>(rings + params.sq_off.tail);
+    ring.sqMask = *reinterpret_cast<uint32_t *>(rings + params.sq_off.ring_mask);
+    ring.sqEntries = params.sq_entries;
+    ring.sqLocalTail = *ring.sqTail;
+    ring.cqHead = reinterpret_cast<uint32_t *>(rings + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<uint32_t *>(rings + params.cq_off.tail);
+    ring.cqMask = *reinterpret_cast<uint32_t *>(rings + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<io_uring_cqe *>(rings + params.cq_off.cqes);
+    // Every SQE stays at its own index of the array.
+    auto *array = reinterpret_cast<uint32_t *>(rings + params.sq_off.array);
+    for (uint32_t i = 0; i < ring.sqEntries; ++i)
+    {
+        array[i] = i;
+    }
+
+    ring.bufferCount = 1;
+    while (ring.bufferCount < bufferCount_)
+    {
+        ring.bufferCount *= 2;
+    }
+    ring.bufferSize = bufferSize_;
+    ring.bufferRingSize = ring.bufferCount * sizeof(io_uring_buf);
+    m = mmap(nullptr, ring.bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+    {
+        return fail();
+    }
+    ring.bufferRing = static_cast<io_uring_buf *>(m);
+    m = mmap(nullptr, static_cast<uint64_t>(ring.bufferCount) * ring.bufferSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+    {
+        return fail();
+    }
+    ring.buffers = static_cast<char *>(m);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring.bufferRing);
+    reg.ring_entries = ring.bufferCount;
+    reg.bgid = bufferGroup;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        return fail();
+    }
+    for (uint32_t i = 0; i < ring.bufferCount; ++i)
+    {
+        ring.addBuffer(i);
+    }
+    __atomic_store_n(&ring.bufferRing[0].resv, ring.bufferTail, __ATOMIC_RELEASE);
+    return ring;
+}
+
+void IOUring::addBuffer(const uint16_t id)
+{
+    // Only the address, the length and the id are written, as the reserved field of the first entry is the tail.
+    io_uring_buf &buffer = bufferRing[bufferTail & (bufferCount - 1)];
+    buffer.addr = reinterpret_cast<uint64_t>(buffers + static_cast<uint64_t>(id) * bufferSize);
+    buffer.len = bufferSize;
+    buffer.bid = id;
+    ++bufferTail;
+}
+
+tl::expected<void, std::string> IOUring::enter(const uint32_t waitCount, const int32_t timeout)
+{
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+    uint32_t flags = waitCount ? IORING_ENTER_GETEVENTS : 0;
+    __kernel_timespec ts{};
+    io_uring_getevents_arg arg{};
+    void *argument = nullptr;
+    uint64_t argumentSize = 0;
+    if (waitCount && timeout != -1)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = static_cast<int64_t>(timeout % 1000) * 1000 * 1000;
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        flags |= IORING_ENTER_EXT_ARG;
+        argument = &arg;
+        argumentSize = sizeof(arg);
+    }
+
+    const int32_t submitted = syscall(__NR_io_uring_enter, fd, unsubmitted, waitCount, flags, argument, argumentSize);
+    if (submitted == -1)
+    {
+        // Timed out, interrupted, or the completion queue is full. The caller consumes the completions and retries.
+        if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN)
+        {
+            return {};
+        }
+        return tl::unexpected(getErrorString());
+    }
+    unsubmitted -= submitted;
+    return {};
+}
+
+tl::expected<io_uring_sqe *, std::string> IOUring::getSqe()
+{
+    if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries)
+    {
+        if (const auto &r = enter(0, -1); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+        if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries)
+        {
+            errno = EBUSY;
+            return tl::unexpected(getErrorString());
+        }
+    }
+
+    io_uring_sqe *sqe = &sqes[sqLocalTail & sqMask];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    ++sqLocalTail;
+    ++unsubmitted;
+    return sqe;
+}
+
+tl::expected<void, std::string> IOUring::submitAndWait(const int32_t timeout)
+{
+    __atomic_store_n(&bufferRing[0].resv, bufferTail, __ATOMIC_RELEASE);
+    return enter(1, timeout);
+}
+
+const char *IOUring::getBuffer(const uint16_t id) const
+{
+    return buffers + static_cast<uint64_t>(id) * bufferSize;
+}
+
+void IOUring::recycleBuffer(const uint16_t id)
+{
+    addBuffer(id);
+}
+
+tl::expected<void, std::string> IOUring::close()
+{
+    // Closing the fd frees the registered buffer ring as well.
+    std::string error;
+    if (::close(fd) == -1)
+    {
+        error = getErrorString();
+    }
+    if ((rings && munmap(rings, ringsSize) == -1) || (sqes && munmap(sqes, sqesSize) == -1) ||
+        (bufferRing && munmap(bufferRing, bufferRingSize) == -1) ||
+        (buffers && munmap(buffers, static_cast<uint64_t>(bufferCount) * bufferSize) == -1))
+    {
+        error = getErrorString();
+    }
+    if (!error.empty())
+    {
+        return tl::unexpected(error);
+    }
+    return {};
+}
+} // namespace P2978
+#endif
@@ -1,7 +1,11 @@
 #include "IPCManagerBS.hpp"
+#include "FlatMessages.hpp"
 #include "Manager.hpp"
 #include "Messages.hpp"
+#include "Serialization.hpp"
 #include "expected.hpp"
+#include <cstring>
+#include <memory>
 #include <string>
 #include <sys/stat.h>
 
@@ -36,6 +40,18 @@ namespace P2978
 
 tl::expected<void, std::string> IPCManagerBS::writeInternal(const std::string_view buffer) const
 {
+    if (writeQueue)
+    {
+#ifndef _WIN32
+        if (framing == Framing::SEQPACKET)
+        {
+            appendDatagrams(*writeQueue, buffer);
+            return {};
+        }
+#endif
+        writeQueue->append(buffer);
+        return {};
+    }
 #ifdef _WIN32
     const bool success = WriteFile(reinterpret_cast<HANDLE>(writeFd), // pipe handle
                                    buffer.data(),                     // message
@@ -47,6 +63,14 @@ tl::expected<void, std::string> IPCManagerBS::writeInternal(const std::string_vi
         return tl::unexpected(getErrorString());
     }
 #else
+    if (framing == Framing::SEQPACKET)
+    {
+        return sendDatagrams(writeFd, buffer);
+    }
+    if (framing == Framing::SHARED_MEMORY)
+    {
+        return channel.write(buffer);
+    }
     if (const auto &r = writeAll(writeFd, buffer.data(), buffer.size()); !r)
     {
         return tl::unexpected(r.error());
@@ -55,12 +79,78 @@ tl::expected<void, std::string> IPCManagerBS::writeInternal(const std::string_vi
     return {};
 }
 
-IPCManagerBS::IPCManagerBS(const uint64_t writeFd_) : writeFd(writeFd_)
+IPCManagerBS::IPCManagerBS(const uint64_t writeFd_, const Framing framing_) : writeFd(writeFd_), framing(framing_)
+{
+}
+
+#ifndef _WIN32
+IPCManagerBS::IPCManagerBS(const SharedMemoryChannel &channel_)
+    : writeFd(channel_.fd), framing(Framing::SHARED_MEMORY), channel(channel_)
+{
+}
+#endif
+
+SessionDictionary *IPCManagerBS::getDictionary() const
+{
+    return wireFormat == WireFormat::V1_INTERNED ? &dictionary : nullptr;
+}
+
+GatherBuffer IPCManagerBS::getBuffer(const uint64_t payloadSize) const
 {
+    GatherBuffer buffer;
+    buffer.reserve(frameHeaderSize + payloadSize + 4 + strlen(delimiter));
+    if (framing == Framing::LENGTH_PREFIXED)
+    {
+        // Filled by writeMessage once the payload size is known.
+        constexpr char header[frameHeaderSize] = {};
+        buffer.append(header, frameHeaderSize);
+    }
+    return buffer;
+}
+
+tl::expected<void, std::string> IPCManagerBS::writeMessage(GatherBuffer &buffer, const BTC type) const
+{
+    if (framing == Framing::LENGTH_PREFIXED)
+    {
+        char header[frameHeaderSize];
+        const uint32_t payloadSize = buffer.size - frameHeaderSize;
+        memcpy(header, &payloadSize, 4);
+        header[4] = static_cast<char>(type);
+        buffer.overwrite(0, header, frameHeaderSize);
+    }
+    else if (framing == Framing::DELIMITER)
+    {
+        // The payload might have the bytes of the delimiter, so the compiler checks the size before it as well.
+        writeUInt32(buffer, buffer.size);
+        buffer.append(delimiter, strlen(delimiter));
+    }
+
+    if (writeQueue && framing != Framing::SEQPACKET)
+    {
+        buffer.flatten(*writeQueue);
+        return {};
+    }
+#ifndef _WIN32
+    if (framing != Framing::SEQPACKET)
+    {
+        std::vector<iovec> iovecs;
+        buffer.getIovecs(iovecs);
+        if (framing == Framing::SHARED_MEMORY)
+        {
+            return channel.write(iovecs, buffer.size);
+        }
+        return writevAll(writeFd, iovecs.data(), iovecs.size());
+    }
+#endif
+
+    std::string flat;
+    buffer.flatten(flat);
+    return writeInternal(flat);
 }
 
 tl::expected<void, std::string> IPCManagerBS::receiveMessage(char (&ctbBuffer)[320], CTB &messageType,
-                                                             const std::string_view serverReadString)
+                                                             const std::string_view serverReadString,
+                                                             const WireFormat wireFormat)
 {
     if (serverReadString.empty())
     {
@@ -74,29 +164,47 @@ tl::expected<void, std::string> IPCManagerBS::receiveMessage(char (&ctbBuffer)[3
     {
 
     case CTB::MODULE: {
-        TRY_READ_VAL(r, readString, serverReadString, bytesRead);
-
+        TRY_READ(r, deserialize, serverReadString, bytesRead, getInitializedObjectFromBuffer<CTBModule>(ctbBuffer),
+                 nullptr, wireFormat);
         messageType = CTB::MODULE;
-        getInitializedObjectFromBuffer<CTBModule>(ctbBuffer).moduleName = r;
     }
     break;
 
     case CTB::NON_MODULE: {
-        TRY_READ_VAL(r, readBool, serverReadString, bytesRead);
-        TRY_READ_VAL(r2, readString, serverReadString, bytesRead);
+        TRY_READ(r, deserialize, serverReadString, bytesRead, getInitializedObjectFromBuffer<CTBNonModule>(ctbBuffer),
+                 nullptr, wireFormat);
         messageType = CTB::NON_MODULE;
-        auto &[isHeaderUnit, str] = getInitializedObjectFromBuffer<CTBNonModule>(ctbBuffer);
-        isHeaderUnit = r;
-        str = r2;
     }
     break;
 
     case CTB::LAST_MESSAGE: {
-        TRY_READ_VAL(fileSizeExpected, readUInt32, serverReadString, bytesRead);
-
+        TRY_READ(r, deserialize, serverReadString, bytesRead,
+                 getInitializedObjectFromBuffer<CTBLastMessage>(ctbBuffer), nullptr, wireFormat);
         messageType = CTB::LAST_MESSAGE;
-        auto &[fileSize] = getInitializedObjectFromBuffer<CTBLastMessage>(ctbBuffer);
-        fileSize = fileSizeExpected;
+    }
+    break;
+
+    case CTB::PREFETCH: {
+        TRY_READ(r, deserialize, serverReadString, bytesRead,
+                 getInitializedObjectFromBuffer<CTBPrefetch>(ctbBuffer), nullptr, wireFormat);
+        messageType = CTB::PREFETCH;
+    }
+    break;
+
+    case CTB::BATCH: {
+        // Caller destroys the batch only if it is received, so it is destroyed here on all the errors.
+        auto &batch = getInitializedObjectFromBuffer<CTBBatch>(ctbBuffer);
+        if (const auto &r = deserialize(serverReadString, bytesRead, batch, nullptr, wireFormat); !r)
+        {
+            std::destroy_at(&batch);
+            return tl::unexpected(r.error());
+        }
+        if (serverReadString.size() != bytesRead)
+        {
+            std::destroy_at(&batch);
+            return tl::unexpected(getErrorString(serverReadString.size(), bytesRead));
+        }
+        messageType = CTB::BATCH;
     }
     break;
 
@@ -112,35 +220,155 @@ tl::expected<void, std::string> IPCManagerBS::receiveMessage(char (&ctbBuffer)[3
     return {};
 }
 
-tl::expected<void, std::string> IPCManagerBS::sendMessage(const BTCModule &moduleFile) const
+tl::expected<void, std::string> IPCManagerBS::receiveMessage(char (&ctbBuffer)[320], CTB &messageType)
 {
-    std::string buffer;
-    writeBMIFile(buffer, moduleFile.requested);
-    buffer.push_back(moduleFile.isSystem);
-    writeVectorOfModuleDep(buffer, moduleFile.modDeps);
-    buffer.append(delimiter, strlen(delimiter));
-    if (const auto &r = writeInternal(buffer); !r)
+#ifdef _WIN32
+    return tl::unexpected(getErrorString(ErrorCategory::NONE));
+#else
+    const auto &r =
+        framing == Framing::SHARED_MEMORY ? channel.read(receiveBuffer) : receiveDatagrams(writeFd, receiveBuffer);
+    if (!r)
+    {
+        return tl::unexpected(r.error());
+    }
+    return receiveMessage(ctbBuffer, messageType, *r, wireFormat);
+#endif
+}
+
+template <typename Reply>
+tl::expected<void, std::string> IPCManagerBS::sendReply(const Reply &reply, const BTC type,
+                                                        const uint32_t requestId) const
+{
+    std::string flat;
+    const uint64_t requestIdSize = type == BTC::PREFETCH ? 4 : 0;
+    GatherBuffer buffer =
+        getBuffer(requestIdSize + (wireFormat == WireFormat::V2 ? 0 : serializedSize(reply, wireFormat)));
+    if (type == BTC::PREFETCH)
+    {
+        writeUInt32(buffer, requestId);
+    }
+    if (wireFormat == WireFormat::V2)
+    {
+        writeFlat(flat, reply);
+        buffer.appendReference(flat);
+    }
+    else
+    {
+        serialize(buffer, reply, getDictionary(), wireFormat);
+    }
+    if (const auto &r = writeMessage(buffer, type); !r)
     {
         return tl::unexpected(r.error());
     }
     return {};
 }
 
+tl::expected<void, std::string> IPCManagerBS::sendMessage(const BTCModule &moduleFile) const
+{
+    return sendReply(moduleFile, BTC::MODULE, 0);
+}
+
 tl::expected<void, std::string> IPCManagerBS::sendMessage(const BTCNonModule &nonModule) const
 {
-    std::string buffer;
-    buffer.push_back(nonModule.isHeaderUnit);
-    buffer.push_back(nonModule.isSystem);
-    writeVectorOfHeaderFiles(buffer, nonModule.headerFiles);
-    writePath(buffer, nonModule.filePath);
-    if (nonModule.isHeaderUnit)
+    return sendReply(nonModule, BTC::NON_MODULE, 0);
+}
+
+tl::expected<void, std::string> IPCManagerBS::sendMessage(const BTCModule &moduleFile, const uint32_t requestId) const
+{
+    return sendReply(moduleFile, BTC::PREFETCH, requestId);
+}
+
+tl::expected<void, std::string> IPCManagerBS::sendMessage(const BTCNonModule &nonModule,
+                                                          const uint32_t requestId) const
+{
+    return sendReply(nonModule, BTC::PREFETCH, requestId);
+}
+
+template <typename Reply> std::string IPCManagerBS::serializePayload(const Reply &reply) const
+{
+    std::string payload;
+    if (wireFormat == WireFormat::V2)
+    {
+        writeFlat(payload, reply);
+    }
+    else if (wireFormat == WireFormat::V1_INTERNED)
+    {
+        // Entries of this connection are not known to the others.
+        SessionDictionary literals;
+        literals.intern = false;
+        serialize(payload, reply, &literals);
+    }
+    else
+    {
+        payload.reserve(serializedSize(reply, wireFormat));
+        serialize(payload, reply, nullptr, wireFormat);
+    }
+    return payload;
+}
+
+std::string IPCManagerBS::serializeReply(const BTCModule &moduleFile) const
+{
+    return serializePayload(moduleFile);
+}
+
+std::string IPCManagerBS::serializeReply(const BTCNonModule &nonModule) const
+{
+    return serializePayload(nonModule);
+}
+
+tl::expected<void, std::string> IPCManagerBS::sendSerializedReply(const std::string_view payload, const BTC type,
+                                                                  const uint32_t requestId) const
+{
+    GatherBuffer buffer = getBuffer(type == BTC::PREFETCH ? 4 : 0);
+    if (type == BTC::PREFETCH)
+    {
+        writeUInt32(buffer, requestId);
+    }
+    buffer.appendReference(payload);
+    if (const auto &r = writeMessage(buffer, type); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    return {};
+}
+
+// WireFormat::V2 reply in a BTCBatch. flat is referenced by the buffer.
+template <typename Reply> static void writeBatchedFlatReply(GatherBuffer &buffer, std::string &flat, const Reply &reply)
+{
+    writeFlat(flat, reply);
+    Manager::writeUInt32(buffer, flat.size());
+    flat.resize((flat.size() + 3) & ~3u);
+    buffer.appendReference(flat);
+}
+
+tl::expected<void, std::string> IPCManagerBS::sendMessage(const BTCBatch &batch) const
+{
+    if (wireFormat != WireFormat::V2)
     {
-        writeUInt32(buffer, nonModule.fileSize);
-        writeVectorOfStrings(buffer, nonModule.logicalNames);
-        writeVectorOfHuDeps(buffer, nonModule.huDeps);
+        GatherBuffer buffer = getBuffer(serializedSize(batch, wireFormat));
+        serialize(buffer, batch, getDictionary(), wireFormat);
+        if (const auto &r = writeMessage(buffer, BTC::BATCH); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+        return {};
+    }
+
+    // Not resized after this, as the buffer references the flat replies.
+    std::vector<std::string> flats(batch.modules.size() + batch.nonModules.size());
+    GatherBuffer buffer = getBuffer(8 + 4 * flats.size());
+    uint32_t i = 0;
+    writeUInt32(buffer, batch.modules.size());
+    for (const BTCModule &moduleFile : batch.modules)
+    {
+        writeBatchedFlatReply(buffer, flats[i++], moduleFile);
+    }
+    writeUInt32(buffer, batch.nonModules.size());
+    for (const BTCNonModule &nonModule : batch.nonModules)
+    {
+        writeBatchedFlatReply(buffer, flats[i++], nonModule);
     }
-    buffer.append(delimiter, strlen(delimiter));
-    if (const auto &r = writeInternal(buffer); !r)
+    if (const auto &r = writeMessage(buffer, BTC::BATCH); !r)
     {
         return tl::unexpected(r.error());
     }
@@ -149,20 +377,20 @@ tl::expected<void, std::string> IPCManagerBS::sendMessage(const BTCNonModule &no
 
 tl::expected<void, std::string> IPCManagerBS::sendMessage(const BTCLastMessage &) const
 {
-    std::string buffer;
+    GatherBuffer buffer = getBuffer(1);
     buffer.push_back(true);
-    buffer.append(delimiter, strlen(delimiter));
-    if (const auto &r = writeInternal(buffer); !r)
+    if (const auto &r = writeMessage(buffer, BTC::LAST_MESSAGE); !r)
     {
         return tl::unexpected(r.error());
     }
     return {};
 }
 
-tl::expected<Mapping, std::string> IPCManagerBS::createSharedMemoryBMIFile(BMIFile &bmiFile)
+tl::expected<Mapping, std::string> IPCManagerBS::createSharedMemoryBMIFile(BMIFile &bmiFile, const PagePolicy policy)
 {
     Mapping sharedFile{};
 #ifdef _WIN32
+    (void)policy;
 
     // mappingName is needed as the Windows kernel object names can't have \\ in them.
     const uint64_t hash = rapidhash(bmiFile.filePath.data(), bmiFile.filePath.size());
@@ -234,16 +462,16 @@ tl::expected<Mapping, std::string> IPCManagerBS::createSharedMemoryBMIFile(BMIFi
 
         bmiFile.fileSize = st.st_size;
     }
-    void *mapping = mmap(nullptr, bmiFile.fileSize, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    const auto &r = mapFile(fd, bmiFile.fileSize, policy);
     if (close(fd) == -1)
     {
         return tl::unexpected(getErrorString());
     }
-    if (mapping == MAP_FAILED)
+    if (!r)
     {
-        return tl::unexpected(getErrorString());
+        return tl::unexpected(r.error());
     }
-    sharedFile.file = std::string_view(static_cast<char *>(mapping), bmiFile.fileSize);
+    sharedFile = *r;
     return sharedFile;
 #endif
 }
@@ -264,4 +492,15 @@ tl::expected<void, std::string> IPCManagerBS::closeBMIFileMapping(const Mapping
     return {};
 }
 
+BMIRegistry &IPCManagerBS::getBMIRegistry()
+{
+    static BMIRegistry registry;
+    return registry;
+}
+
+const SessionDictionaryStats &IPCManagerBS::getDictionaryStats() const
+{
+    return dictionary.getStats();
+}
+
 } // namespace P2978
\ No newline at end of file
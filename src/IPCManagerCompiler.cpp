@@ -1,15 +1,20 @@
 
 #include "IPCManagerCompiler.hpp"
+#include "FlatMessages.hpp"
 #include "Manager.hpp"
 #include "Messages.hpp"
+#include "Serialization.hpp"
+#include "rapidhash.h"
 
+#include <algorithm>
 #include <string>
+#include <unordered_set>
 #include <utility>
 
 #ifdef _WIN32
-#include "rapidhash.h"
 #include <Windows.h>
 #else
+#include <cerrno>
 #include <cstring>
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -42,20 +47,118 @@ Response::Response(std::string_view filePath_, const Mapping &mapping_, const Fi
 {
 }
 
-static bool endsWith(const std::string_view str, const std::string &suffix)
+// Reads exactly count bytes from the stdin.
+static tl::expected<void, std::string> readAll(char *buffer, const uint32_t count)
 {
-    if (suffix.size() > str.size())
+    uint32_t bytesRead = 0;
+    while (bytesRead != count)
     {
-        return false;
+#ifdef _WIN32
+        DWORD result = 0;
+        const bool success =
+            ReadFile((HANDLE)STD_INPUT_HANDLE, buffer + bytesRead, count - bytesRead, &result, nullptr);
+
+        if (const uint32_t lastError = GetLastError(); !success && lastError != ERROR_MORE_DATA)
+        {
+            return tl::unexpected(getErrorString());
+        }
+#else
+        const int32_t result = read(STDIN_FILENO, buffer + bytesRead, count - bytesRead);
+        if (result == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return tl::unexpected(getErrorString());
+        }
+#endif
+        if (!result)
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::READ_FILE_ZERO_BYTES_READ));
+        }
+        bytesRead += result;
     }
-    return str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+    return {};
 }
 
-tl::expected<std::string_view, std::string> IPCManagerCompiler::readInternal(char (&buffer)[4096]) const
+IPCManagerCompiler::IPCManagerCompiler(const Framing framing_, const uint64_t channelFd_)
+    : framing(framing_), channelFd(channelFd_)
 {
-    std::string *output = nullptr;
+}
+
+#ifndef _WIN32
+IPCManagerCompiler::IPCManagerCompiler(const SharedMemoryChannel &channel_)
+    : framing(Framing::SHARED_MEMORY), channel(channel_)
+{
+}
+#endif
+
+tl::expected<std::string_view, std::string> IPCManagerCompiler::readInternal(char (&buffer)[4096], const BTC type)
+{
+#ifndef _WIN32
+    if (framing == Framing::SEQPACKET)
+    {
+        return receiveDatagrams(channelFd, receiveBuffer);
+    }
+    if (framing == Framing::SHARED_MEMORY)
+    {
+        return channel.read(receiveBuffer);
+    }
+#endif
+
+    if (framing == Framing::LENGTH_PREFIXED)
+    {
+        if (const auto &r = readAll(buffer, frameHeaderSize); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+        if (static_cast<BTC>(buffer[4]) != type)
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::UNEXPECTED_BTC_TYPE));
+        }
+
+        uint32_t payloadSize;
+        memcpy(&payloadSize, buffer, 4);
+        // Payload is read directly in the receiveBuffer, so there is no delimiter scanning. receiveBuffer only grows
+        // if the payload is larger than any of the previous ones.
+        receiveBuffer.resize(payloadSize);
+        if (const auto &r = readAll(receiveBuffer.data(), payloadSize); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+        return std::string_view{receiveBuffer};
+    }
+
+    // Build-system might have replied to more than one CTBPrefetch, so the bytes after the previous message are the
+    // start of this one.
+    receiveBuffer.swap(unreadInput);
+    unreadInput.clear();
+    const uint32_t delimiterSize = strlen(delimiter);
+    uint64_t searchStart = 0;
     while (true)
     {
+        // A delimiter ends the message only if it is preceded by the size of the bytes before that. Otherwise, it is
+        // part of the payload, e.g. in a logical-name.
+        uint64_t pos;
+        while ((pos = receiveBuffer.find(delimiter, searchStart, delimiterSize)) != std::string::npos)
+        {
+            if (pos >= 4)
+            {
+                uint32_t payloadSize;
+                memcpy(&payloadSize, receiveBuffer.data() + (pos - 4), 4);
+                if (payloadSize == pos - 4)
+                {
+                    unreadInput.assign(receiveBuffer, pos + delimiterSize);
+                    receiveBuffer.resize(payloadSize);
+                    return std::string_view{receiveBuffer};
+                }
+            }
+            searchStart = pos + 1;
+        }
+        // Delimiter could be split across the reads.
+        searchStart = receiveBuffer.size() < delimiterSize ? 0 : receiveBuffer.size() - delimiterSize + 1;
+
         uint32_t bytesRead;
 #ifdef _WIN32
         const bool success = ReadFile((HANDLE)STD_INPUT_HANDLE, // pipe handle
@@ -82,23 +185,12 @@ tl::expected<std::string_view, std::string> IPCManagerCompiler::readInternal(cha
             return tl::unexpected(getErrorString(ErrorCategory::READ_FILE_ZERO_BYTES_READ));
         }
 
-        if (!output)
+        if (receiveBuffer.empty() && bytesRead < delimiterSize)
         {
-            if (bytesRead < strlen(delimiter))
-            {
-                return tl::unexpected("P2978 Error: Received string only has delimiter but not the size of payload\n");
-            }
-            output = new std::string{};
-            allocations.emplace_back(output);
+            return tl::unexpected("P2978 Error: Received string only has delimiter but not the size of payload\n");
         }
 
-        output->append(buffer, bytesRead);
-
-        // We return once we receive the delimiter.
-        if (endsWith(*output, delimiter))
-        {
-            return std::string_view{output->data(), output->size() - strlen(delimiter)};
-        }
+        receiveBuffer.append(buffer, bytesRead);
     }
 }
 
@@ -115,6 +207,14 @@ tl::expected<void, std::string> IPCManagerCompiler::writeInternal(const std::str
         return tl::unexpected(getErrorString());
     }
 #else
+    if (framing == Framing::SEQPACKET)
+    {
+        return sendDatagrams(channelFd, buffer);
+    }
+    if (framing == Framing::SHARED_MEMORY)
+    {
+        return channel.write(buffer);
+    }
     if (const auto &r = writeAll(STDOUT_FILENO, buffer.data(), buffer.size()); !r)
     {
         return tl::unexpected(r.error());
@@ -123,35 +223,241 @@ tl::expected<void, std::string> IPCManagerCompiler::writeInternal(const std::str
     return {};
 }
 
+tl::expected<void, std::string> IPCManagerCompiler::writeMessage(std::string &buffer) const
+{
+    // Build-system finds the message in the compiler output by reading backwards from the delimiter.
+    if (framing == Framing::DELIMITER || framing == Framing::LENGTH_PREFIXED)
+    {
+        writeUInt32(buffer, buffer.size());
+        buffer.append(delimiter, strlen(delimiter));
+    }
+    return writeInternal(buffer);
+}
+
+SessionDictionary *IPCManagerCompiler::getDictionary()
+{
+    return wireFormat == WireFormat::V1_INTERNED ? &dictionary : nullptr;
+}
+
+tl::expected<std::string_view, std::string> IPCManagerCompiler::readReplyString(const std::string_view message,
+                                                                                uint32_t &bytesRead, const bool isPath)
+{
+    if (wireFormat == WireFormat::V1_INTERNED)
+    {
+        return dictionary.read(message, bytesRead, isPath);
+    }
+    return isPath ? readPath(message, bytesRead) : readString(message, bytesRead);
+}
+
 tl::expected<IPCManagerCompiler::BMIFileMapping, std::string> IPCManagerCompiler::readProcessMappingOfBMIFile(
     const std::string_view message, uint32_t &bytesRead)
 {
-    const auto &r = readPath(message, bytesRead);
+    BMIFile file;
+    if (const auto &r = deserialize(message, bytesRead, file, getDictionary()); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    return mapBMIFile(file);
+}
+
+tl::expected<IPCManagerCompiler::BMIFileMapping, std::string> IPCManagerCompiler::mapBMIFile(const BMIFile &file)
+{
+    BMIFileMapping bmiFileMapping;
+    bmiFileMapping.file.fileSize = file.fileSize;
+    if (const auto it = mappingsByPath.find(file.filePath); it != mappingsByPath.end())
+    {
+        bmiFileMapping.file.filePath = it->first;
+        bmiFileMapping.mapping = it->second->mapping;
+        return bmiFileMapping;
+    }
+
+    // file.filePath points into the receiveBuffer. The key is saved in the arena and is shared with the responses.
+    const std::string_view filePath = arena.save(file.filePath);
+    SharedMapping *shared;
+#ifndef _WIN32
+    // stat instead of open, so that a file that is not mapped yet does not keep a descriptor.
+    struct stat st;
+    if (stat(filePath.data(), &st) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    // Same file reached through another path, e.g. a hard link.
+    if (const auto it = mappedFiles.find({st.st_dev, st.st_ino}); it != mappedFiles.end())
+    {
+        shared = it->second;
+    }
+    else
+#endif
+    {
+        shared = &sharedMappings.emplace_back();
+        shared->position = std::prev(sharedMappings.end());
+        shared->fileSize = file.fileSize;
+#ifndef _WIN32
+        shared->device = st.st_dev;
+        shared->inode = st.st_ino;
+        mappedFiles.emplace(std::pair{shared->device, shared->inode}, shared);
+#endif
+    }
+    shared->filePaths.emplace_back(filePath);
+    mappingsByPath.emplace(filePath, shared);
+
+    // Every received file is mapped, even if no response has it, e.g. a dependency whose logical-names are all
+    // cached already.
+    if (shared->mapping.file.data())
+    {
+        filePathProcessMapping.emplace(filePath, shared->mapping);
+    }
+    else if (!lazyMapping)
+    {
+        if (const auto &r = map(*shared, defaultPagePolicy); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+    }
+    bmiFileMapping.file.filePath = filePath;
+    bmiFileMapping.mapping = shared->mapping;
+    return bmiFileMapping;
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::map(SharedMapping &shared, const PagePolicy policy)
+{
+    if (shared.mapping.file.data())
+    {
+        return {};
+    }
+    const auto &r = readSharedMemoryBMIFile(BMIFile{shared.filePaths[0], shared.fileSize}, policy);
     if (!r)
     {
         return tl::unexpected(r.error());
     }
-    const auto &r2 = readUInt32(message, bytesRead);
-    if (!r2)
+    shared.mapping = *r;
+    for (const std::string_view filePath : shared.filePaths)
     {
-        return tl::unexpected(r2.error());
+        filePathProcessMapping.emplace(filePath, shared.mapping);
     }
+    return {};
+}
 
-    BMIFile file;
-    file.filePath = *r;
-    file.fileSize = *r2;
+tl::expected<void, std::string> IPCManagerCompiler::mapResponse(Response &response)
+{
+    if (response.type == FileType::HEADER_FILE || response.mapping.file.data())
+    {
+        return {};
+    }
+    const auto it = mappingsByPath.find(response.filePath);
+    if (it == mappingsByPath.end())
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::UNKNOWN_BMI_FILE));
+    }
+    SharedMapping &shared = *it->second;
+    if (const auto &r = map(shared, defaultPagePolicy); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    response.mapping = shared.mapping;
+    return {};
+}
 
-    if (const auto &r3 = readSharedMemoryBMIFile(file); r3)
+tl::expected<Mapping, std::string> IPCManagerCompiler::getBMIFileMapping(const std::string_view filePath)
+{
+    const auto it = mappingsByPath.find(filePath);
+    if (it == mappingsByPath.end())
     {
-        filePathProcessMapping.emplace(file.filePath, r3.value());
-        BMIFileMapping bmiFileMapping;
-        bmiFileMapping.file = file;
-        bmiFileMapping.mapping = *r3;
-        return bmiFileMapping;
+        return tl::unexpected(getErrorString(ErrorCategory::UNKNOWN_BMI_FILE));
     }
-    else
+    if (const auto &r = map(*it->second, defaultPagePolicy); !r)
     {
-        return tl::unexpected(r3.error());
+        return tl::unexpected(r.error());
+    }
+    return it->second->mapping;
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::willNeedBMIFile(const std::string_view logicalName)
+{
+    const Response *response = responses.find(logicalName);
+    if (!response || response->type == FileType::HEADER_FILE || response->mapping.file.data())
+    {
+        return {};
+    }
+    const auto it = mappingsByPath.find(response->filePath);
+    if (it == mappingsByPath.end())
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::UNKNOWN_BMI_FILE));
+    }
+    SharedMapping &shared = *it->second;
+    if (shared.mapping.file.data())
+    {
+        return {};
+    }
+    return map(shared, PagePolicy::WILL_NEED);
+}
+
+// Requests made by the IPCManagerCompiler always have the hash, even if it is not sent.
+static uint64_t getHash(const CTBModule &request)
+{
+    return request.hashed ? request.hash : hashLogicalName(request.moduleName);
+}
+
+static uint64_t getHash(const CTBNonModule &request)
+{
+    return request.hashed ? request.hash : hashLogicalName(request.logicalName);
+}
+
+// Reads the hashed flag and the hashes that follow it if it is set. Returns the 8 bytes of every hash, or an empty
+// string_view if these are not sent. These are only sent in WireFormat::V1_HASHED.
+static tl::expected<std::string_view, std::string> readHashes(const std::string_view message, uint32_t &bytesRead,
+                                                              const WireFormat wireFormat)
+{
+    if (wireFormat != WireFormat::V1_HASHED)
+    {
+        return std::string_view{};
+    }
+    TRY_READ_VAL(hashed, Manager::readBool, message, bytesRead);
+    if (!hashed)
+    {
+        return std::string_view{};
+    }
+    TRY_READ_VAL(hashesSize, Manager::readUInt32, message, bytesRead);
+    if (hashesSize > (message.size() - bytesRead) / 8)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    const std::string_view hashes = message.substr(bytesRead, hashesSize * 8);
+    bytesRead += hashesSize * 8;
+    return hashes;
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::addResponse(const std::string_view logicalName, const uint64_t hash,
+                                                                const BMIFileMapping &mapping, const FileType type,
+                                                                const bool isSystem)
+{
+    if (responses.find(logicalName, hash))
+    {
+        return {};
+    }
+    const auto it = mappingsByPath.find(mapping.file.filePath);
+    if (it == mappingsByPath.end())
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::UNKNOWN_BMI_FILE));
+    }
+    SharedMapping &shared = *it->second;
+    if (shared.response == UINT32_MAX || responses.getResponse(shared.response).type != type ||
+        responses.getResponse(shared.response).isSystem != isSystem)
+    {
+        shared.response = responses.addResponse(Response(mapping.file.filePath, shared.mapping, type, isSystem));
+    }
+    responses.insert(arena.save(logicalName), hash, shared.response);
+    ++shared.references;
+    return {};
+}
+
+void IPCManagerCompiler::addHeaderFile(const std::string_view logicalName, const uint64_t hash,
+                                       const std::string_view filePath, const bool isSystem)
+{
+    if (!responses.find(logicalName, hash))
+    {
+        responses.insert(arena.save(logicalName), hash,
+                         responses.addResponse(Response(arena.save(filePath), {}, FileType::HEADER_FILE, isSystem)));
     }
 }
 
@@ -159,20 +465,106 @@ tl::expected<void, std::string> IPCManagerCompiler::readLogicalNames(const std::
                                                                      uint32_t &bytesRead, const BMIFileMapping &mapping,
                                                                      const FileType type, const bool isSystem)
 {
+    TRY_READ_VAL(hashes, readHashes, message, bytesRead, wireFormat);
     TRY_READ_VAL(logicalNamesSize, readUInt32, message, bytesRead);
+    if (!hashes.empty() && hashes.size() != logicalNamesSize * uint64_t{8})
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    // Every logical-name takes at least 4 bytes, so a corrupt count does not reserve more than the message has.
+    responses.reserve(std::min<uint32_t>(logicalNamesSize, (message.size() - bytesRead) / 4));
     for (uint32_t i = 0; i < logicalNamesSize; ++i)
     {
-        TRY_READ_VAL(logicalName, readString, message, bytesRead);
-        responses.emplace(logicalName, Response(mapping.file.filePath, mapping.mapping, type, isSystem));
+        TRY_READ_VAL(logicalName, readReplyString, message, bytesRead, false);
+        uint64_t hash;
+        if (hashes.empty())
+        {
+            hash = hashLogicalName(logicalName);
+        }
+        else
+        {
+            memcpy(&hash, hashes.data() + i * 8, 8);
+        }
+        TRY_READ(response, addResponse, logicalName, hash, mapping, type, isSystem);
     }
 
     return {};
 }
 
-tl::expected<void, std::string> IPCManagerCompiler::receiveBTCLastMessage() const
+tl::expected<void, std::string> IPCManagerCompiler::readFlatLogicalNames(const FlatMessage &flat,
+                                                                         const FlatVector<FlatString> &logicalNames,
+                                                                         const BMIFileMapping &mapping,
+                                                                         const FileType type, const bool isSystem)
+{
+    responses.reserve(logicalNames.count);
+    for (uint32_t i = 0; i < logicalNames.count; ++i)
+    {
+        const std::string_view logicalName = flat.get(flat.get(logicalNames, i));
+        TRY_READ(response, addResponse, logicalName, hashLogicalName(logicalName), mapping, type, isSystem);
+    }
+    return {};
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::readFlatBTCModule(const CTBModule &moduleName,
+                                                                      const std::string_view message)
+{
+    TRY_READ_VAL(flat, FlatMessage::openBTCModule, message);
+    const auto &root = flat.root<FlatBTCModule>();
+
+    TRY_READ_VAL(requested, mapBMIFile, flat.get(root.requested));
+    TRY_READ(response, addResponse, moduleName.moduleName, getHash(moduleName), requested, FileType::MODULE,
+             root.isSystem);
+
+    for (uint32_t i = 0; i < root.modDeps.count; ++i)
+    {
+        const FlatModuleDep &modDep = flat.get(root.modDeps, i);
+        TRY_READ_VAL(modDepFile, mapBMIFile, flat.get(modDep.file));
+        TRY_READ(names, readFlatLogicalNames, flat, modDep.logicalNames, modDepFile,
+                 modDep.isHeaderUnit ? FileType::HEADER_UNIT : FileType::MODULE, modDep.isSystem);
+    }
+    return {};
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::readFlatBTCNonModule(const CTBNonModule &nonModule,
+                                                                         const std::string_view message)
+{
+    TRY_READ_VAL(flat, FlatMessage::openBTCNonModule, message);
+    const auto &root = flat.root<FlatBTCNonModule>();
+
+    responses.reserve(root.headerFiles.count + 1);
+    for (uint32_t i = 0; i < root.headerFiles.count; ++i)
+    {
+        const FlatHeaderFile &headerFile = flat.get(root.headerFiles, i);
+        const std::string_view logicalName = flat.get(headerFile.logicalName);
+        addHeaderFile(logicalName, hashLogicalName(logicalName), flat.get(headerFile.filePath),
+                      headerFile.isSystem != 0);
+    }
+
+    if (!root.isHeaderUnit)
+    {
+        addHeaderFile(nonModule.logicalName, getHash(nonModule), flat.get(root.filePath), root.isSystem != 0);
+        return {};
+    }
+
+    TRY_READ_VAL(file, mapBMIFile, BMIFile{flat.get(root.filePath), root.fileSize});
+    TRY_READ(response, addResponse, nonModule.logicalName, getHash(nonModule), file, FileType::HEADER_UNIT,
+             root.isSystem != 0);
+    TRY_READ(names, readFlatLogicalNames, flat, root.logicalNames, file, FileType::HEADER_UNIT, root.isSystem);
+
+    for (uint32_t i = 0; i < root.huDeps.count; ++i)
+    {
+        const FlatHuDep &huDep = flat.get(root.huDeps, i);
+        TRY_READ_VAL(huDepFile, mapBMIFile, flat.get(huDep.file));
+        TRY_READ(names, readFlatLogicalNames, flat, huDep.logicalNames, huDepFile, FileType::HEADER_UNIT,
+                 huDep.isSystem);
+    }
+    return {};
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::receiveBTCLastMessage()
 {
     char buffer[4096];
-    const auto &r = readInternal(buffer);
+    const auto &r = readInternal(buffer, BTC::LAST_MESSAGE);
     if (!r)
     {
         return tl::unexpected(r.error());
@@ -180,7 +572,7 @@ tl::expected<void, std::string> IPCManagerCompiler::receiveBTCLastMessage() cons
 
     // The BTCLastMessage must be 1 byte of true signaling that build-system has successfully created a shared memory
     // mapping of the BMI file.
-    if (buffer[0] != static_cast<char>(true))
+    if (r->empty() || (*r)[0] != static_cast<char>(true))
     {
         return tl::unexpected(getErrorString(ErrorCategory::INCORRECT_BTC_LAST_MESSAGE));
     }
@@ -195,33 +587,52 @@ tl::expected<void, std::string> IPCManagerCompiler::receiveBTCLastMessage() cons
 
 tl::expected<void, std::string> IPCManagerCompiler::receiveBTCModule(const CTBModule &moduleName)
 {
-    std::string buffer = getBufferWithType(CTB::MODULE);
-    writeString(buffer, moduleName.moduleName);
-    writeUInt32(buffer, buffer.size());
-    buffer.append(delimiter, strlen(delimiter));
+    if (const auto &r = waitForAllPrefetches(); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+
+    std::string buffer = getBufferWithType(CTB::MODULE, serializedSize(moduleName, wireFormat));
+    serialize(buffer, moduleName, nullptr, wireFormat);
     // This call sends the CTBModule to the build-system.
-    if (const auto &r = writeInternal(buffer); !r)
+    if (const auto &r = writeMessage(buffer); !r)
     {
         return tl::unexpected(r.error());
     }
 
     char stackBuffer[4096];
-    auto received = readInternal(stackBuffer);
+    auto received = readInternal(stackBuffer, BTC::MODULE);
 
     if (!received)
     {
         return tl::unexpected(received.error());
     }
     const std::string_view message = *received;
+    if (wireFormat == WireFormat::V2)
+    {
+        return readFlatBTCModule(moduleName, message);
+    }
 
     uint32_t bytesRead = 0;
+    if (const auto &r = readBTCModule(moduleName, message, bytesRead); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    if (message.size() != bytesRead)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    return {};
+}
 
+tl::expected<void, std::string> IPCManagerCompiler::readBTCModule(const CTBModule &moduleName,
+                                                                  const std::string_view message, uint32_t &bytesRead)
+{
     TRY_READ_VAL(requested, readProcessMappingOfBMIFile, message, bytesRead);
     TRY_READ_VAL(isSystem, readBool, message, bytesRead);
 
-    std::string *str = new std::string(moduleName.moduleName);
-    allocations.emplace_back(str);
-    responses.emplace(*str, Response(requested.file.filePath, requested.mapping, FileType::MODULE, isSystem));
+    TRY_READ(response, addResponse, moduleName.moduleName, getHash(moduleName), requested, FileType::MODULE,
+             isSystem);
 
     TRY_READ_VAL(modDepsSize, readUInt32, message, bytesRead);
 
@@ -247,28 +658,26 @@ tl::expected<void, std::string> IPCManagerCompiler::receiveBTCModule(const CTBMo
         }
     }
 
-    if (message.size() != bytesRead)
-    {
-        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
-    }
     return {};
 }
 
 tl::expected<void, std::string> IPCManagerCompiler::receiveBTCNonModule(const CTBNonModule &nonModule)
 {
-    std::string buffer = getBufferWithType(CTB::NON_MODULE);
-    buffer.push_back(nonModule.isHeaderUnit);
-    writeString(buffer, nonModule.logicalName);
-    writeUInt32(buffer, buffer.size());
-    buffer.append(delimiter, strlen(delimiter));
+    if (const auto &r = waitForAllPrefetches(); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+
+    std::string buffer = getBufferWithType(CTB::NON_MODULE, serializedSize(nonModule, wireFormat));
+    serialize(buffer, nonModule, nullptr, wireFormat);
     // This call sends the CTBNonModule to the build-system.
-    if (const auto &r = writeInternal(buffer); !r)
+    if (const auto &r = writeMessage(buffer); !r)
     {
         return tl::unexpected(r.error());
     }
 
     char stackBuffer[4096];
-    auto received = readInternal(stackBuffer);
+    auto received = readInternal(stackBuffer, BTC::NON_MODULE);
 
     if (!received)
     {
@@ -276,49 +685,156 @@ tl::expected<void, std::string> IPCManagerCompiler::receiveBTCNonModule(const CT
     }
 
     std::string_view readCompilerMessage = *received;
+    if (wireFormat == WireFormat::V2)
+    {
+        return readFlatBTCNonModule(nonModule, readCompilerMessage);
+    }
     uint32_t bytesRead = 0;
+    if (const auto &r = readBTCNonModule(nonModule, readCompilerMessage, bytesRead); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    if (readCompilerMessage.size() != bytesRead)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    return {};
+}
 
-    TRY_READ_VAL(isHeaderUnit, readBool, readCompilerMessage, bytesRead);
-    TRY_READ_VAL(isSystem, readBool, readCompilerMessage, bytesRead);
-    TRY_READ_VAL(headerFilesSize, readUInt32, readCompilerMessage, bytesRead);
+tl::expected<void, std::string> IPCManagerCompiler::readBTCNonModule(const CTBNonModule &nonModule,
+                                                                     const std::string_view message,
+                                                                     uint32_t &bytesRead)
+{
+    TRY_READ_VAL(isHeaderUnit, readBool, message, bytesRead);
+    TRY_READ_VAL(isSystem, readBool, message, bytesRead);
+    TRY_READ_VAL(headerFilesSize, readUInt32, message, bytesRead);
 
+    responses.reserve(std::min<uint32_t>(headerFilesSize, (message.size() - bytesRead) / 4) + 1);
     for (uint32_t i = 0; i < headerFilesSize; ++i)
     {
-        TRY_READ_VAL(logicalName, readString, readCompilerMessage, bytesRead);
-        TRY_READ_VAL(filePath, readPath, readCompilerMessage, bytesRead);
-        TRY_READ_VAL(isSystemHeaderFile, readBool, readCompilerMessage, bytesRead);
-
-        responses.emplace(logicalName, Response{filePath, {}, FileType::HEADER_FILE, isSystemHeaderFile});
+        HeaderFile headerFile;
+        TRY_READ(r, deserialize, message, bytesRead, headerFile, getDictionary(), wireFormat);
+        addHeaderFile(headerFile.logicalName,
+                      headerFile.hashed ? headerFile.hash : hashLogicalName(headerFile.logicalName),
+                      headerFile.filePath, headerFile.isSystem);
     }
 
-    std::string *str = new std::string(nonModule.logicalName);
-    allocations.emplace_back(str);
     if (!isHeaderUnit)
     {
-        TRY_READ_VAL(filePath, readPath, readCompilerMessage, bytesRead);
-        responses.emplace(*str, Response{filePath, {}, FileType::HEADER_FILE, isSystem});
-        if (readCompilerMessage.size() != bytesRead)
-        {
-            return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
-        }
+        TRY_READ_VAL(filePath, readReplyString, message, bytesRead, true);
+        addHeaderFile(nonModule.logicalName, getHash(nonModule), filePath, isSystem);
         return {};
     }
 
-    TRY_READ_VAL(file, readProcessMappingOfBMIFile, readCompilerMessage, bytesRead);
-    responses.emplace(*str, Response{file.file.filePath, file.mapping, FileType::HEADER_UNIT, isSystem});
+    TRY_READ_VAL(file, readProcessMappingOfBMIFile, message, bytesRead);
+    TRY_READ(response, addResponse, nonModule.logicalName, getHash(nonModule), file, FileType::HEADER_UNIT,
+             isSystem);
 
-    TRY_READ(logicalNames, readLogicalNames, readCompilerMessage, bytesRead, file, FileType::HEADER_UNIT, isSystem);
+    TRY_READ(logicalNames, readLogicalNames, message, bytesRead, file, FileType::HEADER_UNIT, isSystem);
 
-    TRY_READ_VAL(huDepsSize, readUInt32, readCompilerMessage, bytesRead);
+    TRY_READ_VAL(huDepsSize, readUInt32, message, bytesRead);
     for (uint32_t i = 0; i < huDepsSize; ++i)
     {
-        TRY_READ_VAL(huDepFile, readProcessMappingOfBMIFile, readCompilerMessage, bytesRead);
-        TRY_READ_VAL(huDepIsSystem, readBool, readCompilerMessage, bytesRead);
-        TRY_READ(huDeplogicalNames, readLogicalNames, readCompilerMessage, bytesRead, huDepFile, FileType::HEADER_UNIT,
+        TRY_READ_VAL(huDepFile, readProcessMappingOfBMIFile, message, bytesRead);
+        TRY_READ_VAL(huDepIsSystem, readBool, message, bytesRead);
+        TRY_READ(huDeplogicalNames, readLogicalNames, message, bytesRead, huDepFile, FileType::HEADER_UNIT,
                  huDepIsSystem);
     }
 
-    if (readCompilerMessage.size() != bytesRead)
+    return {};
+}
+
+Response *IPCManagerCompiler::findCached(const std::string_view logicalName, const uint64_t hash, const FileType type)
+{
+    Response *response = responses.find(logicalName, hash);
+    // This requests from the build-system if we don't have an entry for the logicalName or if there is a type
+    // mismatch between the request and the response. Only allowed mismatch is if the request is of header-file and
+    // the response is a header-unit instead. For other mismatches compiler will request the build-system which will
+    // give not found error. HMake at config-time checks for the logicalName collision and also that a file is not
+    // registered as 2 of header-file, header-unit and module.
+    if (!response ||
+        (response->type != type && (response->type != FileType::HEADER_UNIT || type != FileType::HEADER_FILE)))
+    {
+        return nullptr;
+    }
+    return response;
+}
+
+// WireFormat::V2 reply in a BTCBatch. It is preceded by its size and padded to keep the next one aligned.
+static tl::expected<std::string_view, std::string> readBatchedFlatReply(const std::string_view message,
+                                                                        uint32_t &bytesRead)
+{
+    const auto &r = Manager::readUInt32(message, bytesRead);
+    if (!r)
+    {
+        return tl::unexpected(r.error());
+    }
+    const uint64_t paddedSize = (static_cast<uint64_t>(*r) + 3) & ~3ull;
+    if (paddedSize > message.size() - bytesRead)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    const std::string_view reply = message.substr(bytesRead, *r);
+    bytesRead += paddedSize;
+    return reply;
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::receiveBTCBatch(const CTBBatch &batch)
+{
+    std::string buffer = getBufferWithType(CTB::BATCH, serializedSize(batch, wireFormat));
+    serialize(buffer, batch, nullptr, wireFormat);
+    // This call sends the CTBBatch to the build-system.
+    if (const auto &r = writeMessage(buffer); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+
+    char stackBuffer[4096];
+    auto received = readInternal(stackBuffer, BTC::BATCH);
+    if (!received)
+    {
+        return tl::unexpected(received.error());
+    }
+    const std::string_view message = *received;
+    uint32_t bytesRead = 0;
+
+    TRY_READ_VAL(modulesSize, readUInt32, message, bytesRead);
+    if (modulesSize != batch.modules.size())
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    for (const CTBModule &moduleName : batch.modules)
+    {
+        if (wireFormat == WireFormat::V2)
+        {
+            TRY_READ_VAL(reply, readBatchedFlatReply, message, bytesRead);
+            TRY_READ(r, readFlatBTCModule, moduleName, reply);
+        }
+        else
+        {
+            TRY_READ(r, readBTCModule, moduleName, message, bytesRead);
+        }
+    }
+
+    TRY_READ_VAL(nonModulesSize, readUInt32, message, bytesRead);
+    if (nonModulesSize != batch.nonModules.size())
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    for (const CTBNonModule &nonModule : batch.nonModules)
+    {
+        if (wireFormat == WireFormat::V2)
+        {
+            TRY_READ_VAL(reply, readBatchedFlatReply, message, bytesRead);
+            TRY_READ(r, readFlatBTCNonModule, nonModule, reply);
+        }
+        else
+        {
+            TRY_READ(r, readBTCNonModule, nonModule, message, bytesRead);
+        }
+    }
+
+    if (message.size() != bytesRead)
     {
         return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
     }
@@ -338,19 +854,36 @@ tl::expected<Response, std::string> IPCManagerCompiler::findResponse(std::string
     }
 #endif
 
-    if (const auto &it = responses.find(logicalName);
-        // This requests from the build-system if we don't have an entry for the logicalName or if there is a type
-        // mismatch between the request and the response. Only allowed mismatch is if the request is of header-file and
-        // the response is a header-unit instead. For other mismatches compiler will request the build-system which will
-        // give not found error. HMake at config-time checks for the logicalName collision and also that a file is not
-        // registered as 2 of header-file, header-unit and module.
-        it == responses.end() ||
-        (it->second.type != type && (it->second.type != FileType::HEADER_UNIT || type != FileType::HEADER_FILE)))
+    const uint64_t hash = hashLogicalName(logicalName);
+    if (Response *cached = findCached(logicalName, hash, type); !cached)
     {
-        if (type == FileType::MODULE)
+        // If there are outstanding prefetches, this request is also sent as one, as its reply could otherwise be
+        // received before theirs.
+        uint32_t requestId = 0;
+        const std::unordered_map<std::string_view, uint32_t> &pending = pendingLogicalNames[static_cast<uint8_t>(type)];
+        if (const auto &it2 = pending.find(logicalName); it2 != pending.end())
+        {
+            requestId = it2->second;
+        }
+        else if (!pendingRequests.empty())
+        {
+            TRY_READ_VAL(r, prefetch, logicalName, type);
+            requestId = r;
+        }
+
+        if (requestId)
+        {
+            if (const auto &r2 = waitForPrefetch(requestId); !r2)
+            {
+                return tl::unexpected(r2.error());
+            }
+        }
+        else if (type == FileType::MODULE)
         {
             CTBModule ctbModule;
             ctbModule.moduleName = logicalName;
+            ctbModule.hashed = true;
+            ctbModule.hash = hash;
             if (const auto &r2 = receiveBTCModule(ctbModule); !r2)
             {
                 return tl::unexpected(r2.error());
@@ -361,27 +894,209 @@ tl::expected<Response, std::string> IPCManagerCompiler::findResponse(std::string
             CTBNonModule ctbNonModule;
             ctbNonModule.logicalName = logicalName;
             ctbNonModule.isHeaderUnit = type == FileType::HEADER_UNIT;
+            ctbNonModule.hashed = true;
+            ctbNonModule.hash = hash;
             if (const auto &r2 = receiveBTCNonModule(ctbNonModule); !r2)
             {
                 return tl::unexpected(r2.error());
             }
         }
 
-        return responses.at(logicalName);
+        // Response of another type might be cached for the logicalName, e.g. by a prefetch of another type.
+        Response *response = findCached(logicalName, hash, type);
+        if (!response)
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+        }
+        if (const auto &r = mapResponse(*response); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+        return *response;
     }
     else
+    {
+        if (const auto &r = mapResponse(*cached); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+        return *cached;
+    }
+}
+
+tl::expected<uint32_t, std::string> IPCManagerCompiler::prefetch(const std::string_view logicalName,
+                                                                  const FileType type)
+{
+    const uint64_t hash = hashLogicalName(logicalName);
+    if (findCached(logicalName, hash, type))
+    {
+        return 0;
+    }
+    std::unordered_map<std::string_view, uint32_t> &pending = pendingLogicalNames[static_cast<uint8_t>(type)];
+    if (const auto &it = pending.find(logicalName); it != pending.end())
     {
         return it->second;
     }
+    if (pendingRequests.size() == maxPendingRequests)
+    {
+        if (const auto &r = receivePrefetchReply(); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+    }
+
+    const CTBPrefetch ctbPrefetch{nextRequestId, type == FileType::MODULE, type == FileType::HEADER_UNIT,
+                                  arena.save(logicalName), true, hash};
+    std::string buffer = getBufferWithType(CTB::PREFETCH, serializedSize(ctbPrefetch, wireFormat));
+    serialize(buffer, ctbPrefetch, nullptr, wireFormat);
+    // This call sends the CTBPrefetch to the build-system.
+    if (const auto &r = writeMessage(buffer); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+
+    pendingRequests.emplace(ctbPrefetch.requestId, PendingRequest{ctbPrefetch.logicalName, hash, type});
+    pending.emplace(ctbPrefetch.logicalName, ctbPrefetch.requestId);
+    // 0 is never a request ID.
+    nextRequestId = nextRequestId == UINT32_MAX ? 1 : nextRequestId + 1;
+    return ctbPrefetch.requestId;
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::receivePrefetchReply()
+{
+    char stackBuffer[4096];
+    auto received = readInternal(stackBuffer, BTC::PREFETCH);
+    if (!received)
+    {
+        return tl::unexpected(received.error());
+    }
+    const std::string_view message = *received;
+    uint32_t bytesRead = 0;
+
+    TRY_READ_VAL(requestId, readUInt32, message, bytesRead);
+    const auto it = pendingRequests.find(requestId);
+    if (it == pendingRequests.end())
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    const PendingRequest request = it->second;
+    pendingRequests.erase(it);
+    pendingLogicalNames[static_cast<uint8_t>(request.type)].erase(request.logicalName);
+
+    if (request.type == FileType::MODULE)
+    {
+        const CTBModule moduleName{request.logicalName, true, request.hash};
+        if (wireFormat == WireFormat::V2)
+        {
+            // The reply follows the 4 bytes requestId, so it is still aligned.
+            return readFlatBTCModule(moduleName, message.substr(bytesRead));
+        }
+        TRY_READ(r, readBTCModule, moduleName, message, bytesRead);
+    }
+    else
+    {
+        const CTBNonModule nonModule{request.type == FileType::HEADER_UNIT, request.logicalName, true, request.hash};
+        if (wireFormat == WireFormat::V2)
+        {
+            return readFlatBTCNonModule(nonModule, message.substr(bytesRead));
+        }
+        TRY_READ(r, readBTCNonModule, nonModule, message, bytesRead);
+    }
+
+    if (message.size() != bytesRead)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    return {};
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::waitForPrefetch(const uint32_t requestId)
+{
+    while (pendingRequests.find(requestId) != pendingRequests.end())
+    {
+        if (const auto &r = receivePrefetchReply(); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+    }
+    return {};
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::waitForAllPrefetches()
+{
+    while (!pendingRequests.empty())
+    {
+        if (const auto &r = receivePrefetchReply(); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+    }
+    return {};
+}
+
+tl::expected<std::vector<Response>, std::string> IPCManagerCompiler::findResponses(
+    const std::vector<std::pair<std::string_view, FileType>> &requests)
+{
+    if (const auto &r = waitForAllPrefetches(); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+
+    std::vector<uint64_t> hashes;
+    hashes.reserve(requests.size());
+    CTBBatch batch;
+    // By FileType, so a logical-name requested as more than one kind is sent once for each.
+    std::unordered_set<std::string_view> requested[3];
+    for (const auto &[logicalName, type] : requests)
+    {
+        const uint64_t hash = hashes.emplace_back(hashLogicalName(logicalName));
+        if (findCached(logicalName, hash, type) || !requested[static_cast<uint8_t>(type)].emplace(logicalName).second)
+        {
+            continue;
+        }
+        if (type == FileType::MODULE)
+        {
+            batch.modules.push_back(CTBModule{logicalName, true, hash});
+        }
+        else
+        {
+            batch.nonModules.push_back(CTBNonModule{type == FileType::HEADER_UNIT, logicalName, true, hash});
+        }
+    }
+
+    if (!batch.modules.empty() || !batch.nonModules.empty())
+    {
+        if (const auto &r = receiveBTCBatch(batch); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+    }
+
+    std::vector<Response> result;
+    result.reserve(requests.size());
+    for (uint32_t i = 0; i < requests.size(); ++i)
+    {
+        Response *response = responses.find(requests[i].first, hashes[i]);
+        if (!response)
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+        }
+        if (const auto &r = mapResponse(*response); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+        result.emplace_back(*response);
+    }
+    return result;
 }
 
-tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const uint32_t fileSize) const
+tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const uint32_t fileSize,
+                                                                       const uint64_t hash) const
 {
-    std::string buffer = getBufferWithType(CTB::LAST_MESSAGE);
-    writeUInt32(buffer, fileSize);
-    writeUInt32(buffer, buffer.size());
-    buffer.append(delimiter, strlen(delimiter));
-    if (const auto &r = writeInternal(buffer); !r)
+    const CTBLastMessage lastMessage{fileSize, true, hash};
+    std::string buffer = getBufferWithType(CTB::LAST_MESSAGE, serializedSize(lastMessage, wireFormat));
+    serialize(buffer, lastMessage, nullptr, wireFormat);
+    if (const auto &r = writeMessage(buffer); !r)
     {
         return tl::unexpected(r.error());
     }
@@ -389,9 +1104,20 @@ tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const uin
 }
 
 tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const std::string &bmiFile,
-                                                                       const std::string &filePath) const
+                                                                       const std::string &filePath)
 {
+    if (const auto &r = waitForAllPrefetches(); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    const uint64_t bmiHash = rapidhash(bmiFile.data(), bmiFile.size());
+
 #ifdef _WIN32
+    // The file might be a hard-link to a BMI in the BMIStore, which must not be overwritten.
+    if (!DeleteFileA(filePath.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND)
+    {
+        return tl::unexpected(getErrorString());
+    }
     const HANDLE hFile = CreateFileA(filePath.c_str(), GENERIC_READ | GENERIC_WRITE,
                                      0, // no sharing during setup
                                      nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
@@ -430,7 +1156,7 @@ tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const std
 
     memcpy(pView, bmiFile.c_str(), bmiFile.size());
 
-    if (!FlushViewOfFile(pView, bmiFile.size()))
+    if (bmiPublication == BMIPublication::SYNC && !FlushViewOfFile(pView, bmiFile.size()))
     {
         return tl::unexpected(getErrorString());
     }
@@ -438,7 +1164,7 @@ tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const std
     UnmapViewOfFile(pView);
     CloseHandle(hFile);
 
-    if (const auto &r = sendCTBLastMessage(fileSize.QuadPart); !r)
+    if (const auto &r = sendCTBLastMessage(fileSize.QuadPart, bmiHash); !r)
     {
         return tl::unexpected(r.error());
     }
@@ -454,7 +1180,11 @@ tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const std
 #else
 
     const uint64_t fileSize = bmiFile.size();
-    // 1. Open & size
+    // 1. Open & size. The file might be a hard-link to a BMI in the BMIStore, which must not be overwritten.
+    if (unlink(filePath.c_str()) == -1 && errno != ENOENT)
+    {
+        return tl::unexpected(getErrorString());
+    }
     const int fd = open(filePath.c_str(), O_RDWR | O_CREAT, 0666);
     if (fd == -1)
     {
@@ -465,6 +1195,31 @@ tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const std
         return tl::unexpected(getErrorString());
     }
 
+    if (bmiPublication == BMIPublication::WRITE_BEHIND)
+    {
+        // Written in the page-cache without mapping the file, and without waiting for the disk.
+        for (uint64_t written = 0; written != fileSize;)
+        {
+            const int64_t result = pwrite(fd, bmiFile.data() + written, fileSize - written, written);
+            if (result == -1)
+            {
+                const std::string error = getErrorString();
+                close(fd);
+                return tl::unexpected(error);
+            }
+            written += result;
+        }
+        if (close(fd) == -1)
+        {
+            return tl::unexpected(getErrorString());
+        }
+        if (const auto &r = sendCTBLastMessage(fileSize, bmiHash); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+        return receiveBTCLastMessage();
+    }
+
     // 2. Map for write
     void *mapping = mmap(nullptr, fileSize, PROT_WRITE, MAP_SHARED, fd, 0);
     if (mapping == MAP_FAILED)
@@ -483,7 +1238,7 @@ tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const std
         return tl::unexpected(getErrorString());
     }
 
-    if (const auto &r = sendCTBLastMessage(fileSize); !r)
+    if (const auto &r = sendCTBLastMessage(fileSize, bmiHash); !r)
     {
         return tl::unexpected(r.error());
     }
@@ -501,10 +1256,50 @@ tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(const std
     return {};
 }
 
-tl::expected<Mapping, std::string> IPCManagerCompiler::readSharedMemoryBMIFile(const BMIFile &file)
+tl::expected<void, std::string> IPCManagerCompiler::sendCTBLastMessage(BMIWriter &writer)
+{
+    if (const auto &r = waitForAllPrefetches(); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+
+    // Hashed before the seal as the mapping is unmapped by it on Windows.
+    const std::string_view bmi = writer.getBMI();
+    const uint64_t bmiHash = rapidhash(bmi.data(), bmi.size());
+    const auto &fileSize = writer.seal(bmiPublication == BMIPublication::SYNC);
+    if (!fileSize)
+    {
+        return tl::unexpected(fileSize.error());
+    }
+    if (const auto &r = sendCTBLastMessage(*fileSize, bmiHash); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    // Build-system will send the BTCLastMessage after it has created the BMI file-mapping. Compiler process can not
+    // exit before that.
+    if (const auto &r = receiveBTCLastMessage(); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    return writer.unmap();
+}
+
+const ArenaStats &IPCManagerCompiler::getArenaStats() const
+{
+    return arena.getStats();
+}
+
+const SessionDictionaryStats &IPCManagerCompiler::getDictionaryStats() const
+{
+    return dictionary.getStats();
+}
+
+tl::expected<Mapping, std::string> IPCManagerCompiler::readSharedMemoryBMIFile(const BMIFile &file,
+                                                                               const PagePolicy policy)
 {
     Mapping f{};
 #ifdef _WIN32
+    (void)policy;
 
     // mappingName is needed as the Windows kernel object names can't have \\ in them.
     const uint64_t hash = rapidhash(file.filePath.data(), file.filePath.size());
@@ -551,19 +1346,19 @@ tl::expected<Mapping, std::string> IPCManagerCompiler::readSharedMemoryBMIFile(c
     {
         return tl::unexpected(getErrorString());
     }
-    void *mapping = mmap(nullptr, file.fileSize, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    const auto &r = mapFile(fd, file.fileSize, policy);
 
     if (close(fd) == -1)
     {
         return tl::unexpected(getErrorString());
     }
 
-    if (mapping == MAP_FAILED)
+    if (!r)
     {
-        return tl::unexpected(getErrorString());
+        return tl::unexpected(r.error());
     }
 
-    f.file = {static_cast<char *>(mapping), file.fileSize};
+    f = *r;
 #endif
     return f;
 }
@@ -582,6 +1377,66 @@ tl::expected<void, std::string> IPCManagerCompiler::closeBMIFileMapping(const Ma
     return {};
 }
 
+tl::expected<void, std::string> IPCManagerCompiler::closeBMIFileMapping(const std::string_view logicalName)
+{
+    const Response *erased = responses.erase(logicalName);
+    if (!erased)
+    {
+        return {};
+    }
+    const Response response = *erased;
+    if (response.type == FileType::HEADER_FILE)
+    {
+        return {};
+    }
+
+    const auto it = mappingsByPath.find(response.filePath);
+    if (it == mappingsByPath.end())
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::UNKNOWN_BMI_FILE));
+    }
+    if (--it->second->references)
+    {
+        return {};
+    }
+    return eraseMapping(*it->second);
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::closeUnreferencedBMIFiles()
+{
+    for (auto it = sharedMappings.begin(); it != sharedMappings.end();)
+    {
+        SharedMapping &shared = *it++;
+        if (!shared.references)
+        {
+            if (const auto &r = eraseMapping(shared); !r)
+            {
+                return tl::unexpected(r.error());
+            }
+        }
+    }
+    return {};
+}
+
+tl::expected<void, std::string> IPCManagerCompiler::eraseMapping(SharedMapping &shared)
+{
+    for (const std::string_view filePath : shared.filePaths)
+    {
+        mappingsByPath.erase(filePath);
+        filePathProcessMapping.erase(filePath);
+    }
+#ifndef _WIN32
+    mappedFiles.erase({shared.device, shared.inode});
+#endif
+    const Mapping mapping = shared.mapping;
+    sharedMappings.erase(shared.position);
+    if (!mapping.file.data())
+    {
+        return {};
+    }
+    return closeBMIFileMapping(mapping);
+}
+
 bool operator==(const CTBNonModule &lhs, const CTBNonModule &rhs)
 {
     return lhs.isHeaderUnit == rhs.isHeaderUnit && lhs.logicalName == rhs.logicalName;
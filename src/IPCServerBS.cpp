@@ -0,0 +1,958 @@
+
+#include "IPCServerBS.hpp"
+#include "Manager.hpp"
+
+#ifndef _WIN32
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace P2978
+{
+
+// Size of one read of the compiler output.
+static constexpr uint32_t readSize = 64 * 1024;
+// Events processed per epoll_wait. Ready connections that do not fit are returned by the next call.
+static constexpr uint32_t maxEvents = 64;
+// IOEngine::IO_URING. The buffers are shared by all the connections and are returned to the kernel right after the
+// completion is processed.
+static constexpr uint32_t ringEntries = 1024;
+static constexpr uint32_t ringBufferCount = 1024;
+static constexpr uint32_t ringBufferSize = 8 * 1024;
+
+// user_data of an SQE is the connection with the operation in the low bits.
+enum Operation : uint64_t
+{
+    READ,
+    WRITE,
+    CANCEL,
+    // Read of the Workers::eventFd. user_data has no connection.
+    WAKE,
+};
+static constexpr uint64_t operationMask = 3;
+
+static uint64_t getUserData(IPCServerBS::Connection &connection, const Operation operation)
+{
+    return reinterpret_cast<uint64_t>(&connection) | operation;
+}
+
+static tl::expected<void, std::string> submitCancel(IOUring &ring, IPCServerBS::Connection &connection,
+                                                    const Operation operation)
+{
+    auto r = ring.getSqe();
+    if (!r)
+    {
+        return tl::unexpected(r.error());
+    }
+    io_uring_sqe &sqe = **r;
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = -1;
+    sqe.addr = getUserData(connection, operation);
+    sqe.user_data = getUserData(connection, CANCEL);
+    return {};
+}
+
+static tl::expected<void, std::string> setNonBlocking(const uint64_t fd)
+{
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    return {};
+}
+
+IPCServerBS::Connection::Connection(const IPCManagerBS &manager_, const uint64_t outputFd_)
+    : outputSource{this, SourceType::OUTPUT}, socketSource{this, SourceType::SOCKET},
+      inputSource{this, SourceType::INPUT}, manager(manager_), outputFd(outputFd_)
+{
+    // Only this manager sends on the connection, so it interns the strings. Copies made for the workers do not.
+    manager.dictionary = SessionDictionary();
+}
+
+IPCServerBS::ReplyTask::ReplyTask(Connection &connection_, ReplyBuilder build_)
+    : connection(&connection_), manager(connection_.manager), build(std::move(build_))
+{
+    manager.writeQueue = &output;
+}
+
+IPCServerBS::Workers::Workers(const uint32_t threadCount, const uint64_t eventFd_)
+    : pool(threadCount), eventFd(eventFd_)
+{
+}
+
+IPCServerBS::Ownership::Ownership(Ownership &&other) noexcept : owned(other.owned)
+{
+    other.owned = false;
+}
+
+IPCServerBS::IPCServerBS(const IOEngine engine_) : engine(engine_)
+{
+    if (engine == IOEngine::EPOLL)
+    {
+        readBuffer.resize(readSize);
+    }
+}
+
+tl::expected<IPCServerBS, std::string> IPCServerBS::create(const IOEngine engine_, const uint32_t workerCount)
+{
+    IPCServerBS server(engine_);
+    if (engine_ == IOEngine::IO_URING)
+    {
+        auto r = IOUring::create(ringEntries, ringBufferCount, ringBufferSize);
+        if (!r)
+        {
+            return tl::unexpected(r.error());
+        }
+        server.ring = *r;
+        server.ownership.owned = true;
+    }
+    else
+    {
+        const int fd = epoll_create1(EPOLL_CLOEXEC);
+        if (fd == -1)
+        {
+            return tl::unexpected(getErrorString());
+        }
+        server.epollFd = fd;
+        server.ownership.owned = true;
+    }
+
+    if (workerCount)
+    {
+        const int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        // Not a connection.
+        ev.data.ptr = nullptr;
+        if (fd == -1 || (engine_ == IOEngine::EPOLL && epoll_ctl(server.epollFd, EPOLL_CTL_ADD, fd, &ev) == -1))
+        {
+            const std::string error = getErrorString();
+            if (fd != -1)
+            {
+                ::close(fd);
+            }
+            (void)server.close();
+            return tl::unexpected(error);
+        }
+        server.workers = std::make_unique<Workers>(workerCount, fd);
+    }
+    return server;
+}
+
+tl::expected<IPCServerBS::Connection *, std::string> IPCServerBS::addConnection(const IPCManagerBS &manager,
+                                                                               const uint64_t outputFd)
+{
+    if (manager.framing == Framing::SHARED_MEMORY)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::UNSUPPORTED_FRAMING));
+    }
+
+    if (engine == IOEngine::IO_URING)
+    {
+        if (manager.framing == Framing::SEQPACKET)
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::UNSUPPORTED_FRAMING));
+        }
+        // The read is armed with the next submission.
+        auto connection = std::make_unique<Connection>(manager, outputFd);
+        connection->socketClosed = true;
+        connection->manager.writeQueue = &connection->queuedReplies;
+        connections.emplace_back(std::move(connection));
+        return connections.back().get();
+    }
+
+    // Replies are written from the queue as the compiler reads these, so a full pipe or socket does not block.
+    if (const auto &r = setNonBlocking(outputFd); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    if (const auto &r = setNonBlocking(manager.writeFd); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+
+    auto connection = std::make_unique<Connection>(manager, outputFd);
+    connection->manager.writeQueue = &connection->queuedReplies;
+    // Level-triggered, so one read per connection per poll keeps a chatty compiler from starving the others.
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &connection->outputSource;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, outputFd, &ev) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    if (manager.framing == Framing::SEQPACKET)
+    {
+        ev.data.ptr = &connection->socketSource;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, manager.writeFd, &ev) == -1)
+        {
+            const std::string error = getErrorString();
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, outputFd, nullptr);
+            return tl::unexpected(error);
+        }
+    }
+    else
+    {
+        connection->socketClosed = true;
+    }
+
+    connections.emplace_back(std::move(connection));
+    return connections.back().get();
+}
+
+void IPCServerBS::closeConnection(Connection &connection, const std::string &error)
+{
+    if (connection.closed)
+    {
+        return;
+    }
+    connection.closed = true;
+    // Might have been closed by the peer already, so the errors are ignored. With IOEngine::IO_URING, the armed read is
+    // canceled with the next submission.
+    if (engine == IOEngine::EPOLL)
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection.outputFd, nullptr);
+        if (connection.manager.framing == Framing::SEQPACKET || connection.writeArmed)
+        {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, connection.manager.writeFd, nullptr);
+        }
+        connection.writeArmed = false;
+    }
+    if (onClose)
+    {
+        onClose(connection, error);
+    }
+}
+
+void IPCServerBS::dispatch(Connection &connection, const std::string_view message)
+{
+    char ctbBuffer[320];
+    CTB type;
+    if (const auto &r = IPCManagerBS::receiveMessage(ctbBuffer, type, message, connection.manager.wireFormat); !r)
+    {
+        closeConnection(connection, r.error());
+        return;
+    }
+
+    switch (type)
+    {
+    case CTB::MODULE:
+        if (onModule)
+        {
+            onModule(connection, reinterpret_cast<CTBModule &>(ctbBuffer));
+        }
+        break;
+
+    case CTB::NON_MODULE:
+        if (onNonModule)
+        {
+            onNonModule(connection, reinterpret_cast<CTBNonModule &>(ctbBuffer));
+        }
+        break;
+
+    case CTB::LAST_MESSAGE:
+        if (onLastMessage)
+        {
+            onLastMessage(connection, reinterpret_cast<CTBLastMessage &>(ctbBuffer));
+        }
+        break;
+
+    case CTB::BATCH: {
+        auto &batch = reinterpret_cast<CTBBatch &>(ctbBuffer);
+        if (onBatch)
+        {
+            onBatch(connection, batch);
+        }
+        std::destroy_at(&batch);
+    }
+    break;
+
+    case CTB::PREFETCH:
+        if (onPrefetch)
+        {
+            onPrefetch(connection, reinterpret_cast<CTBPrefetch &>(ctbBuffer));
+        }
+        break;
+    }
+}
+
+void IPCServerBS::frameMessages(Connection &connection)
+{
+    // Every CTB message is the payload followed by its 4 bytes size and the delimiter. The bytes before the payload
+    // are the compiler output.
+    std::string &input = connection.input;
+    const uint32_t delimiterSize = strlen(delimiter);
+    uint64_t consumed = 0;
+    uint64_t end;
+    while ((end = input.find(delimiter, connection.searched, delimiterSize)) != std::string::npos)
+    {
+        uint32_t payloadSize = 0;
+        if (end - consumed >= 4)
+        {
+            memcpy(&payloadSize, input.data() + end - 4, 4);
+        }
+        if (end - consumed < 4 || payloadSize > end - 4 - consumed)
+        {
+            // Compiler output or a payload might have the bytes of the delimiter. These are framed with a later one.
+            connection.searched = end + 1;
+            continue;
+        }
+        const uint64_t payloadStart = end - 4 - payloadSize;
+        if (payloadStart != consumed && onOutput)
+        {
+            onOutput(connection, std::string_view(input.data() + consumed, payloadStart - consumed));
+        }
+        dispatch(connection, std::string_view(input.data() + payloadStart, payloadSize));
+        if (connection.closed)
+        {
+            return;
+        }
+        consumed = end + delimiterSize;
+        connection.searched = consumed;
+    }
+
+    input.erase(0, consumed);
+    // The delimiter might be split across the reads.
+    connection.searched = input.size() < delimiterSize ? 0 : input.size() - delimiterSize + 1;
+}
+
+void IPCServerBS::receiveOutput(Connection &connection, const char *data, const uint32_t size)
+{
+    if (connection.manager.framing == Framing::SEQPACKET)
+    {
+        if (onOutput)
+        {
+            onOutput(connection, std::string_view(data, size));
+        }
+    }
+    else
+    {
+        connection.input.append(data, size);
+        frameMessages(connection);
+    }
+}
+
+void IPCServerBS::endOutput(Connection &connection)
+{
+    connection.outputClosed = true;
+    // Compiler exited before a delimiter that did not end a message was followed by one that did.
+    if (connection.input.find(delimiter) != std::string::npos)
+    {
+        connection.input.clear();
+        closeConnection(connection, getErrorString(ErrorCategory::PARSING_ERROR));
+        return;
+    }
+    if (!connection.input.empty() && onOutput)
+    {
+        onOutput(connection, connection.input);
+    }
+    connection.input.clear();
+    if (connection.socketClosed)
+    {
+        closeConnection(connection, {});
+    }
+}
+
+void IPCServerBS::readOutput(Connection &connection)
+{
+    const int32_t readCount = read(connection.outputFd, readBuffer.data(), readSize);
+    if (readCount == -1)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            closeConnection(connection, getErrorString());
+        }
+        return;
+    }
+
+    if (readCount == 0)
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection.outputFd, nullptr);
+        endOutput(connection);
+    }
+    else
+    {
+        receiveOutput(connection, readBuffer.data(), readCount);
+    }
+}
+
+void IPCServerBS::receiveDatagram(Connection &connection)
+{
+    // Datagrams are received till the message is complete or the socket is empty. Remaining datagrams of a message that
+    // the compiler is still sending are received with a later poll.
+    const uint64_t fd = connection.manager.writeFd;
+    std::string &buffer = connection.datagramBuffer;
+    while (true)
+    {
+        const uint32_t used = buffer.size();
+        buffer.resize(used + Manager::maxDatagramSize);
+
+        // The flag is scattered out of the buffer, so the chunks of the message are contiguous.
+        char moreFollows;
+        iovec iov[2];
+        iov[0].iov_base = &moreFollows;
+        iov[0].iov_len = 1;
+        iov[1].iov_base = buffer.data() + used;
+        iov[1].iov_len = Manager::maxDatagramSize;
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        const int32_t result = recvmsg(fd, &msg, MSG_DONTWAIT);
+        if (result == -1)
+        {
+            buffer.resize(used);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN)
+            {
+                closeConnection(connection, getErrorString());
+            }
+            return;
+        }
+        if (result == 0)
+        {
+            buffer.resize(used);
+            connection.socketClosed = true;
+            connection.writeArmed = false;
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            if (connection.outputClosed)
+            {
+                closeConnection(connection, {});
+            }
+            return;
+        }
+        if (msg.msg_flags & MSG_TRUNC)
+        {
+            closeConnection(connection, getErrorString(ErrorCategory::PARSING_ERROR));
+            return;
+        }
+        buffer.resize(used + result - 1);
+        if (!moreFollows)
+        {
+            dispatch(connection, buffer);
+            buffer.clear();
+            return;
+        }
+    }
+}
+
+tl::expected<bool, std::string> IPCServerBS::writeQueued(Connection &connection)
+{
+    const uint64_t fd = connection.manager.writeFd;
+    const char *data = connection.writing.data() + connection.written;
+    int64_t result;
+    uint64_t consumed;
+    if (connection.manager.framing == Framing::SEQPACKET)
+    {
+        // Every datagram is preceded by its size, and is sent whole or not at all.
+        uint32_t size;
+        memcpy(&size, data, 4);
+        result = send(fd, data + 4, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+        consumed = 4 + size;
+    }
+    else
+    {
+        result = write(fd, data, connection.writing.size() - connection.written);
+        consumed = result;
+    }
+
+    if (result == -1)
+    {
+        if (errno == EAGAIN)
+        {
+            return false;
+        }
+        if (errno == EINTR)
+        {
+            return true;
+        }
+        return tl::unexpected(getErrorString());
+    }
+    connection.written += consumed;
+    return true;
+}
+
+void IPCServerBS::flushReplies(Connection &connection)
+{
+    if (connection.closed)
+    {
+        return;
+    }
+    while (true)
+    {
+        if (connection.written == connection.writing.size())
+        {
+            connection.writing.clear();
+            connection.written = 0;
+            if (connection.queuedReplies.empty())
+            {
+                break;
+            }
+            connection.writing.swap(connection.queuedReplies);
+        }
+        const auto &r = writeQueued(connection);
+        if (!r)
+        {
+            closeConnection(connection, r.error());
+            return;
+        }
+        if (!*r)
+        {
+            break;
+        }
+    }
+    armWrite(connection, !connection.writing.empty());
+}
+
+void IPCServerBS::armWrite(Connection &connection, const bool arm)
+{
+    if (connection.writeArmed == arm || (connection.socketClosed && connection.manager.framing == Framing::SEQPACKET))
+    {
+        return;
+    }
+
+    // The socket is in the epoll set already for the messages, while the compiler input is added only while it is
+    // full.
+    epoll_event ev{};
+    int operation;
+    if (connection.manager.framing == Framing::SEQPACKET)
+    {
+        ev.events = arm ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.ptr = &connection.socketSource;
+        operation = EPOLL_CTL_MOD;
+    }
+    else
+    {
+        ev.events = EPOLLOUT;
+        ev.data.ptr = &connection.inputSource;
+        operation = arm ? EPOLL_CTL_ADD : EPOLL_CTL_DEL;
+    }
+    if (epoll_ctl(epollFd, operation, connection.manager.writeFd, &ev) == -1)
+    {
+        closeConnection(connection, getErrorString());
+        return;
+    }
+    connection.writeArmed = arm;
+}
+
+tl::expected<void, std::string> IPCServerBS::submitOperations()
+{
+    if (workers && !workers->readArmed)
+    {
+        auto r = ring.getSqe();
+        if (!r)
+        {
+            return tl::unexpected(r.error());
+        }
+        io_uring_sqe &sqe = **r;
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = workers->eventFd;
+        sqe.addr = reinterpret_cast<uint64_t>(&workers->eventValue);
+        sqe.len = sizeof(workers->eventValue);
+        sqe.user_data = WAKE;
+        workers->readArmed = true;
+    }
+
+    // Scanned for the replies that were sent outside the callbacks as well.
+    for (const std::unique_ptr<Connection> &c : connections)
+    {
+        Connection &connection = *c;
+        if (connection.closed)
+        {
+            // Write could wait forever on a compiler that does not read its input anymore.
+            if (connection.readArmed && !connection.readCancelSubmitted)
+            {
+                if (const auto &r = submitCancel(ring, connection, READ); !r)
+                {
+                    return r;
+                }
+                connection.readCancelSubmitted = true;
+                ++connection.pendingOperations;
+            }
+            if (connection.writeArmed && !connection.writeCancelSubmitted)
+            {
+                if (const auto &r = submitCancel(ring, connection, WRITE); !r)
+                {
+                    return r;
+                }
+                connection.writeCancelSubmitted = true;
+                ++connection.pendingOperations;
+            }
+            continue;
+        }
+
+        if (!connection.readArmed && !connection.outputClosed)
+        {
+            auto r = ring.getSqe();
+            if (!r)
+            {
+                return tl::unexpected(r.error());
+            }
+            io_uring_sqe &sqe = **r;
+            sqe.opcode = multishot ? ioringOpReadMultishot : static_cast<uint8_t>(IORING_OP_READ);
+            sqe.fd = connection.outputFd;
+            sqe.flags = IOSQE_BUFFER_SELECT;
+            sqe.buf_group = IOUring::bufferGroup;
+            sqe.user_data = getUserData(connection, READ);
+            connection.readArmed = true;
+            ++connection.pendingOperations;
+        }
+
+        if (!connection.writeArmed)
+        {
+            if (connection.writing.empty())
+            {
+                connection.writing.swap(connection.queuedReplies);
+            }
+            if (!connection.writing.empty())
+            {
+                auto r = ring.getSqe();
+                if (!r)
+                {
+                    return tl::unexpected(r.error());
+                }
+                io_uring_sqe &sqe = **r;
+                sqe.opcode = IORING_OP_WRITE;
+                sqe.fd = connection.manager.writeFd;
+                sqe.addr = reinterpret_cast<uint64_t>(connection.writing.data() + connection.written);
+                sqe.len = connection.writing.size() - connection.written;
+                sqe.user_data = getUserData(connection, WRITE);
+                connection.writeArmed = true;
+                ++connection.pendingOperations;
+            }
+        }
+    }
+    return {};
+}
+
+void IPCServerBS::complete(const io_uring_cqe &cqe)
+{
+    if (cqe.user_data == WAKE)
+    {
+        workers->readArmed = false;
+        receiveReplies();
+        return;
+    }
+
+    Connection &connection = *reinterpret_cast<Connection *>(cqe.user_data & ~operationMask);
+    switch (static_cast<Operation>(cqe.user_data & operationMask))
+    {
+    case READ:
+        // Multishot read stays armed while the kernel sets IORING_CQE_F_MORE.
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            connection.readArmed = false;
+            --connection.pendingOperations;
+        }
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+        {
+            const uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0 && !connection.closed)
+            {
+                receiveOutput(connection, ring.getBuffer(id), cqe.res);
+            }
+            ring.recycleBuffer(id);
+        }
+        if (connection.closed || cqe.res > 0)
+        {
+            break;
+        }
+        if (cqe.res == 0)
+        {
+            endOutput(connection);
+        }
+        else if (cqe.res == -EINVAL && multishot)
+        {
+            multishot = false;
+        }
+        // Out of buffers, so it is armed again once these are recycled.
+        else if (cqe.res != -ENOBUFS && cqe.res != -EAGAIN && cqe.res != -EINTR)
+        {
+            closeConnection(connection, strerror(-cqe.res));
+        }
+        break;
+
+    case WRITE:
+        connection.writeArmed = false;
+        --connection.pendingOperations;
+        if (connection.closed)
+        {
+            break;
+        }
+        if (cqe.res < 0)
+        {
+            closeConnection(connection, strerror(-cqe.res));
+            break;
+        }
+        // Remaining bytes of a partial write are written with the next submission.
+        connection.written += cqe.res;
+        if (connection.written == connection.writing.size())
+        {
+            connection.writing.clear();
+            connection.written = 0;
+        }
+        break;
+
+    case CANCEL:
+        --connection.pendingOperations;
+        break;
+
+    case WAKE:
+        break;
+    }
+}
+
+tl::expected<void, std::string> IPCServerBS::pollRing(const int32_t timeout)
+{
+    // The reads to be armed and the replies queued by the last poll are submitted with the wait in one system call.
+    if (const auto &r = submitOperations(); !r)
+    {
+        return r;
+    }
+    if (const auto &r = ring.submitAndWait(timeout); !r)
+    {
+        return r;
+    }
+    ring.forEachCompletion([this](const io_uring_cqe &cqe) { complete(cqe); });
+
+    connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                     [](const std::unique_ptr<Connection> &c) {
+                                         return c->closed && !c->pendingOperations;
+                                     }),
+                      connections.end());
+    return {};
+}
+
+tl::expected<void, std::string> IPCServerBS::poll(const int32_t timeout)
+{
+    if (engine == IOEngine::IO_URING)
+    {
+        return pollRing(timeout);
+    }
+
+    // Replies that were sent outside the callbacks are written before the wait, and the ones sent from the callbacks
+    // after the events are processed.
+    const auto flushAll = [this] {
+        for (const std::unique_ptr<Connection> &c : connections)
+        {
+            if (!c->closed && !c->writeArmed && !c->queuedReplies.empty())
+            {
+                flushReplies(*c);
+            }
+        }
+    };
+    flushAll();
+
+    epoll_event events[maxEvents];
+    const int32_t count = epoll_wait(epollFd, events, maxEvents, timeout);
+    if (count == -1)
+    {
+        if (errno == EINTR)
+        {
+            return {};
+        }
+        return tl::unexpected(getErrorString());
+    }
+
+    for (int32_t i = 0; i < count; ++i)
+    {
+        if (!events[i].data.ptr)
+        {
+            uint64_t value;
+            if (read(workers->eventFd, &value, sizeof(value)) == -1 && errno != EAGAIN && errno != EINTR)
+            {
+                return tl::unexpected(getErrorString());
+            }
+            receiveReplies();
+            continue;
+        }
+
+        const auto &source = *static_cast<Connection::Source *>(events[i].data.ptr);
+        Connection &connection = *source.connection;
+        // Connection might have been closed by an earlier event of this call.
+        if (connection.closed)
+        {
+            continue;
+        }
+        switch (source.type)
+        {
+        case Connection::SourceType::OUTPUT:
+            readOutput(connection);
+            break;
+
+        case Connection::SourceType::SOCKET:
+            if (events[i].events & EPOLLOUT)
+            {
+                flushReplies(connection);
+            }
+            if (events[i].events & ~EPOLLOUT && !connection.closed)
+            {
+                receiveDatagram(connection);
+            }
+            break;
+
+        case Connection::SourceType::INPUT:
+            // Compiler closed its input if EPOLLERR, so the write fails and closes the connection.
+            flushReplies(connection);
+            break;
+        }
+    }
+    flushAll();
+
+    // Destroyed after all the events are processed, as these could point to a closed connection.
+    connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                     [](const std::unique_ptr<Connection> &c) {
+                                         return c->closed && !c->pendingOperations;
+                                     }),
+                      connections.end());
+    return {};
+}
+
+void IPCServerBS::buildReply(Connection &connection, ReplyBuilder build)
+{
+    if (connection.closed)
+    {
+        return;
+    }
+    if (!workers)
+    {
+        if (const auto &r = build(connection.manager); !r)
+        {
+            closeConnection(connection, r.error());
+        }
+        return;
+    }
+
+    auto task = std::make_unique<ReplyTask>(connection, std::move(build));
+    ReplyTask *t = task.get();
+    connection.replyTasks.emplace_back(std::move(task));
+    ++connection.pendingOperations;
+
+    Workers *w = workers.get();
+    w->pool.submit([w, t] {
+        if (const auto &r = t->build(t->manager); !r)
+        {
+            t->error = r.error();
+        }
+        // Task is not touched after the push, as the I/O thread could write and destroy it right away.
+        ReplyTask *head = w->finished.load(std::memory_order_relaxed);
+        do
+        {
+            t->next = head;
+        } while (!w->finished.compare_exchange_weak(head, t, std::memory_order_release, std::memory_order_relaxed));
+        if (!head)
+        {
+            // Fails only if the counter is about to overflow, and then it is readable already.
+            constexpr uint64_t one = 1;
+            [[maybe_unused]] const int64_t written = write(w->eventFd, &one, sizeof(one));
+        }
+    });
+}
+
+void IPCServerBS::receiveReplies()
+{
+    // Pushing on an empty stack wakes this up again, so no task is left behind after the exchange.
+    ReplyTask *task = workers->finished.exchange(nullptr, std::memory_order_acquire);
+    while (task)
+    {
+        ReplyTask *next = task->next;
+        Connection &connection = *task->connection;
+        task->finished = true;
+        --connection.pendingOperations;
+        writeReplies(connection);
+        task = next;
+    }
+}
+
+void IPCServerBS::writeReplies(Connection &connection)
+{
+    std::deque<std::unique_ptr<ReplyTask>> &tasks = connection.replyTasks;
+    while (!tasks.empty() && tasks.front()->finished)
+    {
+        const ReplyTask &task = *tasks.front();
+        if (!connection.closed)
+        {
+            if (!task.error.empty())
+            {
+                closeConnection(connection, task.error);
+            }
+            else
+            {
+                // task.output is encoded for the queue already, as the manager of the task queues in it.
+                connection.queuedReplies.append(task.output);
+            }
+        }
+        tasks.pop_front();
+    }
+    if (engine == IOEngine::EPOLL && !connection.writeArmed)
+    {
+        flushReplies(connection);
+    }
+}
+
+tl::expected<void, std::string> IPCServerBS::run()
+{
+    while (!connections.empty())
+    {
+        if (const auto &r = poll(-1); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+    }
+    return {};
+}
+
+uint32_t IPCServerBS::getConnectionCount() const
+{
+    return connections.size();
+}
+
+tl::expected<void, std::string> IPCServerBS::close()
+{
+    if (!ownership.owned)
+    {
+        return {};
+    }
+    ownership.owned = false;
+    // io_uring is closed first, so no completion is left to point to the connections or the workers. Workers are
+    // stopped before the connections that their tasks point to are destroyed.
+    std::string error;
+    if (engine == IOEngine::IO_URING)
+    {
+        if (const auto &r = ring.close(); !r)
+        {
+            error = r.error();
+        }
+    }
+    else if (::close(epollFd) == -1)
+    {
+        error = getErrorString();
+    }
+    if (workers)
+    {
+        const uint64_t eventFd = workers->eventFd;
+        workers.reset();
+        ::close(eventFd);
+    }
+    connections.clear();
+    if (!error.empty())
+    {
+        return tl::unexpected(error);
+    }
+    return {};
+}
+
+IPCServerBS::~IPCServerBS()
+{
+    (void)close();
+}
+} // namespace P2978
+#endif
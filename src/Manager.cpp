@@ -2,18 +2,108 @@
 #include "Manager.hpp"
 #include "Messages.hpp"
 #include "expected.hpp"
+#include "rapidhash.h"
+
+#include <algorithm>
+#include <cstring>
 
 #ifdef _WIN32
 #include <Windows.h>
 #else
-#include <cstring>
+#include <climits>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #endif
 
 namespace P2978
 {
 
+void GatherBuffer::reserve(const uint32_t count)
+{
+    scratch.reserve(scratch.size() + count);
+}
+
+void GatherBuffer::append(const char *bytes, const uint32_t count)
+{
+    if (!segments.empty() && !segments.back().data && segments.back().offset + segments.back().size == scratch.size())
+    {
+        segments.back().size += count;
+    }
+    else
+    {
+        segments.push_back({nullptr, static_cast<uint32_t>(scratch.size()), count});
+    }
+    scratch.append(bytes, count);
+    size += count;
+}
+
+void GatherBuffer::push_back(const char c)
+{
+    append(&c, 1);
+}
+
+void GatherBuffer::appendReference(const std::string_view str)
+{
+    if (str.size() < copyThreshold)
+    {
+        append(str.data(), str.size());
+        return;
+    }
+    segments.push_back({str.data(), 0, static_cast<uint32_t>(str.size())});
+    size += str.size();
+}
+
+void GatherBuffer::overwrite(uint32_t offset, const char *bytes, uint32_t count)
+{
+    for (Segment &segment : segments)
+    {
+        if (!count)
+        {
+            return;
+        }
+        if (offset >= segment.size)
+        {
+            offset -= segment.size;
+            continue;
+        }
+        // Referenced string is not ours to write, so the segment is copied in the scratch first.
+        if (segment.data)
+        {
+            const char *data = segment.data;
+            segment.data = nullptr;
+            segment.offset = scratch.size();
+            scratch.append(data, segment.size);
+        }
+        const uint32_t chunk = std::min(count, segment.size - offset);
+        memcpy(scratch.data() + segment.offset + offset, bytes, chunk);
+        bytes += chunk;
+        count -= chunk;
+        offset = 0;
+    }
+}
+
+void GatherBuffer::flatten(std::string &buffer) const
+{
+    buffer.reserve(buffer.size() + size);
+    for (const Segment &segment : segments)
+    {
+        buffer.append(segment.data ? segment.data : scratch.data() + segment.offset, segment.size);
+    }
+}
+
+#ifndef _WIN32
+void GatherBuffer::getIovecs(std::vector<iovec> &iovecs) const
+{
+    iovecs.reserve(iovecs.size() + segments.size());
+    for (const Segment &segment : segments)
+    {
+        const char *data = segment.data ? segment.data : scratch.data() + segment.offset;
+        iovecs.push_back({const_cast<char *>(data), segment.size});
+    }
+}
+#endif
+
 std::string getErrorString()
 {
 #ifdef _WIN32
@@ -62,6 +152,24 @@ std::string getErrorString(const ErrorCategory errorCategory_)
     case ErrorCategory::UNKNOWN_CTB_TYPE:
         errorString = "Error: Unknown CTB message received.";
         break;
+    case ErrorCategory::UNEXPECTED_BTC_TYPE:
+        errorString = "Error: Frame header has unexpected BTC type.";
+        break;
+    case ErrorCategory::CHANNEL_CLOSED:
+        errorString = "Error: Shared memory channel is closed.";
+        break;
+    case ErrorCategory::UNSUPPORTED_FRAMING:
+        errorString = "Error: Framing is not supported by IPCServerBS.";
+        break;
+    case ErrorCategory::MODULE_CYCLE:
+        errorString = "Error: Module dependencies have a cycle.";
+        break;
+    case ErrorCategory::UNKNOWN_BMI_FILE:
+        errorString = "Error: BMI file is not in any reply.";
+        break;
+    case ErrorCategory::BMI_FILE_TOO_LARGE:
+        errorString = "Error: BMI file is larger than 4GB.";
+        break;
     case ErrorCategory::NONE:
         std::string str = __FILE__;
         str += ':';
@@ -100,105 +208,181 @@ tl::expected<void, std::string> Manager::writeAll(const int fd, const char *buff
 
     return {};
 }
-#endif
 
-std::string Manager::getBufferWithType(CTB type)
+tl::expected<void, std::string> Manager::writevAll(const int fd, iovec *iovecs, uint32_t count)
 {
-    std::string buffer;
-    buffer.push_back(static_cast<uint8_t>(type));
-    return buffer;
+    while (count)
+    {
+        const int32_t result = writev(fd, iovecs, std::min<uint32_t>(count, IOV_MAX));
+        if (result == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return tl::unexpected(getErrorString());
+        }
+
+        // Skips the fully written iovecs and adjusts the partially written one.
+        auto bytesWritten = static_cast<uint32_t>(result);
+        while (count && bytesWritten >= iovecs->iov_len)
+        {
+            bytesWritten -= iovecs->iov_len;
+            ++iovecs;
+            --count;
+        }
+        if (count)
+        {
+            iovecs->iov_base = static_cast<char *>(iovecs->iov_base) + bytesWritten;
+            iovecs->iov_len -= bytesWritten;
+        }
+    }
+    return {};
 }
 
-void Manager::writeUInt32(std::string &buffer, const uint32_t value)
+tl::expected<void, std::string> Manager::sendDatagrams(const int fd, const std::string_view message)
 {
-    const auto ptr = reinterpret_cast<const char *>(&value);
-    buffer.append(ptr, ptr + 4);
+    uint32_t bytesSent = 0;
+    do
+    {
+        const uint32_t chunkSize = std::min<uint32_t>(message.size() - bytesSent, maxDatagramSize);
+        char moreFollows = bytesSent + chunkSize != message.size();
+
+        // The flag and the chunk are gathered by the kernel, so the message is not copied.
+        iovec iov[2];
+        iov[0].iov_base = &moreFollows;
+        iov[0].iov_len = 1;
+        iov[1].iov_base = const_cast<char *>(message.data() + bytesSent);
+        iov[1].iov_len = chunkSize;
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return tl::unexpected(getErrorString());
+        }
+        bytesSent += chunkSize;
+    } while (bytesSent != message.size());
+
+    return {};
 }
 
-void Manager::writeString(std::string &buffer, const std::string_view &str)
+void Manager::appendDatagrams(std::string &queue, const std::string_view message)
 {
-    writeUInt32(buffer, str.size());
-    buffer.append(str.begin(), str.end()); // Insert all characters
+    uint32_t bytesAppended = 0;
+    do
+    {
+        const uint32_t chunkSize = std::min<uint32_t>(message.size() - bytesAppended, maxDatagramSize);
+        writeUInt32(queue, chunkSize + 1);
+        queue.push_back(bytesAppended + chunkSize != message.size());
+        queue.append(message.data() + bytesAppended, chunkSize);
+        bytesAppended += chunkSize;
+    } while (bytesAppended != message.size());
 }
 
-void Manager::writePath(std::string &buffer, const std::string_view &str)
+tl::expected<std::string_view, std::string> Manager::receiveDatagrams(const int fd, std::string &buffer)
 {
-    writeUInt32(buffer, str.size());
-    buffer.append(str.begin(), str.end()); // Insert all characters
-    buffer.push_back('\0');
+    buffer.clear();
+    char moreFollows = true;
+    while (moreFollows)
+    {
+        const uint32_t used = buffer.size();
+        buffer.resize(used + maxDatagramSize);
+
+        // The flag is scattered out of the buffer, so the chunks of the message are contiguous.
+        iovec iov[2];
+        iov[0].iov_base = &moreFollows;
+        iov[0].iov_len = 1;
+        iov[1].iov_base = buffer.data() + used;
+        iov[1].iov_len = maxDatagramSize;
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        const int32_t result = recvmsg(fd, &msg, 0);
+        if (result == -1)
+        {
+            buffer.resize(used);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return tl::unexpected(getErrorString());
+        }
+        if (result == 0)
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::READ_FILE_ZERO_BYTES_READ));
+        }
+        if (msg.msg_flags & MSG_TRUNC)
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+        }
+        buffer.resize(used + result - 1);
+    }
+    return std::string_view{buffer};
 }
+#endif
 
-void Manager::writeBMIFile(std::string &buffer, const BMIFile &file)
+std::string Manager::getBufferWithType(CTB type, const uint64_t payloadSize)
 {
-    writePath(buffer, file.filePath);
-    writeUInt32(buffer, file.fileSize);
+    std::string buffer;
+    // type, payload, payload size and delimiter.
+    buffer.reserve(1 + payloadSize + 4 + strlen(delimiter));
+    buffer.push_back(static_cast<uint8_t>(type));
+    return buffer;
 }
 
-void Manager::writeModuleDep(std::string &buffer, const ModuleDep &dep)
+void Manager::writeUInt32(std::string &buffer, const uint32_t value)
 {
-    buffer.push_back(dep.isHeaderUnit);
-    writeBMIFile(buffer, dep.file);
-    buffer.push_back(dep.isSystem);
-    writeVectorOfStrings(buffer, dep.logicalNames);
+    const auto ptr = reinterpret_cast<const char *>(&value);
+    buffer.append(ptr, ptr + 4);
 }
 
-void Manager::writeHuDep(std::string &buffer, const HuDep &dep)
+void Manager::writeUInt64(std::string &buffer, const uint64_t value)
 {
-    writeBMIFile(buffer, dep.file);
-    buffer.push_back(dep.isSystem);
-    writeVectorOfStrings(buffer, dep.logicalNames);
+    const auto ptr = reinterpret_cast<const char *>(&value);
+    buffer.append(ptr, ptr + 8);
 }
 
-void Manager::writeHeaderFile(std::string &buffer, const HeaderFile &dep)
+void Manager::writeString(std::string &buffer, const std::string_view &str)
 {
-    writeString(buffer, dep.logicalName);
-    writePath(buffer, dep.filePath);
-    buffer.push_back(dep.isSystem);
+    writeUInt32(buffer, str.size());
+    buffer.append(str.begin(), str.end()); // Insert all characters
 }
 
-void Manager::writeVectorOfStrings(std::string &buffer, const std::vector<std::string_view> &strs)
+void Manager::writePath(std::string &buffer, const std::string_view &str)
 {
-    writeUInt32(buffer, strs.size());
-    for (const std::string_view &str : strs)
-    {
-        writeString(buffer, str);
-    }
+    writeUInt32(buffer, str.size());
+    buffer.append(str.begin(), str.end()); // Insert all characters
+    buffer.push_back('\0');
 }
 
-void Manager::writeVectorOfProcessMappingOfBMIFiles(std::string &buffer, const std::vector<BMIFile> &files)
+void Manager::writeUInt32(GatherBuffer &buffer, const uint32_t value)
 {
-    writeUInt32(buffer, files.size());
-    for (const BMIFile &file : files)
-    {
-        writeBMIFile(buffer, file);
-    }
+    buffer.append(reinterpret_cast<const char *>(&value), 4);
 }
 
-void Manager::writeVectorOfModuleDep(std::string &buffer, const std::vector<ModuleDep> &deps)
+void Manager::writeUInt64(GatherBuffer &buffer, const uint64_t value)
 {
-    writeUInt32(buffer, deps.size());
-    for (const ModuleDep &dep : deps)
-    {
-        writeModuleDep(buffer, dep);
-    }
+    buffer.append(reinterpret_cast<const char *>(&value), 8);
 }
 
-void Manager::writeVectorOfHuDeps(std::string &buffer, const std::vector<HuDep> &deps)
+void Manager::writeString(GatherBuffer &buffer, const std::string_view &str)
 {
-    writeUInt32(buffer, deps.size());
-    for (const HuDep &dep : deps)
-    {
-        writeHuDep(buffer, dep);
-    }
+    writeUInt32(buffer, str.size());
+    buffer.appendReference(str);
 }
 
-void Manager::writeVectorOfHeaderFiles(std::string &buffer, const std::vector<HeaderFile> &headerFiles)
+void Manager::writePath(GatherBuffer &buffer, const std::string_view &str)
 {
-    writeUInt32(buffer, headerFiles.size());
-    for (const HeaderFile &headerFile : headerFiles)
-    {
-        writeHeaderFile(buffer, headerFile);
-    }
+    writeUInt32(buffer, str.size());
+    buffer.appendReference(str);
+    buffer.push_back('\0');
 }
 
 tl::expected<bool, std::string> Manager::readBool(const std::string_view message, uint32_t &bytesRead)
@@ -223,6 +407,18 @@ tl::expected<uint32_t, std::string> Manager::readUInt32(const std::string_view m
     return result;
 }
 
+tl::expected<uint64_t, std::string> Manager::readUInt64(const std::string_view message, uint32_t &bytesRead)
+{
+    if (bytesRead + 8 > message.size())
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    uint64_t result;
+    memcpy(&result, message.data() + bytesRead, 8);
+    bytesRead += 8;
+    return result;
+}
+
 tl::expected<std::string_view, std::string> Manager::readString(const std::string_view message, uint32_t &bytesRead)
 {
     auto r = readUInt32(message, bytesRead);
@@ -259,4 +455,121 @@ tl::expected<std::string_view, std::string> Manager::readPath(const std::string_
     return result;
 }
 
+#ifndef _WIN32
+tl::expected<Mapping, std::string> mapFile(const int fd, const uint32_t fileSize, const PagePolicy policy)
+{
+    constexpr uint64_t hugePageSize = 2 * 1024 * 1024;
+    void *m;
+    if (policy == PagePolicy::HUGE_PAGE && fileSize >= hugePageSize)
+    {
+        // Address space is reserved with one extra huge-page, so an aligned range is in it. Rest of it is unmapped.
+        const uint64_t reserved = fileSize + hugePageSize;
+        void *r = mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (r == MAP_FAILED)
+        {
+            return tl::unexpected(getErrorString());
+        }
+        const uint64_t pageSize = getpagesize();
+        const uint64_t begin = reinterpret_cast<uint64_t>(r);
+        const uint64_t aligned = (begin + hugePageSize - 1) & ~(hugePageSize - 1);
+        const uint64_t end = aligned + ((fileSize + pageSize - 1) & ~(pageSize - 1));
+        m = mmap(reinterpret_cast<void *>(aligned), fileSize, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0);
+        if (m == MAP_FAILED)
+        {
+            const std::string error = getErrorString();
+            munmap(r, reserved);
+            return tl::unexpected(error);
+        }
+        if (aligned != begin)
+        {
+            munmap(r, aligned - begin);
+        }
+        if (end != begin + reserved)
+        {
+            munmap(reinterpret_cast<void *>(end), begin + reserved - end);
+        }
+    }
+    else
+    {
+        m = mmap(nullptr, fileSize, PROT_READ, policy == PagePolicy::POPULATE ? MAP_SHARED | MAP_POPULATE : MAP_SHARED,
+                 fd, 0);
+        if (m == MAP_FAILED)
+        {
+            return tl::unexpected(getErrorString());
+        }
+    }
+
+    // Advice is only a hint, e.g. MADV_HUGEPAGE fails if the transparent huge-pages are disabled, so its failure is
+    // not an error.
+    switch (policy)
+    {
+    case PagePolicy::WILL_NEED:
+        (void)madvise(m, fileSize, MADV_WILLNEED);
+        break;
+    case PagePolicy::SEQUENTIAL:
+        (void)madvise(m, fileSize, MADV_SEQUENTIAL);
+        break;
+    case PagePolicy::RANDOM:
+        (void)madvise(m, fileSize, MADV_RANDOM);
+        break;
+    case PagePolicy::HUGE_PAGE:
+        (void)madvise(m, fileSize, MADV_HUGEPAGE);
+        break;
+    case PagePolicy::POPULATE:
+    case PagePolicy::NONE:
+        break;
+    }
+
+    Mapping mapping{};
+    mapping.file = {static_cast<char *>(m), fileSize};
+    return mapping;
+}
+#endif
+
+uint64_t hashLogicalName(const std::string_view logicalName)
+{
+    return rapidhash(logicalName.data(), logicalName.size());
+}
+
+void hashLogicalNames(const std::vector<std::string_view> &names, std::vector<uint64_t> &hashes)
+{
+    hashes.reserve(hashes.size() + names.size());
+    for (const std::string_view name : names)
+    {
+        hashes.emplace_back(hashLogicalName(name));
+    }
+}
+
+void hashLogicalNames(BTCModule &reply)
+{
+    for (ModuleDep &dep : reply.modDeps)
+    {
+        dep.hashed = true;
+        dep.logicalNameHashes.clear();
+        hashLogicalNames(dep.logicalNames, dep.logicalNameHashes);
+    }
+}
+
+void hashLogicalNames(BTCNonModule &reply)
+{
+    for (HeaderFile &headerFile : reply.headerFiles)
+    {
+        headerFile.hashed = true;
+        headerFile.hash = hashLogicalName(headerFile.logicalName);
+    }
+    if (!reply.isHeaderUnit)
+    {
+        return;
+    }
+    reply.hashed = true;
+    reply.logicalNameHashes.clear();
+    hashLogicalNames(reply.logicalNames, reply.logicalNameHashes);
+    for (HuDep &dep : reply.huDeps)
+    {
+        dep.hashed = true;
+        dep.logicalNameHashes.clear();
+        hashLogicalNames(dep.logicalNames, dep.logicalNameHashes);
+    }
+}
+
 } // namespace P2978
\ No newline at end of file
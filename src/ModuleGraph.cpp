@@ -0,0 +1,258 @@
+
+#include "ModuleGraph.hpp"
+#include "Manager.hpp"
+#include "rapidhash.h"
+
+#include <algorithm>
+
+namespace P2978
+{
+
+uint32_t ModuleGraph::addModule(const std::string_view logicalName, const bool isHeaderUnit)
+{
+    if (const auto it = ids.find(logicalName); it != ids.end())
+    {
+        return it->second;
+    }
+    const uint32_t id = modules.size();
+    Module &m = modules.emplace_back();
+    m.logicalNames.emplace_back(logicalName);
+    m.logicalNameHashes.emplace_back(hashLogicalName(logicalName));
+    m.isHeaderUnit = isHeaderUnit;
+    ids.emplace(logicalName, id);
+    return id;
+}
+
+uint32_t ModuleGraph::findModule(const std::string_view logicalName) const
+{
+    const auto it = ids.find(logicalName);
+    return it == ids.end() ? invalidId : it->second;
+}
+
+void ModuleGraph::addLogicalName(const uint32_t id, const std::string_view logicalName)
+{
+    if (ids.emplace(logicalName, id).second)
+    {
+        modules[id].logicalNames.emplace_back(logicalName);
+        modules[id].logicalNameHashes.emplace_back(hashLogicalName(logicalName));
+    }
+}
+
+void ModuleGraph::setBMI(const uint32_t id, const std::string_view filePath, const uint32_t fileSize,
+                         const bool isSystem)
+{
+    Module &m = modules[id];
+    m.filePath = filePath;
+    m.fileSize = fileSize;
+    m.isSystem = isSystem;
+}
+
+void ModuleGraph::setDependencies(const uint32_t id, const std::vector<uint32_t> &dependencies)
+{
+    for (const uint32_t dep : modules[id].dependencies)
+    {
+        std::vector<uint32_t> &dependents = modules[dep].dependents;
+        dependents.erase(std::find(dependents.begin(), dependents.end(), id));
+    }
+    modules[id].dependencies = dependencies;
+    for (const uint32_t dep : dependencies)
+    {
+        modules[dep].dependents.emplace_back(id);
+    }
+    markStale(id);
+}
+
+void ModuleGraph::markStale(const uint32_t id)
+{
+    // Closure is only computed after the closures of the dependencies, so the dependents of a stale closure are
+    // stale already.
+    std::vector<uint32_t> stack{id};
+    while (!stack.empty())
+    {
+        Module &m = modules[stack.back()];
+        stack.pop_back();
+        if (!m.closure)
+        {
+            continue;
+        }
+        m.closure.reset();
+        stack.insert(stack.end(), m.dependents.begin(), m.dependents.end());
+    }
+}
+
+tl::expected<const ModuleGraph::Closure *, std::string> ModuleGraph::getClosure(const uint32_t id)
+{
+    struct Frame
+    {
+        uint32_t id;
+        // Next dependency to visit.
+        uint32_t next;
+    };
+
+    std::vector<Frame> stack;
+    if (!modules[id].closure)
+    {
+        modules[id].computing = true;
+        stack.push_back({id, 0});
+    }
+    while (!stack.empty())
+    {
+        const Frame frame = stack.back();
+        const std::vector<uint32_t> &dependencies = modules[frame.id].dependencies;
+        if (frame.next == dependencies.size())
+        {
+            computeClosure(frame.id);
+            modules[frame.id].computing = false;
+            stack.pop_back();
+            continue;
+        }
+
+        ++stack.back().next;
+        Module &dep = modules[dependencies[frame.next]];
+        if (dep.closure)
+        {
+            continue;
+        }
+        if (dep.computing)
+        {
+            for (const Frame &f : stack)
+            {
+                modules[f.id].computing = false;
+            }
+            return tl::unexpected(getErrorString(ErrorCategory::MODULE_CYCLE));
+        }
+        dep.computing = true;
+        stack.push_back({dependencies[frame.next], 0});
+    }
+    return modules[id].closure.get();
+}
+
+void ModuleGraph::computeClosure(const uint32_t id)
+{
+    std::vector<uint64_t> bits((modules.size() + 63) / 64);
+    for (const uint32_t dep : modules[id].dependencies)
+    {
+        bits[dep / 64] |= uint64_t{1} << dep % 64;
+        const std::vector<uint64_t> &depBits = modules[dep].closure->bits;
+        for (uint64_t i = 0; i < depBits.size(); ++i)
+        {
+            bits[i] |= depBits[i];
+        }
+    }
+    while (!bits.empty() && !bits.back())
+    {
+        bits.pop_back();
+    }
+
+    // Equal closure might be computed already, e.g. of all the modules that only import std.
+    const uint64_t hash = rapidhash(bits.data(), bits.size() * sizeof(uint64_t));
+    auto [first, last] = interned.equal_range(hash);
+    while (first != last)
+    {
+        std::shared_ptr<const Closure> closure = first->second.lock();
+        if (!closure)
+        {
+            first = interned.erase(first);
+            continue;
+        }
+        if (closure->bits == bits)
+        {
+            modules[id].closure = std::move(closure);
+            return;
+        }
+        ++first;
+    }
+
+    auto closure = std::make_shared<Closure>();
+    for (const uint64_t word : bits)
+    {
+        closure->size += __builtin_popcountll(word);
+    }
+    closure->bits = std::move(bits);
+    interned.emplace(hash, closure);
+    modules[id].closure = std::move(closure);
+}
+
+tl::expected<uint32_t, std::string> ModuleGraph::getClosureSize(const uint32_t id)
+{
+    const auto &r = getClosure(id);
+    if (!r)
+    {
+        return tl::unexpected(r.error());
+    }
+    return (*r)->size;
+}
+
+void ModuleGraph::fillModuleDep(const uint32_t id, ModuleDep &dep, const bool hashNames) const
+{
+    const Module &m = modules[id];
+    dep.isHeaderUnit = m.isHeaderUnit;
+    dep.file.filePath = m.filePath;
+    dep.file.fileSize = m.fileSize;
+    dep.isSystem = m.isSystem;
+    dep.logicalNames.assign(m.logicalNames.begin(), m.logicalNames.end());
+    dep.hashed = hashNames;
+    if (hashNames)
+    {
+        dep.logicalNameHashes = m.logicalNameHashes;
+    }
+    else
+    {
+        dep.logicalNameHashes.clear();
+    }
+}
+
+tl::expected<bool, std::string> ModuleGraph::fillReply(const uint32_t id, BTCModule &reply,
+                                                       const ModuleGraphPolicy &policy)
+{
+    const auto &r = getClosure(id);
+    if (!r)
+    {
+        return tl::unexpected(r.error());
+    }
+
+    const Module &m = modules[id];
+    reply.requested.filePath = m.filePath;
+    reply.requested.fileSize = m.fileSize;
+    reply.isSystem = m.isSystem;
+
+    const Closure &closure = **r;
+    const bool full = closure.size <= policy.fullClosureLimit ||
+                      closure.size <= static_cast<uint64_t>(policy.maxExpansion) * m.dependencies.size();
+    if (!full)
+    {
+        reply.modDeps.resize(m.dependencies.size());
+        for (uint64_t i = 0; i < m.dependencies.size(); ++i)
+        {
+            fillModuleDep(m.dependencies[i], reply.modDeps[i], policy.hashNames);
+        }
+        return false;
+    }
+
+    // Set bits in the increasing order.
+    reply.modDeps.resize(closure.size);
+    uint32_t next = 0;
+    for (uint64_t i = 0; i < closure.bits.size(); ++i)
+    {
+        for (uint64_t word = closure.bits[i]; word; word &= word - 1)
+        {
+            fillModuleDep(i * 64 + __builtin_ctzll(word), reply.modDeps[next++], policy.hashNames);
+        }
+    }
+    return true;
+}
+
+ModuleGraphStats ModuleGraph::getStats() const
+{
+    ModuleGraphStats stats{static_cast<uint32_t>(modules.size()), 0, 0};
+    for (const Module &m : modules)
+    {
+        stats.closures += m.closure != nullptr;
+    }
+    for (const auto &[hash, closure] : interned)
+    {
+        stats.distinctClosures += !closure.expired();
+    }
+    return stats;
+}
+} // namespace P2978
@@ -0,0 +1,137 @@
+
+#include "ReplyCache.hpp"
+
+#include <algorithm>
+
+namespace P2978
+{
+
+// kind is 0 for a module, 1 for a header-file and 2 for a header-unit.
+static std::string makeKey(const char kind, const WireFormat wireFormat, const std::string_view logicalName)
+{
+    std::string key;
+    key.reserve(2 + logicalName.size());
+    key.push_back(kind);
+    key.push_back(static_cast<char>(wireFormat));
+    key.append(logicalName);
+    return key;
+}
+
+std::string ReplyCache::getKey(const CTBModule &request, const WireFormat wireFormat)
+{
+    return makeKey(0, wireFormat, request.moduleName);
+}
+
+std::string ReplyCache::getKey(const CTBNonModule &request, const WireFormat wireFormat)
+{
+    return makeKey(request.isHeaderUnit ? 2 : 1, wireFormat, request.logicalName);
+}
+
+ReplyCache::Payload ReplyCache::find(const std::string_view key)
+{
+    std::lock_guard lock(mutex);
+    const auto it = entries.find(key);
+    if (it == entries.end())
+    {
+        ++misses;
+        return nullptr;
+    }
+    ++hits;
+    return it->second.payload;
+}
+
+ReplyCache::Payload ReplyCache::insert(std::string key, std::string payload, const BTCModule &reply)
+{
+    std::vector<std::string> bmiPaths;
+    bmiPaths.reserve(1 + reply.modDeps.size());
+    bmiPaths.emplace_back(reply.requested.filePath);
+    for (const ModuleDep &dep : reply.modDeps)
+    {
+        bmiPaths.emplace_back(dep.file.filePath);
+    }
+    return insert(std::move(key), std::move(payload), std::move(bmiPaths));
+}
+
+ReplyCache::Payload ReplyCache::insert(std::string key, std::string payload, const BTCNonModule &reply)
+{
+    std::vector<std::string> bmiPaths;
+    if (reply.isHeaderUnit)
+    {
+        bmiPaths.reserve(1 + reply.huDeps.size());
+        bmiPaths.emplace_back(reply.filePath);
+        for (const HuDep &dep : reply.huDeps)
+        {
+            bmiPaths.emplace_back(dep.file.filePath);
+        }
+    }
+    return insert(std::move(key), std::move(payload), std::move(bmiPaths));
+}
+
+ReplyCache::Payload ReplyCache::insert(std::string key, std::string payload, std::vector<std::string> bmiPaths)
+{
+    // A BMI file might be repeated in the reply.
+    std::sort(bmiPaths.begin(), bmiPaths.end());
+    bmiPaths.erase(std::unique(bmiPaths.begin(), bmiPaths.end()), bmiPaths.end());
+
+    auto shared = std::make_shared<const std::string>(std::move(payload));
+    std::lock_guard lock(mutex);
+    if (const auto it = entries.find(key); it != entries.end())
+    {
+        erase(it);
+    }
+    for (const std::string &bmiPath : bmiPaths)
+    {
+        byBMI[bmiPath].emplace_back(key);
+    }
+    bytes += shared->size();
+    entries.emplace(std::move(key), Entry{shared, std::move(bmiPaths)});
+    return shared;
+}
+
+void ReplyCache::erase(const std::map<std::string, Entry, std::less<>>::iterator it)
+{
+    for (const std::string &bmiPath : it->second.bmiPaths)
+    {
+        const auto keys = byBMI.find(bmiPath);
+        std::vector<std::string> &k = keys->second;
+        k.erase(std::find(k.begin(), k.end(), it->first));
+        if (k.empty())
+        {
+            byBMI.erase(keys);
+        }
+    }
+    bytes -= it->second.payload->size();
+    entries.erase(it);
+}
+
+void ReplyCache::invalidate(const std::string_view bmiPath)
+{
+    std::lock_guard lock(mutex);
+    const auto keys = byBMI.find(bmiPath);
+    if (keys == byBMI.end())
+    {
+        return;
+    }
+    // Copied, as erasing the last entry erases the keys.
+    const std::vector<std::string> k = keys->second;
+    for (const std::string &key : k)
+    {
+        ++invalidations;
+        erase(entries.find(key));
+    }
+}
+
+void ReplyCache::clear()
+{
+    std::lock_guard lock(mutex);
+    entries.clear();
+    byBMI.clear();
+    bytes = 0;
+}
+
+ReplyCacheStats ReplyCache::getStats() const
+{
+    std::lock_guard lock(mutex);
+    return {static_cast<uint32_t>(entries.size()), bytes, hits, misses, invalidations};
+}
+} // namespace P2978
@@ -0,0 +1,135 @@
+
+#include "ResponseTable.hpp"
+
+namespace P2978
+{
+
+static uint8_t getTag(const uint64_t hash)
+{
+    return 0x80 | static_cast<uint8_t>(hash >> 57);
+}
+
+uint64_t ResponseTable::hash(const std::string_view key)
+{
+    return hashLogicalName(key);
+}
+
+uint32_t ResponseTable::findSlot(const std::string_view key, const uint64_t hash) const
+{
+    if (control.empty())
+    {
+        return UINT32_MAX;
+    }
+    const uint32_t mask = control.size() - 1;
+    const uint8_t tag = getTag(hash);
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        if (control[slot] == emptySlot)
+        {
+            return UINT32_MAX;
+        }
+        if (control[slot] == tag && hashes[slot] == hash && keys[slot] == key)
+        {
+            return slot;
+        }
+    }
+}
+
+void ResponseTable::rehash(const uint32_t capacity)
+{
+    std::vector<uint8_t> oldControl(capacity, emptySlot);
+    std::vector<uint64_t> oldHashes(capacity);
+    std::vector<std::string_view> oldKeys(capacity);
+    std::vector<uint32_t> oldIndices(capacity);
+    oldControl.swap(control);
+    oldHashes.swap(hashes);
+    oldKeys.swap(keys);
+    oldIndices.swap(indices);
+    size = 0;
+    erased = 0;
+
+    for (uint32_t i = 0; i < oldControl.size(); ++i)
+    {
+        if (oldControl[i] & 0x80)
+        {
+            insert(oldKeys[i], oldHashes[i], oldIndices[i]);
+        }
+    }
+}
+
+void ResponseTable::reserve(const uint32_t count)
+{
+    // Load factor, including the erased slots, is kept at most 7/8, so the probes are short and end at an empty slot.
+    const uint64_t capacity = control.size();
+    if ((static_cast<uint64_t>(size) + erased + count) * 8 <= capacity * 7)
+    {
+        return;
+    }
+    uint64_t newCapacity = capacity ? capacity : 16;
+    while ((static_cast<uint64_t>(size) + count) * 8 > newCapacity * 7)
+    {
+        newCapacity *= 2;
+    }
+    rehash(newCapacity);
+}
+
+uint32_t ResponseTable::addResponse(const Response &response)
+{
+    responses.emplace_back(response);
+    return responses.size() - 1;
+}
+
+Response &ResponseTable::getResponse(const uint32_t index)
+{
+    return responses[index];
+}
+
+Response *ResponseTable::find(const std::string_view key)
+{
+    return find(key, hash(key));
+}
+
+Response *ResponseTable::find(const std::string_view key, const uint64_t hash)
+{
+    const uint32_t slot = findSlot(key, hash);
+    return slot == UINT32_MAX ? nullptr : &responses[indices[slot]];
+}
+
+void ResponseTable::insert(const std::string_view key, const uint64_t hash, const uint32_t index)
+{
+    reserve(1);
+    const uint32_t mask = control.size() - 1;
+    uint32_t slot = hash & mask;
+    while (control[slot] & 0x80)
+    {
+        slot = (slot + 1) & mask;
+    }
+    if (control[slot] == erasedSlot)
+    {
+        --erased;
+    }
+    control[slot] = getTag(hash);
+    hashes[slot] = hash;
+    keys[slot] = key;
+    indices[slot] = index;
+    ++size;
+}
+
+Response *ResponseTable::erase(const std::string_view key)
+{
+    const uint32_t slot = findSlot(key, hash(key));
+    if (slot == UINT32_MAX)
+    {
+        return nullptr;
+    }
+    control[slot] = erasedSlot;
+    ++erased;
+    --size;
+    return &responses[indices[slot]];
+}
+
+uint32_t ResponseTable::getSize() const
+{
+    return size;
+}
+} // namespace P2978
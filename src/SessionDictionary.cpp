@@ -0,0 +1,201 @@
+#include "SessionDictionary.hpp"
+
+namespace P2978
+{
+
+SessionDictionary::SessionDictionary(const SessionDictionary &) : intern(false)
+{
+}
+
+SessionDictionary &SessionDictionary::operator=(const SessionDictionary &other)
+{
+    if (this != &other)
+    {
+        *this = SessionDictionary(other);
+    }
+    return *this;
+}
+
+void SessionDictionary::writeVarint(std::string &buffer, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<char>(value));
+}
+
+void SessionDictionary::writeVarint(GatherBuffer &buffer, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<char>(value));
+}
+
+tl::expected<uint64_t, std::string> SessionDictionary::readVarint(const std::string_view message, uint32_t &bytesRead)
+{
+    uint64_t value = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7)
+    {
+        if (bytesRead >= message.size())
+        {
+            break;
+        }
+        const auto byte = static_cast<uint8_t>(message[bytesRead]);
+        ++bytesRead;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return value;
+        }
+    }
+    return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+}
+
+static void writeBytes(std::string &buffer, const std::string_view str)
+{
+    SessionDictionary::writeVarint(buffer, str.size());
+    buffer.append(str.begin(), str.end());
+}
+
+static void writeBytes(GatherBuffer &buffer, const std::string_view str)
+{
+    SessionDictionary::writeVarint(buffer, str.size());
+    buffer.appendReference(str);
+}
+
+template <typename Buffer>
+void SessionDictionary::writeToken(Buffer &buffer, const std::string_view str, const bool isPath)
+{
+    if (!intern)
+    {
+        writeVarint(buffer, literalToken);
+        writeBytes(buffer, str);
+        if (isPath)
+        {
+            buffer.push_back('\0');
+        }
+        return;
+    }
+
+    if (const auto it = ids.find(str); it != ids.end())
+    {
+        writeVarint(buffer, firstReference + it->second);
+        ++stats.references;
+        stats.bytesSaved += str.size();
+        return;
+    }
+
+    const size_t separator = isPath ? str.find_last_of("/\\") : std::string_view::npos;
+    if (separator != std::string_view::npos && separator + 1 < str.size())
+    {
+        writeVarint(buffer, pathToken);
+        // Directory gets its id before the path.
+        writeToken(buffer, str.substr(0, separator + 1), false);
+        writeBytes(buffer, str.substr(separator + 1));
+    }
+    else
+    {
+        writeVarint(buffer, entryToken);
+        writeBytes(buffer, str);
+    }
+    ids.emplace(arena.save(str), static_cast<uint32_t>(ids.size()));
+    ++stats.entries;
+}
+
+void SessionDictionary::write(std::string &buffer, const std::string_view str, const bool isPath)
+{
+    writeToken(buffer, str, isPath);
+}
+
+void SessionDictionary::write(GatherBuffer &buffer, const std::string_view str, const bool isPath)
+{
+    writeToken(buffer, str, isPath);
+}
+
+tl::expected<std::string_view, std::string> SessionDictionary::readToken(const std::string_view message,
+                                                                         uint32_t &bytesRead, const bool isPath,
+                                                                         const bool isDirectory)
+{
+    const auto &token = readVarint(message, bytesRead);
+    if (!token)
+    {
+        return tl::unexpected(token.error());
+    }
+
+    if (*token >= firstReference)
+    {
+        if (*token - firstReference >= entries.size())
+        {
+            return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+        }
+        const std::string_view entry = entries[*token - firstReference];
+        ++stats.references;
+        stats.bytesSaved += entry.size();
+        return entry;
+    }
+
+    // Directory of a path is always an entry, so the tokens do not nest further.
+    if (isDirectory && *token != entryToken)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    std::string_view directory;
+    if (*token == pathToken)
+    {
+        const auto &r = readToken(message, bytesRead, false, true);
+        if (!r)
+        {
+            return tl::unexpected(r.error());
+        }
+        directory = *r;
+    }
+
+    const auto &size = readVarint(message, bytesRead);
+    if (!size)
+    {
+        return tl::unexpected(size.error());
+    }
+    const bool terminated = *token == literalToken && isPath;
+    if (*size + terminated > message.size() - bytesRead)
+    {
+        return tl::unexpected(getErrorString(ErrorCategory::PARSING_ERROR));
+    }
+    const std::string_view bytes = message.substr(bytesRead, *size);
+    bytesRead += *size + terminated;
+
+    if (*token == literalToken)
+    {
+        return bytes;
+    }
+    std::string_view entry;
+    if (*token == pathToken)
+    {
+        scratch.assign(directory);
+        scratch.append(bytes);
+        entry = arena.save(scratch);
+    }
+    else
+    {
+        entry = arena.save(bytes);
+    }
+    entries.emplace_back(entry);
+    ++stats.entries;
+    return entry;
+}
+
+tl::expected<std::string_view, std::string> SessionDictionary::read(const std::string_view message,
+                                                                    uint32_t &bytesRead, const bool isPath)
+{
+    return readToken(message, bytesRead, isPath, false);
+}
+
+const SessionDictionaryStats &SessionDictionary::getStats() const
+{
+    return stats;
+}
+} // namespace P2978
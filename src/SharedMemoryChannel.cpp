@@ -0,0 +1,307 @@
+
+#include "SharedMemoryChannel.hpp"
+#include "Manager.hpp"
+
+#ifndef _WIN32
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <linux/futex.h>
+#include <new>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace P2978
+{
+
+// Data of a ring starts at the next page.
+static constexpr uint32_t ringHeaderSize = 4096;
+// Spinning only delays the peer on a single cpu.
+static const uint32_t spinCount = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 1024 : 0;
+
+// Exited process that is not reaped yet is not alive either, as its pidfd is readable.
+static bool isAlive(const uint32_t pid)
+{
+    if (!pid)
+    {
+        return true;
+    }
+#ifdef SYS_pidfd_open
+    if (const int pidfd = syscall(SYS_pidfd_open, pid, 0); pidfd != -1)
+    {
+        pollfd p{pidfd, POLLIN, 0};
+        const bool exited = poll(&p, 1, 0) == 1;
+        ::close(pidfd);
+        return !exited;
+    }
+    if (errno == ESRCH)
+    {
+        return false;
+    }
+#endif
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static tl::expected<void, std::string> waitWhileEqual(std::atomic<uint32_t> &word, const uint32_t value,
+                                                      std::atomic<uint32_t> &waiting,
+                                                      const std::atomic<uint32_t> &closed,
+                                                      const std::atomic<uint32_t> &peerPid)
+{
+    for (uint32_t i = 0; i < spinCount; ++i)
+    {
+        if (word.load(std::memory_order_acquire) != value)
+        {
+            return {};
+        }
+    }
+
+    // Only the waiting side clears the flag. Otherwise, the flag of a later wait could be cleared by the wake of an
+    // earlier one and that later wait would never be woken.
+    waiting.store(1, std::memory_order_seq_cst);
+    while (word.load(std::memory_order_seq_cst) == value)
+    {
+        if (closed.load(std::memory_order_acquire))
+        {
+            waiting.store(0, std::memory_order_relaxed);
+            return tl::unexpected(getErrorString(ErrorCategory::CHANNEL_CLOSED));
+        }
+
+        // Timeout is only for noticing the close or the exit of the peer.
+        timespec timeout{0, 100 * 1000 * 1000};
+        if (syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, value, &timeout, nullptr, 0) == -1)
+        {
+            if (errno == ETIMEDOUT && !isAlive(peerPid.load(std::memory_order_acquire)))
+            {
+                waiting.store(0, std::memory_order_relaxed);
+                return tl::unexpected(getErrorString(ErrorCategory::CHANNEL_CLOSED));
+            }
+            if (errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+            {
+                waiting.store(0, std::memory_order_relaxed);
+                return tl::unexpected(getErrorString());
+            }
+        }
+    }
+    waiting.store(0, std::memory_order_relaxed);
+    return {};
+}
+
+static void wake(std::atomic<uint32_t> &word, const std::atomic<uint32_t> &waiting)
+{
+    if (waiting.load(std::memory_order_seq_cst))
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+}
+
+tl::expected<SharedMemoryChannel, std::string> SharedMemoryChannel::map(const uint64_t fd_, const uint64_t size,
+                                                                        const bool isBuildSystem)
+{
+    void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (m == MAP_FAILED)
+    {
+        return tl::unexpected(getErrorString());
+    }
+
+    // First ring carries the CTB messages and the second the BTC messages.
+    auto *first = static_cast<char *>(m);
+    const uint32_t capacity = reinterpret_cast<RingHeader *>(first)->capacity;
+    char *second = first + ringHeaderSize + capacity;
+
+    SharedMemoryChannel channel;
+    channel.fd = fd_;
+    channel.mapping = m;
+    channel.mappingSize = size;
+    channel.readRing = reinterpret_cast<RingHeader *>(isBuildSystem ? first : second);
+    channel.writeRing = reinterpret_cast<RingHeader *>(isBuildSystem ? second : first);
+    channel.readData = reinterpret_cast<char *>(channel.readRing) + ringHeaderSize;
+    channel.writeData = reinterpret_cast<char *>(channel.writeRing) + ringHeaderSize;
+    return channel;
+}
+
+tl::expected<SharedMemoryChannel, std::string> SharedMemoryChannel::create(const uint32_t capacity)
+{
+    uint32_t ringCapacity = 4096;
+    while (ringCapacity < capacity)
+    {
+        ringCapacity *= 2;
+    }
+
+    const int memfd = memfd_create("P2978", MFD_CLOEXEC);
+    if (memfd == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    // memfd is closed on the errors after this.
+    const auto fail = [memfd] {
+        const std::string error = getErrorString();
+        ::close(memfd);
+        return tl::unexpected(error);
+    };
+    const uint64_t size = 2 * (static_cast<uint64_t>(ringHeaderSize) + ringCapacity);
+    if (ftruncate(memfd, size) == -1)
+    {
+        return fail();
+    }
+
+    void *m = mmap(nullptr, ringHeaderSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (m == MAP_FAILED)
+    {
+        return fail();
+    }
+    // memfd is zero-filled, so only the capacity needs to be set before the mapping of the whole file.
+    (new (m) RingHeader{})->capacity = ringCapacity;
+    munmap(m, ringHeaderSize);
+
+    auto r = map(memfd, size, true);
+    if (!r)
+    {
+        ::close(memfd);
+        return tl::unexpected(r.error());
+    }
+    new (r->writeRing) RingHeader{};
+    r->writeRing->capacity = ringCapacity;
+    r->writeRing->producerPid.store(getpid(), std::memory_order_release);
+    return r;
+}
+
+tl::expected<SharedMemoryChannel, std::string> SharedMemoryChannel::open(const uint64_t fd_)
+{
+    struct stat st;
+    if (fstat(fd_, &st) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    auto r = map(fd_, st.st_size, false);
+    if (r)
+    {
+        r->writeRing->producerPid.store(getpid(), std::memory_order_release);
+    }
+    return r;
+}
+
+void SharedMemoryChannel::setPeer(const uint32_t pid) const
+{
+    readRing->producerPid.store(pid, std::memory_order_release);
+}
+
+tl::expected<void, std::string> SharedMemoryChannel::writeBytes(const char *bytes, const uint32_t count) const
+{
+    const uint32_t capacity = writeRing->capacity;
+    uint32_t written = 0;
+    while (written != count)
+    {
+        const uint32_t tail = writeRing->tail.load(std::memory_order_relaxed);
+        const uint32_t head = writeRing->head.load(std::memory_order_acquire);
+        if (tail - head == capacity)
+        {
+            if (const auto &r = waitWhileEqual(writeRing->head, head, writeRing->producerWaiting, writeRing->closed,
+                                               readRing->producerPid);
+                !r)
+            {
+                return tl::unexpected(r.error());
+            }
+            continue;
+        }
+
+        const uint32_t offset = tail & (capacity - 1);
+        const uint32_t chunk = std::min({count - written, capacity - (tail - head), capacity - offset});
+        memcpy(writeData + offset, bytes + written, chunk);
+        writeRing->tail.store(tail + chunk, std::memory_order_seq_cst);
+        wake(writeRing->tail, writeRing->consumerWaiting);
+        written += chunk;
+    }
+    return {};
+}
+
+tl::expected<void, std::string> SharedMemoryChannel::readBytes(char *bytes, const uint32_t count) const
+{
+    const uint32_t capacity = readRing->capacity;
+    uint32_t read = 0;
+    while (read != count)
+    {
+        const uint32_t head = readRing->head.load(std::memory_order_relaxed);
+        const uint32_t tail = readRing->tail.load(std::memory_order_acquire);
+        if (tail == head)
+        {
+            if (const auto &r = waitWhileEqual(readRing->tail, tail, readRing->consumerWaiting, readRing->closed,
+                                               readRing->producerPid);
+                !r)
+            {
+                return tl::unexpected(r.error());
+            }
+            continue;
+        }
+
+        const uint32_t offset = head & (capacity - 1);
+        const uint32_t chunk = std::min({count - read, tail - head, capacity - offset});
+        memcpy(bytes + read, readData + offset, chunk);
+        readRing->head.store(head + chunk, std::memory_order_seq_cst);
+        wake(readRing->head, readRing->producerWaiting);
+        read += chunk;
+    }
+    return {};
+}
+
+tl::expected<void, std::string> SharedMemoryChannel::write(const std::string_view message) const
+{
+    const uint32_t size = message.size();
+    if (const auto &r = writeBytes(reinterpret_cast<const char *>(&size), 4); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    return writeBytes(message.data(), size);
+}
+
+tl::expected<void, std::string> SharedMemoryChannel::write(const std::vector<iovec> &iovecs, const uint32_t size) const
+{
+    if (const auto &r = writeBytes(reinterpret_cast<const char *>(&size), 4); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    for (const iovec &i : iovecs)
+    {
+        if (const auto &r = writeBytes(static_cast<const char *>(i.iov_base), i.iov_len); !r)
+        {
+            return tl::unexpected(r.error());
+        }
+    }
+    return {};
+}
+
+tl::expected<std::string_view, std::string> SharedMemoryChannel::read(std::string &buffer) const
+{
+    uint32_t size;
+    if (const auto &r = readBytes(reinterpret_cast<char *>(&size), 4); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    buffer.resize(size);
+    if (const auto &r = readBytes(buffer.data(), size); !r)
+    {
+        return tl::unexpected(r.error());
+    }
+    return std::string_view{buffer};
+}
+
+void SharedMemoryChannel::close() const
+{
+    readRing->closed.store(1, std::memory_order_release);
+    writeRing->closed.store(1, std::memory_order_release);
+}
+
+tl::expected<void, std::string> SharedMemoryChannel::unmap() const
+{
+    if (munmap(mapping, mappingSize) == -1 || ::close(fd) == -1)
+    {
+        return tl::unexpected(getErrorString());
+    }
+    return {};
+}
+
+} // namespace P2978
+#endif
@@ -0,0 +1,46 @@
+#include "StringArena.hpp"
+
+#include <cstring>
+
+namespace P2978
+{
+
+std::string_view StringArena::save(const std::string_view str)
+{
+    const uint32_t size = str.size() + 1;
+    char *copy;
+    if (size > pageSize)
+    {
+        // Does not replace the current page, which might still have some space left.
+        pages.emplace_back(new char[size]);
+        copy = pages.back().get();
+        stats.bytesReserved += size;
+        ++stats.pages;
+    }
+    else
+    {
+        if (size > remaining)
+        {
+            pages.emplace_back(new char[pageSize]);
+            current = pages.back().get();
+            remaining = pageSize;
+            stats.bytesReserved += pageSize;
+            ++stats.pages;
+        }
+        copy = current;
+        current += size;
+        remaining -= size;
+    }
+
+    memcpy(copy, str.data(), str.size());
+    copy[str.size()] = '\0';
+    stats.bytesUsed += size;
+    ++stats.strings;
+    return {copy, str.size()};
+}
+
+const ArenaStats &StringArena::getStats() const
+{
+    return stats;
+}
+} // namespace P2978
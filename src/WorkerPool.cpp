@@ -0,0 +1,93 @@
+
+#include "WorkerPool.hpp"
+
+namespace P2978
+{
+
+WorkerPool::WorkerPool(const uint32_t threadCount)
+{
+    workers.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; ++i)
+    {
+        workers.emplace_back(std::make_unique<Worker>());
+    }
+    threads.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back(&WorkerPool::work, this, i);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard lock(sleepMutex);
+        stopping = true;
+    }
+    sleeping.notify_all();
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> task)
+{
+    Worker &worker = *workers[nextWorker];
+    nextWorker = (nextWorker + 1) % workers.size();
+    // Queued under the sleepMutex, so a worker that has just found no task is already waiting for the notify.
+    {
+        std::lock_guard sleepLock(sleepMutex);
+        std::lock_guard lock(worker.mutex);
+        worker.tasks.emplace_back(std::move(task));
+        queued.fetch_add(1, std::memory_order_relaxed);
+    }
+    sleeping.notify_one();
+}
+
+bool WorkerPool::take(const uint32_t index, std::function<void()> &task)
+{
+    for (uint32_t i = 0; i < workers.size(); ++i)
+    {
+        Worker &worker = *workers[(index + i) % workers.size()];
+        std::lock_guard lock(worker.mutex);
+        if (worker.tasks.empty())
+        {
+            continue;
+        }
+        if (i == 0)
+        {
+            task = std::move(worker.tasks.front());
+            worker.tasks.pop_front();
+        }
+        else
+        {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+        }
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void WorkerPool::work(const uint32_t index)
+{
+    std::function<void()> task;
+    while (true)
+    {
+        if (take(index, task))
+        {
+            task();
+            continue;
+        }
+
+        std::unique_lock lock(sleepMutex);
+        sleeping.wait(lock, [this] { return stopping || queued.load(std::memory_order_relaxed); });
+        if (stopping)
+        {
+            return;
+        }
+    }
+}
+} // namespace P2978
@@ -1,18 +1,28 @@
+#include "BMIStore.hpp"
+#include "BMIWriteBehind.hpp"
+#include "DeliveredDeps.hpp"
 #include "IPCManagerBS.hpp"
 #include "IPCManagerCompiler.hpp"
+#include "ModuleGraph.hpp"
+#include "ReplyCache.hpp"
+#include "Serialization.hpp"
 #include "Testing.hpp"
 #include "fmt/printf.h"
+#include "rapidhash.h"
 #include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <set>
+#include <thread>
 
 #ifdef _WIN32
 #include <Windows.h>
 #else
 #include "sys/epoll.h"
+#include "sys/socket.h"
 #include "sys/wait.h"
 #include "wordexp.h"
+#include <fcntl.h>
 #include <unistd.h>
 #endif
 
@@ -242,6 +252,8 @@ struct RunCommand
     uint64_t readPipe;
     uint64_t writePipe;
     int exitStatus;
+    // Close-on-exec fd that only this process inherits, e.g. the memfd of its SharedMemoryChannel.
+    int inheritedFd = -1;
     RunCommand() = default;
     uint64_t startAsyncProcess(const char *command, uint64_t serverFd);
     void reapProcess() const;
@@ -431,6 +443,12 @@ uint64_t RunCommand::startAsyncProcess(const char *command, uint64_t serverFd)
         close(stdinPipesLocal[0]);
         close(stdinPipesLocal[1]);
 
+        if (inheritedFd != -1 && fcntl(inheritedFd, F_SETFD, 0) == -1)
+        {
+            perror("fcntl");
+            _exit(127);
+        }
+
         wordexp_t p;
         if (wordexp(command, &p, 0) != 0)
         {
@@ -614,13 +632,81 @@ void pruneCompilerOutput(IPCManagerBS &manager, char (&buffer)[320], CTB &type)
     const uint32_t payloadSize =
         *reinterpret_cast<uint32_t *>(compilerTestPrunedOutput.data() + (prunedSize - (4 + strlen(delimiter))));
     const char *payloadStart = compilerTestPrunedOutput.data() + (prunedSize - (4 + strlen(delimiter) + payloadSize));
-    if (const auto &r2 = IPCManagerBS::receiveMessage(buffer, type, string_view(payloadStart, payloadSize)); !r2)
+    if (const auto &r2 = IPCManagerBS::receiveMessage(buffer, type, string_view(payloadStart, payloadSize),
+                                                       manager.wireFormat);
+        !r2)
     {
         exitFailure(r2.error());
     }
     compilerTestPrunedOutput.resize(prunedSize - (4 + strlen(delimiter) + payloadSize));
 }
 
+#ifndef _WIN32
+// Framing::SEQPACKET. The compiler output is drained while waiting for the message on the socket, as the compiler
+// could otherwise block on a full stdout pipe.
+void receiveSeqPacketMessage(IPCManagerBS &manager, const uint64_t serverFd, const uint64_t readFd,
+                             char (&buffer)[320], CTB &type)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = readFd;
+    if (epoll_ctl(serverFd, EPOLL_CTL_ADD, readFd, &ev) == -1)
+    {
+        exitFailure(getErrorString());
+    }
+    ev.data.fd = manager.writeFd;
+    if (epoll_ctl(serverFd, EPOLL_CTL_ADD, manager.writeFd, &ev) == -1)
+    {
+        exitFailure(getErrorString());
+    }
+
+    while (true)
+    {
+        if (epoll_wait(serverFd, &ev, 1, -1) == -1)
+        {
+            exitFailure(getErrorString());
+        }
+
+        if (ev.data.fd == static_cast<int>(readFd))
+        {
+            char output[4096];
+            const int readCount = read(readFd, output, 4096);
+            if (readCount <= 0)
+            {
+                exitFailure("early exit by CompilerTest");
+            }
+            compilerTestPrunedOutput.append(output, readCount);
+            continue;
+        }
+
+        if (const auto &r2 = manager.receiveMessage(buffer, type); !r2)
+        {
+            exitFailure(r2.error());
+        }
+        break;
+    }
+
+    if (epoll_ctl(serverFd, EPOLL_CTL_DEL, readFd, &ev) == -1 ||
+        epoll_ctl(serverFd, EPOLL_CTL_DEL, manager.writeFd, &ev) == -1)
+    {
+        exitFailure(getErrorString());
+    }
+}
+#endif
+
+#ifndef _WIN32
+// Framing::SHARED_MEMORY. Runs in a separate thread, as the messages are not received through a file descriptor.
+void drainCompilerOutput(const uint64_t readFd)
+{
+    char output[4096];
+    int readCount;
+    while ((readCount = read(readFd, output, 4096)) > 0)
+    {
+        compilerTestPrunedOutput.append(output, readCount);
+    }
+}
+#endif
+
 void closeHandle(const uint64_t fd)
 {
 #ifdef _WIN32
@@ -655,14 +741,88 @@ uint64_t createMultiplex()
 #endif
 }
 
-int runTest()
+int runTest(const Framing framing, const WireFormat wireFormat = WireFormat::V1)
 {
     CTBLastMessage lastMessage;
     const uint64_t serverFd = createMultiplex();
 
     RunCommand compilerTest;
-    compilerTest.startAsyncProcess(COMPILER_TEST, serverFd);
-    IPCManagerBS manager{compilerTest.writePipe};
+    string command = COMPILER_TEST;
+    uint64_t writeFd;
+#ifndef _WIN32
+    int sockets[2];
+    if (framing == Framing::SEQPACKET)
+    {
+        // Only the compiler end is inherited.
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) == -1 || fcntl(sockets[0], F_SETFD, FD_CLOEXEC) == -1)
+        {
+            exitFailure(getErrorString());
+        }
+        command += fmt::format(" seqpacket {}", sockets[1]);
+    }
+    SharedMemoryChannel channel;
+    if (framing == Framing::SHARED_MEMORY)
+    {
+        auto r = SharedMemoryChannel::create();
+        if (!r)
+        {
+            exitFailure(r.error());
+        }
+        channel = *r;
+        command += fmt::format(" shared-memory {}", channel.fd);
+        compilerTest.inheritedFd = static_cast<int>(channel.fd);
+    }
+#endif
+    if (framing == Framing::LENGTH_PREFIXED)
+    {
+        command += " length-prefixed";
+    }
+    if (wireFormat == WireFormat::V2)
+    {
+        command += " v2";
+    }
+    else if (wireFormat == WireFormat::V1_INTERNED)
+    {
+        command += " interned";
+    }
+    else if (wireFormat == WireFormat::V1_HASHED)
+    {
+        command += " hashed";
+    }
+    // Requests carry the hashes only in this wire format, and the replies are hashed as well. In the others, the hashed
+    // flag is not sent, so it is not set on the received requests.
+    const bool hashed = wireFormat == WireFormat::V1_HASHED;
+    auto checkHash = [&](const string_view logicalName, const bool requestHashed, const uint64_t hash) {
+        if (requestHashed != hashed || (hashed && hash != hashLogicalName(logicalName)))
+        {
+            exitFailure(fmt::format("Incorrect hash of {} in the request", logicalName));
+        }
+    };
+    compilerTest.startAsyncProcess(command.c_str(), serverFd);
+    writeFd = compilerTest.writePipe;
+#ifndef _WIN32
+    if (framing == Framing::SEQPACKET)
+    {
+        closeHandle(sockets[1]);
+        writeFd = sockets[0];
+    }
+    IPCManagerBS manager = framing == Framing::SHARED_MEMORY ? IPCManagerBS{channel} : IPCManagerBS{writeFd, framing};
+
+    // Compiler output is drained concurrently as otherwise the compiler could block on a full stdout pipe.
+    std::thread outputDrainer;
+    if (framing == Framing::SHARED_MEMORY)
+    {
+        channel.setPeer(compilerTest.pid);
+        outputDrainer = std::thread(drainCompilerOutput, compilerTest.readPipe);
+    }
+#else
+    IPCManagerBS manager{writeFd, framing};
+#endif
+    manager.wireFormat = wireFormat;
+    // Prefetch replies are sent through it.
+    ReplyCache replyCache;
+    // BTC::MODULE and BTC::NON_MODULE replies omit the dependencies sent before.
+    DeliveredDeps delivered;
 
     CTB type;
     char buffer[320];
@@ -670,12 +830,33 @@ int runTest()
     {
         bool loopExit = false;
 
-        readCompilerMessage(serverFd, compilerTest.readPipe);
-        if (!endsWith(compilerTestPrunedOutput, delimiter))
+#ifndef _WIN32
+        if (framing == Framing::SEQPACKET)
         {
-            exitFailure("early exit by CompilerTest");
+            receiveSeqPacketMessage(manager, serverFd, compilerTest.readPipe, buffer, type);
+        }
+        else if (framing == Framing::SHARED_MEMORY)
+        {
+            if (const auto &r2 = manager.receiveMessage(buffer, type); !r2)
+            {
+                exitFailure(r2.error());
+            }
+        }
+        else
+#endif
+        {
+            // Previous read might have received more than one message, as the compiler does not wait for the
+            // CTBPrefetch reply.
+            if (!endsWith(compilerTestPrunedOutput, delimiter))
+            {
+                readCompilerMessage(serverFd, compilerTest.readPipe);
+            }
+            if (!endsWith(compilerTestPrunedOutput, delimiter))
+            {
+                exitFailure("early exit by CompilerTest");
+            }
+            pruneCompilerOutput(manager, buffer, type);
         }
-        pruneCompilerOutput(manager, buffer, type);
 
         switch (type)
         {
@@ -683,7 +864,13 @@ int runTest()
         case CTB::MODULE: {
             const auto &ctbModule = reinterpret_cast<CTBModule &>(buffer);
             printMessage(ctbModule, false);
+            checkHash(ctbModule.moduleName, ctbModule.hashed, ctbModule.hash);
             BTCModule btcModule = getBTCModule(ctbModule);
+            if (hashed)
+            {
+                hashLogicalNames(btcModule);
+            }
+            delivered.omitDelivered(ctbModule, btcModule);
             if (const auto &r2 = manager.sendMessage(btcModule); !r2)
             {
                 exitFailure(r2.error());
@@ -703,7 +890,13 @@ int runTest()
         case CTB::NON_MODULE: {
             const auto &ctbNonModule = reinterpret_cast<CTBNonModule &>(buffer);
             printMessage(ctbNonModule, false);
+            checkHash(ctbNonModule.logicalName, ctbNonModule.hashed, ctbNonModule.hash);
             BTCNonModule nonModule = getBTCNonModule(ctbNonModule);
+            if (hashed)
+            {
+                hashLogicalNames(nonModule);
+            }
+            delivered.omitDelivered(ctbNonModule, nonModule);
             if (const auto &r2 = manager.sendMessage(nonModule); !r2)
             {
                 exitFailure(r2.error());
@@ -713,6 +906,101 @@ int runTest()
 
         break;
 
+        case CTB::PREFETCH: {
+            const auto &ctbPrefetch = reinterpret_cast<CTBPrefetch &>(buffer);
+            checkHash(ctbPrefetch.logicalName, ctbPrefetch.hashed, ctbPrefetch.hash);
+            if (ctbPrefetch.isModule)
+            {
+                const CTBModule ctbModule{ctbPrefetch.logicalName};
+                printMessage(ctbModule, false);
+                BTCModule btcModule = getBTCModule(ctbModule);
+                if (hashed)
+                {
+                    hashLogicalNames(btcModule);
+                }
+                const ReplyCache::Payload payload = replyCache.insert(
+                    ReplyCache::getKey(ctbModule, manager.wireFormat), manager.serializeReply(btcModule), btcModule);
+                if (const auto &r2 = manager.sendSerializedReply(*payload, BTC::PREFETCH, ctbPrefetch.requestId); !r2)
+                {
+                    exitFailure(r2.error());
+                }
+                printMessage(btcModule, true);
+            }
+            else
+            {
+                const CTBNonModule ctbNonModule{ctbPrefetch.isHeaderUnit, ctbPrefetch.logicalName};
+                printMessage(ctbNonModule, false);
+                BTCNonModule nonModule = getBTCNonModule(ctbNonModule);
+                if (hashed)
+                {
+                    hashLogicalNames(nonModule);
+                }
+                const string key = ReplyCache::getKey(ctbNonModule, manager.wireFormat);
+                replyCache.insert(key, manager.serializeReply(nonModule), nonModule);
+                const ReplyCache::Payload payload = replyCache.find(key);
+                if (!payload)
+                {
+                    exitFailure("reply is not cached");
+                }
+                if (const auto &r2 = manager.sendSerializedReply(*payload, BTC::PREFETCH, ctbPrefetch.requestId); !r2)
+                {
+                    exitFailure(r2.error());
+                }
+                // As if the header-unit is rebuilt.
+                if (nonModule.isHeaderUnit)
+                {
+                    replyCache.invalidate(nonModule.filePath);
+                    if (replyCache.find(key))
+                    {
+                        exitFailure("reply is not invalidated");
+                    }
+                }
+                printMessage(nonModule, true);
+            }
+        }
+
+        break;
+
+        case CTB::BATCH: {
+            auto &ctbBatch = reinterpret_cast<CTBBatch &>(buffer);
+            BTCBatch btcBatch;
+            for (const CTBModule &ctbModule : ctbBatch.modules)
+            {
+                printMessage(ctbModule, false);
+                checkHash(ctbModule.moduleName, ctbModule.hashed, ctbModule.hash);
+                btcBatch.modules.emplace_back(getBTCModule(ctbModule));
+                if (hashed)
+                {
+                    hashLogicalNames(btcBatch.modules.back());
+                }
+            }
+            for (const CTBNonModule &ctbNonModule : ctbBatch.nonModules)
+            {
+                printMessage(ctbNonModule, false);
+                checkHash(ctbNonModule.logicalName, ctbNonModule.hashed, ctbNonModule.hash);
+                btcBatch.nonModules.emplace_back(getBTCNonModule(ctbNonModule));
+                if (hashed)
+                {
+                    hashLogicalNames(btcBatch.nonModules.back());
+                }
+            }
+            if (const auto &r2 = manager.sendMessage(btcBatch); !r2)
+            {
+                exitFailure(r2.error());
+            }
+            for (const BTCModule &btcModule : btcBatch.modules)
+            {
+                printMessage(btcModule, true);
+            }
+            for (const BTCNonModule &nonModule : btcBatch.nonModules)
+            {
+                printMessage(nonModule, true);
+            }
+            std::destroy_at(&ctbBatch);
+        }
+
+        break;
+
         case CTB::LAST_MESSAGE: {
             lastMessage = reinterpret_cast<CTBLastMessage &>(buffer);
             printMessage(lastMessage, false);
@@ -781,6 +1069,23 @@ int runTest()
         }
     }
 
+    // Persisted after the dependent compilations could use it, as it might be published with
+    // BMIPublication::WRITE_BEHIND.
+    BMIWriteBehind writeBehind;
+    if (const auto &r2 = writeBehind.publish(bmi.filePath); !r2)
+    {
+        exitFailure(r2.error());
+    }
+    if (const auto &r2 = writeBehind.flush(); !r2)
+    {
+        exitFailure(r2.error());
+    }
+    if (const BMIWriteBehindStats stats = writeBehind.getStats();
+        stats.pending || stats.published != 1 || stats.persisted != 1 || stats.flushes != 1)
+    {
+        exitFailure("Incorrect BMIWriteBehind stats");
+    }
+
     // creates compiler mapping to already created mapping and read contents.
     if (const auto &r2 = BuildSystemTest::readSharedMemoryBMIFile(bmi); !r2)
     {
@@ -793,6 +1098,10 @@ int runTest()
         {
             exitFailure(fmt::format("File Contents not similar for {}", bmi.filePath));
         }
+        if (lastMessage.hashed != hashed || (hashed && lastMessage.hash != rapidhash(bmiText.data(), bmiText.size())))
+        {
+            exitFailure(fmt::format("Incorrect hash of {} in CTBLastMessage", bmi.filePath));
+        }
         if (r2->file != output)
         {
             difference(string(r2->file), output);
@@ -837,6 +1146,36 @@ int runTest()
             exitFailure(fmt::format("file.fileSize is different from fileContent.size\n"));
         }
 
+#ifndef _WIN32
+        // bmi2.txt is mapped once for both the handles. Budget only fits one of the files, so the idle bmi2.txt is
+        // evicted once bmi.txt is acquired.
+        {
+            BMIRegistry registry(std::max<uint64_t>(bmi.fileSize, bmi2Content.size()));
+            auto h1 = registry.acquire(bmi2.filePath);
+            auto h2 = registry.acquire(bmi2.filePath);
+            if (!h1 || !h2)
+            {
+                exitFailure(!h1 ? h1.error() : h2.error());
+            }
+            if (h1->getFile().data() != h2->getFile().data() || h1->getFile() != bmi2Content ||
+                h2->getBMIFile().fileSize != bmi2Content.size())
+            {
+                exitFailure("BMIRegistry handles are different for the same file");
+            }
+            h1->reset();
+            h2->reset();
+            if (const auto &h3 = registry.acquire(bmi.filePath); !h3)
+            {
+                exitFailure(h3.error());
+            }
+            if (const BMIRegistryStats stats = registry.getStats();
+                stats.entries != 1 || stats.hits != 1 || stats.misses != 2 || stats.evictions != 1)
+            {
+                exitFailure("Incorrect BMIRegistry stats");
+            }
+        }
+#endif
+
         // After receiving the next message, CompilerTest will check that bmi2.txt is same as the received mapping. This
         // is tested to ensure that if the build-system is making the bmi first time is working correctly.
         constexpr BTCLastMessage btcLastMessage;
@@ -849,19 +1188,52 @@ int runTest()
     }
 
     // As CompilerTest will output some print statements.
-    readCompilerMessage(serverFd, compilerTest.readPipe);
+#ifndef _WIN32
+    if (framing == Framing::SHARED_MEMORY)
+    {
+        outputDrainer.join();
+    }
+    else
+#endif
+    {
+        readCompilerMessage(serverFd, compilerTest.readPipe);
+    }
 
     compilerTest.reapProcess();
     if (compilerTest.exitStatus != EXIT_SUCCESS)
     {
         print("CompilerTest did not exit successfully. ExitCode {}\n", compilerTest.exitStatus);
     }
+    if (framing == Framing::SEQPACKET)
+    {
+        closeHandle(manager.writeFd);
+    }
+#ifndef _WIN32
+    if (framing == Framing::SHARED_MEMORY)
+    {
+        if (const auto &r2 = channel.unmap(); !r2)
+        {
+            exitFailure(r2.error());
+        }
+    }
+#endif
 
     if (const auto &r2 = IPCManagerBS::closeBMIFileMapping(bmi2Mapping); !r2)
     {
         exitFailure(r2.error());
     }
 
+    if (wireFormat == WireFormat::V1_INTERNED)
+    {
+        const SessionDictionaryStats &stats = manager.getDictionaryStats();
+        if (!stats.entries || !stats.references || !stats.bytesSaved)
+        {
+            exitFailure("Strings of the replies are not interned");
+        }
+        print("Dictionary Entries {} References {} Bytes Saved {}\n", stats.entries, stats.references,
+              stats.bytesSaved);
+    }
+
     for (string *alloc : buildTestallocations)
     {
         delete alloc;
@@ -871,15 +1243,357 @@ int runTest()
     return EXIT_SUCCESS;
 }
 
+static void testModuleGraph()
+{
+    // a and b import std, c imports a and b, d imports c.
+    ModuleGraph graph;
+    const uint32_t stdModule = graph.addModule("std");
+    const uint32_t a = graph.addModule("a");
+    const uint32_t b = graph.addModule("b");
+    const uint32_t c = graph.addModule("c");
+    const uint32_t d = graph.addModule("d");
+    for (const uint32_t id : {stdModule, a, b, c, d})
+    {
+        graph.setBMI(id, fmt::format("{}.bmi", id), id + 1, false);
+    }
+    graph.setDependencies(a, {stdModule});
+    graph.setDependencies(b, {stdModule});
+    graph.setDependencies(c, {a, b});
+    graph.setDependencies(d, {c});
+
+    BTCModule reply;
+    if (auto r = graph.fillReply(d, reply); !r || !*r || reply.modDeps.size() != 4 || reply.requested.fileSize != 5)
+    {
+        exitFailure("Incorrect ModuleGraph closure");
+    }
+    if (const ModuleGraphStats stats = graph.getStats(); stats.closures != 5 || stats.distinctClosures != 4)
+    {
+        exitFailure("ModuleGraph closures of a and b are not shared");
+    }
+
+    // c no longer imports b, so closures of c and d are recomputed.
+    graph.setDependencies(c, {a});
+    if (graph.getStats().closures != 3 || graph.getClosureSize(d).value_or(0) != 3)
+    {
+        exitFailure("Stale ModuleGraph closure");
+    }
+
+    if (auto r = graph.fillReply(d, reply, {2, 2}); !r || *r || reply.modDeps.size() != 1)
+    {
+        exitFailure("ModuleGraph policy did not send only the direct dependencies");
+    }
+
+    graph.setDependencies(stdModule, {d});
+    if (graph.getClosureSize(d))
+    {
+        exitFailure("ModuleGraph cycle is not detected");
+    }
+
+    // Closure of a deep chain of imports is computed without recursion.
+    ModuleGraph chain;
+    constexpr uint32_t depth = 20000;
+    for (uint32_t i = 0; i < depth; ++i)
+    {
+        chain.addModule(std::to_string(i));
+        if (i)
+        {
+            chain.setDependencies(i, {i - 1});
+        }
+    }
+    if (chain.getClosureSize(depth - 1).value_or(0) != depth - 1)
+    {
+        exitFailure("Incorrect ModuleGraph closure of a deep chain");
+    }
+}
+
+static void testGatherBuffer()
+{
+    // Overwrite spans a scratch segment and a referenced string, which must not be modified.
+    const string referenced(GatherBuffer::copyThreshold * 2, 'x');
+    GatherBuffer buffer;
+    buffer.append("ab", 2);
+    buffer.appendReference(referenced);
+    buffer.append("cd", 2);
+    buffer.overwrite(1, "1234", 4);
+    string flattened;
+    buffer.flatten(flattened);
+    if (flattened != "a1234" + referenced.substr(3) + "cd" || referenced != string(referenced.size(), 'x'))
+    {
+        exitFailure("Incorrect GatherBuffer overwrite");
+    }
+}
+
+static void testBatchTrailingBytes()
+{
+    // Batch is parsed, but is followed by an extra byte. It is destroyed before the error is returned, else its
+    // vectors leak.
+    const string moduleName = getRandomString();
+    const string headerUnit = getRandomString();
+    CTBBatch batch;
+    batch.modules.emplace_back(CTBModule{moduleName});
+    batch.nonModules.emplace_back(CTBNonModule{true, headerUnit});
+    string message(1, static_cast<char>(CTB::BATCH));
+    serialize(message, batch);
+    message.push_back('\0');
+    char ctbBuffer[320];
+    CTB type;
+    if (IPCManagerBS::receiveMessage(ctbBuffer, type, message))
+    {
+        exitFailure("CTBBatch with the trailing bytes is received");
+    }
+}
+
+static void testHashedWireFormat()
+{
+    // Hashes are only sent in WireFormat::V1_HASHED, so a hashed request is plain in the other wire formats.
+    const string logicalName = getRandomString();
+    const CTBNonModule request{false, logicalName, true, hashLogicalName(logicalName)};
+    for (const WireFormat wireFormat : {WireFormat::V1, WireFormat::V1_HASHED})
+    {
+        string message(1, static_cast<char>(CTB::NON_MODULE));
+        serialize(message, request, nullptr, wireFormat);
+        const bool hashed = wireFormat == WireFormat::V1_HASHED;
+        if (message.size() != 1 + 1 + 4 + logicalName.size() + (hashed ? 9 : 0))
+        {
+            exitFailure("Incorrect size of the CTBNonModule");
+        }
+        char ctbBuffer[320];
+        CTB type;
+        if (const auto &r = IPCManagerBS::receiveMessage(ctbBuffer, type, message, wireFormat); !r)
+        {
+            exitFailure(r.error());
+        }
+        if (const auto &received = reinterpret_cast<CTBNonModule &>(ctbBuffer);
+            received.logicalName != logicalName || received.hashed != hashed ||
+            (hashed && received.hash != request.hash))
+        {
+            exitFailure("Incorrect CTBNonModule");
+        }
+    }
+}
+
+static void testDeliveredDeps()
+{
+    DeliveredDeps delivered;
+    BTCModule a;
+    a.requested.filePath = "a.bmi";
+    a.modDeps.resize(2);
+    a.modDeps[0].file.filePath = "std.bmi";
+    a.modDeps[0].logicalNames = {"std"};
+    a.modDeps[1].file.filePath = "x.bmi";
+    a.modDeps[1].logicalNames = {"x"};
+    delivered.omitDelivered(CTBModule{"a"}, a);
+    if (a.modDeps.size() != 2)
+    {
+        exitFailure("DeliveredDeps omitted a dependency of the first reply");
+    }
+
+    // std is omitted. x has a new logical name, and y a new BMI file, so both are sent.
+    BTCModule b;
+    b.requested.filePath = "b.bmi";
+    b.modDeps.resize(4);
+    b.modDeps[0].file.filePath = "std.bmi";
+    b.modDeps[0].logicalNames = {"std"};
+    b.modDeps[1].file.filePath = "x.bmi";
+    b.modDeps[1].logicalNames = {"x", "x2"};
+    b.modDeps[2].file.filePath = "y.bmi";
+    b.modDeps[3].file.filePath = "a.bmi";
+    b.modDeps[3].logicalNames = {"a"};
+    hashLogicalNames(b);
+    delivered.omitDelivered(CTBModule{"b"}, b);
+    if (b.modDeps.size() != 2 || b.modDeps[0].logicalNames.size() != 1 || b.modDeps[0].logicalNames[0] != "x2" ||
+        b.modDeps[0].logicalNameHashes != vector<uint64_t>{hashLogicalName("x2")} ||
+        b.modDeps[1].file.filePath != "y.bmi")
+    {
+        exitFailure("Incorrect DeliveredDeps delta reply");
+    }
+    if (const DeliveredDepsStats stats = delivered.getStats(); stats.logicalNames != 5 || stats.bmiFiles != 5 ||
+                                                               stats.omittedDeps != 2 || stats.omittedLogicalNames != 3)
+    {
+        exitFailure("Incorrect DeliveredDeps stats");
+    }
+}
+
+static void testBMIStore()
+{
+    namespace fs = std::filesystem;
+    const fs::path directory = fs::current_path() / "bmi-store";
+    std::error_code ec;
+    fs::remove_all(directory, ec);
+    fs::create_directories(directory / "objects", ec);
+
+    // a and b are identical, c is not.
+    const string a = (directory / "a.bmi").generic_string();
+    const string b = (directory / "b.bmi").generic_string();
+    const string c = (directory / "c.bmi").generic_string();
+    const string content = getRandomString(4096);
+    std::ofstream(a) << content;
+    std::ofstream(b) << content;
+    std::ofstream(c) << content << "c";
+    const uint64_t hash = rapidhash(content.data(), content.size());
+
+    BMIStore store((directory / "objects").generic_string());
+    const auto &r1 = store.publish(a, content.size(), hash);
+    const auto &r2 = store.publish(b, content.size(), hash);
+    const auto &r3 = store.publish(c, content.size() + 1, rapidhash(fileToString(c).data(), content.size() + 1));
+    if (!r1 || !r2 || !r3)
+    {
+        exitFailure("BMIStore publish failed");
+    }
+    if (*r1 != *r2 || *r1 == *r3 || fileToString(b) != content)
+    {
+        exitFailure("Identical BMIs are not stored once");
+    }
+#ifndef _WIN32
+    if (!fs::equivalent(a, b, ec) || fs::equivalent(a, c, ec))
+    {
+        exitFailure("Identical BMIs are not linked");
+    }
+#endif
+    // Same hash and size as a, but another content.
+    const string d = (directory / "d.bmi").generic_string();
+    string collision = content;
+    collision.back() ^= 1;
+    std::ofstream(d) << collision;
+    if (const auto &r4 = store.publish(d, content.size(), hash); !r4 || *r4 != d || fileToString(d) != collision)
+    {
+        exitFailure("BMI of a colliding hash is replaced");
+    }
+    if (const BMIStoreStats stats = store.getStats();
+        stats.published != 4 || stats.deduplicated != 1 || stats.savedBytes != content.size())
+    {
+        exitFailure("Incorrect BMIStore stats");
+    }
+    fs::remove_all(directory, ec);
+}
+
+#ifndef _WIN32
+static void testReplyCache()
+{
+    // Same request is answered twice. Second one is a hit and sends the payload serialized for the first.
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        exitFailure(getErrorString());
+    }
+    const IPCManagerBS manager(fds[1]);
+    ReplyCache replyCache;
+    const CTBModule request{"a"};
+    BTCModule reply;
+    reply.requested.filePath = "a.bmi";
+    reply.modDeps.resize(1);
+    reply.modDeps[0].file.filePath = "std.bmi";
+    reply.modDeps[0].logicalNames = {"std"};
+    vector<const string *> payloads;
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+        const string key = ReplyCache::getKey(request, manager.wireFormat);
+        ReplyCache::Payload payload = replyCache.find(key);
+        if (!payload)
+        {
+            payload = replyCache.insert(key, manager.serializeReply(reply), reply);
+        }
+        if (const auto &r = manager.sendSerializedReply(*payload, BTC::MODULE); !r)
+        {
+            exitFailure(r.error());
+        }
+        payloads.emplace_back(payload.get());
+    }
+    close(fds[1]);
+    string sent;
+    char buffer[4096];
+    for (ssize_t n; (n = read(fds[0], buffer, sizeof(buffer))) > 0;)
+    {
+        sent.append(buffer, n);
+    }
+    close(fds[0]);
+
+    if (const ReplyCacheStats stats = replyCache.getStats();
+        stats.entries != 1 || stats.hits != 1 || stats.misses != 1 || payloads[0] != payloads[1])
+    {
+        exitFailure("Reply is not reused from the ReplyCache");
+    }
+    if (sent.empty() || sent.size() % 2 || sent.substr(0, sent.size() / 2) != sent.substr(sent.size() / 2))
+    {
+        exitFailure("Cached reply is not sent as the first one");
+    }
+    replyCache.invalidate("std.bmi");
+    if (replyCache.find(ReplyCache::getKey(request, manager.wireFormat)) || replyCache.getStats().invalidations != 1)
+    {
+        exitFailure("Reply is not invalidated with its dependency");
+    }
+}
+
+static void testSharedMemoryPeerExit()
+{
+    // Compiler exits without opening the channel, so the read fails instead of waiting forever.
+    auto r = SharedMemoryChannel::create(4096);
+    if (!r)
+    {
+        exitFailure(r.error());
+    }
+    // Only the compiler that owns the channel inherits it.
+    if (!(fcntl(static_cast<int>(r->fd), F_GETFD) & FD_CLOEXEC))
+    {
+        exitFailure("SharedMemoryChannel memfd is inherited by every spawned process");
+    }
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        _exit(EXIT_SUCCESS);
+    }
+    r->setPeer(pid);
+    string buffer;
+    if (const auto &r2 = r->read(buffer); r2 || r2.error() != getErrorString(ErrorCategory::CHANNEL_CLOSED))
+    {
+        exitFailure("Exit of the shared memory peer is not noticed");
+    }
+    waitpid(pid, nullptr, 0);
+    if (const auto &r2 = r->unmap(); !r2)
+    {
+        exitFailure(r2.error());
+    }
+}
+#endif
+
 int main()
 {
-    runTest();
+    testModuleGraph();
+    testGatherBuffer();
+    testBatchTrailingBytes();
+    testHashedWireFormat();
+    testDeliveredDeps();
+    testBMIStore();
+#ifndef _WIN32
+    testReplyCache();
+    testSharedMemoryPeerExit();
+#endif
+    // Strings of the replies are interned in this run.
+    runTest(Framing::DELIMITER, WireFormat::V1_INTERNED);
+    fmt::println("\n\n\nCompilerTest Output\n\n\n {}", compilerTestPrunedOutput);
+    compilerTestPrunedOutput.clear();
+    tempTestFiles.clear();
+    buildTestallocations.clear();
+    // Requests and replies carry the hashes of the logical-names in this run.
+    runTest(Framing::LENGTH_PREFIXED, WireFormat::V1_HASHED);
     fmt::println("\n\n\nCompilerTest Output\n\n\n {}", compilerTestPrunedOutput);
     compilerTestPrunedOutput.clear();
     tempTestFiles.clear();
     buildTestallocations.clear();
-    runTest();
+    runTest(Framing::LENGTH_PREFIXED, WireFormat::V2);
     fmt::println("\n\n\nCompilerTest Output\n\n\n {}", compilerTestPrunedOutput);
+#ifndef _WIN32
+    compilerTestPrunedOutput.clear();
+    tempTestFiles.clear();
+    buildTestallocations.clear();
+    runTest(Framing::SEQPACKET);
+    fmt::println("\n\n\nCompilerTest Output\n\n\n {}", compilerTestPrunedOutput);
+    compilerTestPrunedOutput.clear();
+    tempTestFiles.clear();
+    buildTestallocations.clear();
+    runTest(Framing::SHARED_MEMORY);
+    fmt::println("\n\n\nCompilerTest Output\n\n\n {}", compilerTestPrunedOutput);
+#endif
 }
 
 extern "C" const char *__asan_default_options()
@@ -2,12 +2,15 @@
 #include "IPCManagerCompiler.hpp"
 #include "Testing.hpp"
 #include "fmt/printf.h"
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <map>
 #include <random>
 #include <set>
 #include <string>
 #include <thread>
+#include <tuple>
 
 using fmt::print;
 using namespace std;
@@ -36,13 +39,145 @@ struct CompilerTest
     {
         return IPCManagerCompiler::readSharedMemoryBMIFile(file);
     }
+
+    // Every BMI file is mapped once and the mapping is freed with the last response that has it. Unless lazyMapping,
+    // every received BMI file is mapped.
+    static void checkSharedMappings(IPCManagerCompiler &manager)
+    {
+        for (const auto &[filePath, mapping] : manager.filePathProcessMapping)
+        {
+            if (manager.mappingsByPath.at(filePath)->mapping.file.data() != mapping.file.data())
+            {
+                exitFailure(fmt::format("BMI file {} is not mapped once", filePath));
+            }
+        }
+        if (!manager.lazyMapping && manager.filePathProcessMapping.size() != manager.mappingsByPath.size())
+        {
+            exitFailure("Received BMI file is not in the filePathProcessMapping");
+        }
+        // Logical-names of a BMI file refer to one response.
+        vector<string_view> logicalNames;
+        map<std::tuple<string_view, FileType, bool>, const Response *> bmiResponses;
+        manager.responses.forEach([&](const string_view logicalName, const Response &response) {
+            logicalNames.emplace_back(logicalName);
+            if (response.type != FileType::HEADER_FILE &&
+                bmiResponses.emplace(std::tuple(response.filePath, response.type, response.isSystem), &response)
+                        .first->second != &response)
+            {
+                exitFailure(fmt::format("BMI file {} has more than one response", response.filePath));
+            }
+        });
+        for (const string_view logicalName : logicalNames)
+        {
+            if (const auto &r = manager.closeBMIFileMapping(logicalName); !r)
+            {
+                exitFailure(r.error());
+            }
+        }
+        // Left are the BMI files sent without a new logical-name, which stay mapped till these are closed.
+        for (const auto &shared : manager.sharedMappings)
+        {
+            if (shared.references)
+            {
+                exitFailure("BMI file mapping is referenced after all the responses are closed");
+            }
+            if (!manager.lazyMapping && !shared.mapping.file.data())
+            {
+                exitFailure(fmt::format("Received BMI file {} is not mapped", shared.filePaths[0]));
+            }
+        }
+        if (const auto &r = manager.closeUnreferencedBMIFiles(); !r)
+        {
+            exitFailure(r.error());
+        }
+        if (!manager.sharedMappings.empty() || !manager.mappingsByPath.empty() ||
+            !manager.filePathProcessMapping.empty())
+        {
+            exitFailure("BMI file mapping is not closed after all the responses are closed");
+        }
+    }
+
+    // In the lazyMapping mode, no BMI file is mapped by the replies alone. Mapped are only the files of the
+    // logical-names that were found.
+    static void checkUnmapped(IPCManagerCompiler &manager, const vector<string> &foundNames)
+    {
+        set<const IPCManagerCompiler::SharedMapping *> used;
+        for (const string &logicalName : foundNames)
+        {
+            if (const Response *response = manager.responses.find(logicalName);
+                response && response->type != FileType::HEADER_FILE)
+            {
+                used.emplace(manager.mappingsByPath.at(response->filePath));
+            }
+        }
+        for (const auto &shared : manager.sharedMappings)
+        {
+            if (shared.mapping.file.data() && !used.count(&shared))
+            {
+                exitFailure(fmt::format("BMI file {} is mapped before its first use", shared.filePaths[0]));
+            }
+        }
+    }
 };
 
-int main()
+int main(const int argc, char **argv)
 {
     // std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-    IPCManagerCompiler manager;
+    Framing framing = Framing::DELIMITER;
+    uint64_t channelFd = 0;
+    if (argc > 1 && string_view(argv[1]) == "length-prefixed")
+    {
+        framing = Framing::LENGTH_PREFIXED;
+    }
+    else if (argc > 2 && string_view(argv[1]) == "seqpacket")
+    {
+        framing = Framing::SEQPACKET;
+        channelFd = std::stoull(argv[2]);
+    }
+#ifndef _WIN32
+    else if (argc > 2 && string_view(argv[1]) == "shared-memory")
+    {
+        framing = Framing::SHARED_MEMORY;
+        channelFd = std::stoull(argv[2]);
+    }
+    SharedMemoryChannel channel;
+    if (framing == Framing::SHARED_MEMORY)
+    {
+        auto r = SharedMemoryChannel::open(channelFd);
+        if (!r)
+        {
+            exitFailure(r.error());
+        }
+        channel = *r;
+    }
+    IPCManagerCompiler manager =
+        framing == Framing::SHARED_MEMORY ? IPCManagerCompiler{channel} : IPCManagerCompiler{framing, channelFd};
+#else
+    IPCManagerCompiler manager(framing, channelFd);
+#endif
+    if (string_view(argv[argc - 1]) == "v2")
+    {
+        manager.wireFormat = WireFormat::V2;
+        // BMI files are mapped on the first use in this run.
+        manager.lazyMapping = true;
+    }
+    else if (string_view(argv[argc - 1]) == "interned")
+    {
+        manager.wireFormat = WireFormat::V1_INTERNED;
+    }
+    else if (string_view(argv[argc - 1]) == "hashed")
+    {
+        // Requests and replies carry the hashes of the logical-names in this run.
+        manager.wireFormat = WireFormat::V1_HASHED;
+    }
+    if (framing == Framing::LENGTH_PREFIXED)
+    {
+        // BuildSystemTest persists the BMI file after it is received.
+        manager.bmiPublication = BMIPublication::WRITE_BEHIND;
+    }
     CompilerTest t(&manager);
+    // Logical-names looked up with findResponse and findResponses, which map their BMI files.
+    vector<string> foundNames;
     for (uint64_t i = 0; i < 300; ++i)
     {
         if (getRandomBool())
@@ -50,6 +185,8 @@ int main()
             CTBModule ctbModule;
             string str = getRandomString();
             ctbModule.moduleName = str;
+            ctbModule.hashed = true;
+            ctbModule.hash = hashLogicalName(str);
 
             if (const auto &r2 = t.receiveBTCModule(ctbModule); !r2)
             {
@@ -66,6 +203,8 @@ int main()
             nonModule.isHeaderUnit = false;
             string str = getRandomString();
             nonModule.logicalName = str;
+            nonModule.hashed = true;
+            nonModule.hash = hashLogicalName(str);
 
             if (const auto &r2 = t.receiveBTCNonModule(nonModule); !r2)
             {
@@ -76,14 +215,112 @@ int main()
                 printMessage(nonModule, true);
             }
         }
+
+        if (i % 20 == 10)
+        {
+            // Prefetches are sent back-to-back. Only the first two are waited for here, while the last one stays
+            // pending till a later request.
+            vector<string> logicalNames;
+            for (uint32_t j = 0; j < 3; ++j)
+            {
+                logicalNames.emplace_back(getRandomString());
+                if (const auto &r2 = manager.prefetch(logicalNames.back(), FileType::HEADER_FILE); !r2)
+                {
+                    exitFailure(r2.error());
+                }
+            }
+            for (uint32_t j = 0; j < 2; ++j)
+            {
+                if (const auto &r2 = manager.findResponse(logicalNames[j], FileType::HEADER_FILE); !r2)
+                {
+                    exitFailure(r2.error());
+                }
+                foundNames.emplace_back(logicalNames[j]);
+            }
+
+            // A logical-name pending as a header-file is prefetched as a module as well. The module request is not
+            // answered with the header-file reply.
+            const string logicalName = getRandomString();
+            const auto &r2 = manager.prefetch(logicalName, FileType::HEADER_FILE);
+            if (!r2)
+            {
+                exitFailure(r2.error());
+            }
+            const auto &r3 = manager.prefetch(logicalName, FileType::MODULE);
+            if (!r3)
+            {
+                exitFailure(r3.error());
+            }
+            if (*r2 == *r3)
+            {
+                exitFailure("module prefetch waits on the header-file prefetch");
+            }
+            if (const auto &r4 = manager.findResponse(logicalName, FileType::MODULE);
+                r4 && r4->type != FileType::MODULE)
+            {
+                exitFailure("module request is answered with another type");
+            }
+            foundNames.emplace_back(logicalName);
+        }
+
+        if (i % 30 == 29)
+        {
+            // Batched lookup of the random modules, header-units and header-files. The first one is requested twice.
+            vector<string> logicalNames;
+            vector<pair<string_view, FileType>> requests;
+            for (uint32_t j = 0; j < 6; ++j)
+            {
+                logicalNames.emplace_back(getRandomString());
+            }
+            for (uint32_t j = 0; j < logicalNames.size(); ++j)
+            {
+                requests.emplace_back(logicalNames[j], static_cast<FileType>(j % 3));
+            }
+            requests.emplace_back(requests[0]);
+            foundNames.insert(foundNames.end(), logicalNames.begin(), logicalNames.end());
+            if (const auto &r2 = manager.findResponses(requests); !r2)
+            {
+                exitFailure(r2.error());
+            }
+            else if (r2->size() != requests.size())
+            {
+                exitFailure("findResponses returned fewer responses than requested");
+            }
+            else
+            {
+                for (uint32_t j = 0; j < requests.size(); ++j)
+                {
+                    // Header-file might be replied with a header-unit.
+                    if ((*r2)[j].type != requests[j].second && requests[j].second != FileType::HEADER_FILE)
+                    {
+                        exitFailure("findResponses returned a response of another kind");
+                    }
+                }
+            }
+        }
     }
 
-    map<string_view, Response> outputResponses;
-    for (auto &r : CompilerTest::getResponse(manager))
+    if (manager.lazyMapping)
     {
-        outputResponses.emplace(r);
+        CompilerTest::checkUnmapped(manager, foundNames);
+        CompilerTest::getResponse(manager).forEach([&](const string_view logicalName, const Response &response) {
+            if (const auto &r2 = manager.willNeedBMIFile(logicalName); !r2)
+            {
+                exitFailure(r2.error());
+            }
+            if (response.type != FileType::HEADER_FILE &&
+                manager.filePathProcessMapping.find(response.filePath) == manager.filePathProcessMapping.end())
+            {
+                exitFailure(fmt::format("BMI file {} is not mapped by willNeedBMIFile", response.filePath));
+            }
+        });
     }
 
+    map<string_view, Response> outputResponses;
+    CompilerTest::getResponse(manager).forEach([&](const string_view logicalName, const Response &response) {
+        outputResponses.emplace(logicalName, response);
+    });
+
     set<string> files;
     std::string output;
     for (auto &r : outputResponses)
@@ -115,9 +352,13 @@ int main()
                 string fileContents = fileToString(response.filePath);
                 output.append(fmt::format("FileContent {}\n", fileContents));
             }
+            else if (const auto &r2 = manager.getBMIFileMapping(response.filePath); !r2)
+            {
+                exitFailure(r2.error());
+            }
             else
             {
-                output.append(fmt::format("FileContent {}\n", response.mapping.file));
+                output.append(fmt::format("FileContent {}\n", r2->file));
             }
             output.append(fmt::format("FileType {}\n", getFileType(response.type)));
             output.append(fmt::format("IsSystem {}\n", response.isSystem));
@@ -126,9 +367,36 @@ int main()
 
     const string bmi1Content = output;
     print("Sending first bmi-content.");
-    if (const auto &r2 =
-            manager.sendCTBLastMessage(bmi1Content, (std::filesystem::current_path() / "bmi.txt").generic_string());
-        !r2)
+    const string bmi1Path = (std::filesystem::current_path() / "bmi.txt").generic_string();
+    if (framing == Framing::SEQPACKET || framing == Framing::SHARED_MEMORY)
+    {
+        // Serialized in place in small pieces, so the writer grows a few times.
+        auto writer = BMIWriter::create(bmi1Path, 256);
+        if (!writer)
+        {
+            exitFailure(writer.error());
+        }
+        for (uint64_t i = 0; i < bmi1Content.size(); i += 100)
+        {
+            const uint64_t size = std::min<uint64_t>(100, bmi1Content.size() - i);
+            const auto &r2 = writer->reserve(size);
+            if (!r2)
+            {
+                exitFailure(r2.error());
+            }
+            memcpy(*r2, bmi1Content.data() + i, size);
+            writer->commit(size);
+        }
+        if (writer->getBMI() != bmi1Content)
+        {
+            exitFailure("BMIWriter contents are not same as written");
+        }
+        if (const auto &r2 = manager.sendCTBLastMessage(*writer); !r2)
+        {
+            exitFailure(r2.error());
+        }
+    }
+    else if (const auto &r2 = manager.sendCTBLastMessage(bmi1Content, bmi1Path); !r2)
     {
         exitFailure(r2.error());
     }
@@ -155,10 +423,28 @@ int main()
             exitFailure(r3.error());
         }
     }
-    for (std::string *p : allocations)
+    if (const ArenaStats &stats = manager.getArenaStats();
+        stats.strings < CompilerTest::getResponse(manager).getSize() || stats.bytesUsed > stats.bytesReserved)
     {
-        delete p;
+        exitFailure("Incorrect arena stats");
+    }
+    else
+    {
+        print("Arena Pages {} Strings {} Bytes Reserved {} Bytes Used {}\n", stats.pages, stats.strings,
+              stats.bytesReserved, stats.bytesUsed);
+    }
+    if (manager.wireFormat == WireFormat::V1_INTERNED)
+    {
+        // Paths of the replies are in the same directory.
+        const SessionDictionaryStats &stats = manager.getDictionaryStats();
+        if (!stats.entries || !stats.references)
+        {
+            exitFailure("Strings of the replies are not interned");
+        }
+        print("Dictionary Entries {} References {} Bytes Saved {}\n", stats.entries, stats.references,
+              stats.bytesSaved);
     }
+    CompilerTest::checkSharedMappings(manager);
     print("Successfully Completed CompilerTest\n");
     print(delimiter);
 }
@@ -0,0 +1,131 @@
+// Measures the page-faults and the wall time of mapping a BMI file and reading it with every PagePolicy. The file is
+// evicted from the page-cache before every run, so it is read from the disk. It is read whole, as the importer of
+// most of the declarations would, and sparsely, as the importer of a few would.
+
+#include "IPCManagerBS.hpp"
+#include "fmt/printf.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+using fmt::print, std::string, std::vector;
+using namespace P2978;
+
+[[noreturn]] void exitFailure(const string &str)
+{
+    print(stderr, "{}\n", str);
+    exit(EXIT_FAILURE);
+}
+
+struct Faults
+{
+    uint64_t minor;
+    uint64_t major;
+};
+
+Faults getFaults()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return {static_cast<uint64_t>(usage.ru_minflt), static_cast<uint64_t>(usage.ru_majflt)};
+}
+
+void evict(const string &filePath)
+{
+    // Dirty pages are not dropped, so these are written back first.
+    const int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd == -1 || fdatasync(fd) == -1 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0 || close(fd) == -1)
+    {
+        exitFailure(getErrorString());
+    }
+}
+
+void benchmark(const string &filePath, const PagePolicy policy, const char *name, const vector<uint32_t> &pages)
+{
+    evict(filePath);
+    BMIFile file;
+    file.filePath = filePath;
+
+    const Faults before = getFaults();
+    const auto start = std::chrono::steady_clock::now();
+    const auto &r = IPCManagerBS::createSharedMemoryBMIFile(file, policy);
+    if (!r)
+    {
+        exitFailure(r.error());
+    }
+    const auto mapped = std::chrono::steady_clock::now();
+
+    const uint32_t pageSize = getpagesize();
+    uint64_t sum = 0;
+    for (const uint32_t page : pages)
+    {
+        sum += static_cast<uint8_t>(r->file[static_cast<uint64_t>(page) * pageSize]);
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const Faults after = getFaults();
+
+    if (const auto &r2 = IPCManagerBS::closeBMIFileMapping(*r); !r2)
+    {
+        exitFailure(r2.error());
+    }
+    print("{:<11} pages {:>7}   map {:>9.2f} ms   read {:>9.2f} ms   minor-faults {:>7}   major-faults {:>6}   {}\n",
+          name, pages.size(), std::chrono::duration<double, std::milli>(mapped - start).count(),
+          std::chrono::duration<double, std::milli>(end - mapped).count(), after.minor - before.minor,
+          after.major - before.major, sum % 2);
+}
+
+int main(const int argc, char **argv)
+{
+    const uint32_t megabytes = argc > 1 ? std::stoul(argv[1]) : 128;
+    const string filePath = (std::filesystem::temp_directory_path() / "PageFaultBenchmark.bmi").string();
+    {
+        std::mt19937 generator(0);
+        string block(1024 * 1024, 0);
+        std::ofstream out(filePath, std::ios::binary);
+        for (uint32_t i = 0; i < megabytes; ++i)
+        {
+            for (char &c : block)
+            {
+                c = static_cast<char>(generator());
+            }
+            out.write(block.data(), block.size());
+        }
+    }
+
+    const uint32_t pageCount = static_cast<uint64_t>(megabytes) * 1024 * 1024 / getpagesize();
+    vector<uint32_t> all(pageCount);
+    for (uint32_t i = 0; i < pageCount; ++i)
+    {
+        all[i] = i;
+    }
+    // Every 16th page on average, in a random order.
+    vector<uint32_t> sparse;
+    std::mt19937 generator(1);
+    for (uint32_t i = 0; i < pageCount / 16; ++i)
+    {
+        sparse.emplace_back(generator() % pageCount);
+    }
+
+    const std::pair<PagePolicy, const char *> policies[] = {
+        {PagePolicy::POPULATE, "populate"},     {PagePolicy::NONE, "none"},     {PagePolicy::WILL_NEED, "will-need"},
+        {PagePolicy::SEQUENTIAL, "sequential"}, {PagePolicy::RANDOM, "random"}, {PagePolicy::HUGE_PAGE, "huge-page"},
+    };
+    print("{} MB file, whole\n", megabytes);
+    for (const auto &[policy, name] : policies)
+    {
+        benchmark(filePath, policy, name, all);
+    }
+    print("\n{} MB file, sparse\n", megabytes);
+    for (const auto &[policy, name] : policies)
+    {
+        benchmark(filePath, policy, name, sparse);
+    }
+    std::filesystem::remove(filePath);
+}
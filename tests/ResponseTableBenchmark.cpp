@@ -0,0 +1,123 @@
+// Compares the insert and lookup throughput of the ResponseTable with the std::unordered_map that the
+// IPCManagerCompiler used for its responses. Logical-names are grouped as in the replies: a header-unit has many
+// logical-names that all share one BMI file, while a module has one.
+
+#include "ResponseTable.hpp"
+#include "fmt/printf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using fmt::print, std::string, std::string_view, std::vector;
+using namespace P2978;
+
+constexpr uint32_t iterations = 50;
+
+struct Group
+{
+    string filePath;
+    vector<string> logicalNames;
+};
+
+template <typename Func> double median(Func func, uint64_t &sink)
+{
+    vector<double> times;
+    times.reserve(iterations);
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        sink += func();
+        times.emplace_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+uint64_t insertMap(const vector<Group> &groups, std::unordered_map<string_view, Response> &map)
+{
+    map = {};
+    for (const Group &group : groups)
+    {
+        for (const string &logicalName : group.logicalNames)
+        {
+            map.emplace(logicalName, Response(group.filePath, {}, FileType::HEADER_UNIT, false));
+        }
+    }
+    return map.size();
+}
+
+uint64_t insertTable(const vector<Group> &groups, ResponseTable &table)
+{
+    table = {};
+    for (const Group &group : groups)
+    {
+        table.reserve(group.logicalNames.size());
+        const uint32_t index = table.addResponse(Response(group.filePath, {}, FileType::HEADER_UNIT, false));
+        for (const string &logicalName : group.logicalNames)
+        {
+            table.insert(logicalName, ResponseTable::hash(logicalName), index);
+        }
+    }
+    return table.getSize();
+}
+
+int main()
+{
+    uint64_t sink = 0;
+    for (const uint32_t namesPerHeaderUnit : {1u, 16u, 256u})
+    {
+        // About 64K logical-names in every run.
+        const uint32_t groupsCount = 65536 / namesPerHeaderUnit;
+        vector<Group> groups(groupsCount);
+        vector<string_view> lookups;
+        for (uint32_t i = 0; i < groupsCount; ++i)
+        {
+            groups[i].filePath = fmt::format("/home/user/project/build/header-units/hu{}.ifc", i);
+            for (uint32_t j = 0; j < namesPerHeaderUnit; ++j)
+            {
+                groups[i].logicalNames.emplace_back(fmt::format("project/include/dir{}/header{}.hpp", i, j));
+            }
+        }
+        for (const Group &group : groups)
+        {
+            lookups.insert(lookups.end(), group.logicalNames.begin(), group.logicalNames.end());
+        }
+        std::reverse(lookups.begin(), lookups.end());
+
+        std::unordered_map<string_view, Response> map;
+        ResponseTable table;
+        const double mapInsert = median([&] { return insertMap(groups, map); }, sink);
+        const double tableInsert = median([&] { return insertTable(groups, table); }, sink);
+        const double mapLookup = median(
+            [&] {
+                uint64_t sum = 0;
+                for (const string_view logicalName : lookups)
+                {
+                    sum += map.find(logicalName)->second.filePath.size();
+                }
+                return sum;
+            },
+            sink);
+        const double tableLookup = median(
+            [&] {
+                uint64_t sum = 0;
+                for (const string_view logicalName : lookups)
+                {
+                    sum += table.find(logicalName)->filePath.size();
+                }
+                return sum;
+            },
+            sink);
+
+        const double names = lookups.size();
+        print("{:>4} names per header-unit, {} names\n", namesPerHeaderUnit, lookups.size());
+        print("    insert   unordered_map {:>7.2f} ns   ResponseTable {:>7.2f} ns\n", mapInsert * 1000 / names,
+              tableInsert * 1000 / names);
+        print("    lookup   unordered_map {:>7.2f} ns   ResponseTable {:>7.2f} ns\n", mapLookup * 1000 / names,
+              tableLookup * 1000 / names);
+    }
+    return sink == 0;
+}
@@ -0,0 +1,299 @@
+// Runs many compiler processes concurrently against one IPCServerBS. Every child process plays a compiler that
+// requests header-files with findResponse and writes some output in between, while the parent serves all of them on
+// one thread. Replies are checked by the compilers, so this also tests the server.
+// Every run is done with the epoll and the io_uring engines, and with the replies built on the worker threads. Without
+// the compilers argument, it is run with 64, 256 and 1024 compilers. In the WireFormat::V1_INTERNED runs, every third
+// reply of a connection is sent from the callback, after two replies built on the workers. These also have a
+// header-file before the requested one, so the ids of the strings differ between the two kinds of the replies.
+// Usage: ServerBenchmark [compilers] [requests per compiler]
+
+#include "IPCManagerCompiler.hpp"
+#include "IPCServerBS.hpp"
+#include "fmt/format.h"
+#include "fmt/printf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using fmt::print, std::string, std::string_view, std::vector;
+using namespace P2978;
+
+[[noreturn]] void exitFailure(const string &str)
+{
+    print(stderr, "{}\n", str);
+    exit(EXIT_FAILURE);
+}
+
+string getFilePath(const string_view logicalName)
+{
+    return fmt::format("/usr/include/{}", logicalName);
+}
+
+// Sent with the replies from the callback in the WireFormat::V1_INTERNED runs.
+constexpr string_view directHeader = "direct/header.hpp";
+
+[[noreturn]] void runCompiler(const Framing framing, const WireFormat wireFormat, const uint64_t channelFd,
+                              const uint32_t id, const uint32_t requests)
+{
+    IPCManagerCompiler manager(framing, channelFd);
+    manager.wireFormat = wireFormat;
+    for (uint32_t i = 0; i < requests; ++i)
+    {
+        const string logicalName = fmt::format("compiler{}/header{}.hpp", id, i);
+        const auto &r = manager.findResponse(logicalName, FileType::HEADER_FILE);
+        if (!r)
+        {
+            exitFailure(r.error());
+        }
+        if (r->filePath != getFilePath(logicalName))
+        {
+            exitFailure(fmt::format("wrong reply for {}", logicalName));
+        }
+        if (i % 8 == 0)
+        {
+            // Diagnostics interleaved with the messages.
+            print("compiler {} processed {} requests\n", id, i);
+            if (i % 16 == 8 && i + 1 < requests)
+            {
+                // Not a message, as it is not preceded by the size.
+                print("compiler {} output has {}\n", id, delimiter);
+            }
+            fflush(stdout);
+        }
+    }
+    if (wireFormat == WireFormat::V1_INTERNED && requests >= 3)
+    {
+        // Cached from the replies sent from the callback.
+        if (const auto &r = manager.findResponse(directHeader, FileType::HEADER_FILE);
+            !r || r->filePath != getFilePath(directHeader))
+        {
+            exitFailure(fmt::format("wrong reply for {}", directHeader));
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+struct Compiler
+{
+    pid_t pid;
+    uint64_t outputFd;
+    IPCManagerBS manager;
+};
+
+// Replies with paddingHeaders header files are larger than the pipe and the datagram, so these are written in parts as
+// the compiler reads these.
+void benchmark(const IOEngine engine, const Framing framing, const uint32_t compilerCount, const uint32_t requests,
+               const uint32_t workerCount = 0, const WireFormat wireFormat = WireFormat::V1,
+               const uint32_t paddingHeaders = 0)
+{
+    // Workers are idle till the server runs, so these do not hold any lock while the compilers are forked.
+    auto r = IPCServerBS::create(engine, workerCount);
+    if (!r)
+    {
+        if (engine == IOEngine::IO_URING)
+        {
+            // Disabled in some containers.
+            print("io_uring is not available: {}\n", r.error());
+            return;
+        }
+        exitFailure(r.error());
+    }
+    IPCServerBS server = std::move(*r);
+
+    uint64_t messages = 0;
+    uint64_t outputBytes = 0;
+    uint32_t delimiterOutputs = 0;
+    uint32_t closed = 0;
+    std::unordered_map<IPCServerBS::Connection *, uint32_t> connectionMessages;
+    server.onNonModule = [&](IPCServerBS::Connection &connection, const CTBNonModule &nonModule) {
+        ++messages;
+        const bool direct = wireFormat == WireFormat::V1_INTERNED && ++connectionMessages[&connection] % 3 == 0;
+        auto build = [logicalName = string(nonModule.logicalName), direct,
+                      paddingHeaders](const IPCManagerBS &manager) {
+            const string filePath = getFilePath(logicalName);
+            const string directPath = getFilePath(directHeader);
+            BTCNonModule reply;
+            if (direct)
+            {
+                reply.headerFiles.emplace_back(HeaderFile{directHeader, directPath, false});
+            }
+            // Reserved, so the header files do not point into the moved strings.
+            vector<string> paddingNames;
+            vector<string> paddingPaths;
+            paddingNames.reserve(paddingHeaders);
+            paddingPaths.reserve(paddingHeaders);
+            for (uint32_t i = 0; i < paddingHeaders; ++i)
+            {
+                const string &name = paddingNames.emplace_back(fmt::format("padding/header{}.hpp", i));
+                reply.headerFiles.emplace_back(HeaderFile{name, paddingPaths.emplace_back(getFilePath(name)), false});
+            }
+            reply.filePath = filePath;
+            return manager.sendMessage(reply);
+        };
+        // Compiler waits for every reply, so the replies on the workers are written already.
+        if (direct)
+        {
+            if (const auto &r2 = build(connection.manager); !r2)
+            {
+                exitFailure(r2.error());
+            }
+            return;
+        }
+        server.buildReply(connection, std::move(build));
+    };
+    server.onOutput = [&](IPCServerBS::Connection &, const string_view output) {
+        outputBytes += output.size();
+        delimiterOutputs += output.find(delimiter) != string_view::npos;
+    };
+    server.onClose = [&](IPCServerBS::Connection &, const string &error) {
+        if (!error.empty())
+        {
+            exitFailure(error);
+        }
+        ++closed;
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    // Build-system ends of the earlier compilers are closed in every child, so a compiler exit is seen as the end of
+    // its connection.
+    vector<int> parentFds;
+    vector<Compiler> compilers;
+    compilers.reserve(compilerCount);
+    for (uint32_t i = 0; i < compilerCount; ++i)
+    {
+        int stdinPipe[2];
+        int stdoutPipe[2];
+        int sockets[2] = {-1, -1};
+        if (pipe(stdinPipe) == -1 || pipe(stdoutPipe) == -1 ||
+            (framing == Framing::SEQPACKET && socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) == -1))
+        {
+            exitFailure(getErrorString());
+        }
+
+        const pid_t pid = fork();
+        if (pid == -1)
+        {
+            exitFailure(getErrorString());
+        }
+        if (pid == 0)
+        {
+            for (const int fd : parentFds)
+            {
+                close(fd);
+            }
+            dup2(stdinPipe[0], STDIN_FILENO);
+            dup2(stdoutPipe[1], STDOUT_FILENO);
+            close(stdinPipe[0]);
+            close(stdinPipe[1]);
+            close(stdoutPipe[0]);
+            close(stdoutPipe[1]);
+            if (framing == Framing::SEQPACKET)
+            {
+                close(sockets[0]);
+            }
+            runCompiler(framing, wireFormat, sockets[1], i, requests);
+        }
+
+        close(stdinPipe[0]);
+        close(stdoutPipe[1]);
+        const uint64_t writeFd = framing == Framing::SEQPACKET ? sockets[0] : stdinPipe[1];
+        if (framing == Framing::SEQPACKET)
+        {
+            close(sockets[1]);
+            parentFds.emplace_back(sockets[0]);
+        }
+        parentFds.emplace_back(stdinPipe[1]);
+        parentFds.emplace_back(stdoutPipe[0]);
+
+        Compiler &compiler = compilers.emplace_back(Compiler{pid, static_cast<uint64_t>(stdoutPipe[0]),
+                                                             IPCManagerBS{writeFd, framing}});
+        compiler.manager.wireFormat = wireFormat;
+        if (const auto &r2 = server.addConnection(compiler.manager, compiler.outputFd); !r2)
+        {
+            exitFailure(r2.error());
+        }
+    }
+
+    if (const auto &r2 = server.run(); !r2)
+    {
+        exitFailure(r2.error());
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (const Compiler &compiler : compilers)
+    {
+        int status;
+        if (waitpid(compiler.pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        {
+            exitFailure("compiler did not exit successfully");
+        }
+    }
+    for (const int fd : parentFds)
+    {
+        close(fd);
+    }
+    if (const auto &r2 = server.close(); !r2)
+    {
+        exitFailure(r2.error());
+    }
+
+    if (closed != compilerCount || messages != static_cast<uint64_t>(compilerCount) * requests || !outputBytes)
+    {
+        exitFailure("server did not receive all the messages");
+    }
+    // Framing::SEQPACKET output is not framed, so the delimiter might be split across the reads.
+    if (framing == Framing::DELIMITER && requests > 9 && delimiterOutputs < compilerCount)
+    {
+        exitFailure("delimiter in the compiler output is not received as output");
+    }
+    print("{:<9} {:<10} {:<9} {:>2} workers {:>5} compilers {:>5} padding   {:>8} requests   {:>8.3f} s   {:>10.0f} "
+          "requests/s\n",
+          engine == IOEngine::IO_URING ? "io_uring" : "epoll",
+          framing == Framing::SEQPACKET ? "seqpacket" : "delimiter",
+          wireFormat == WireFormat::V1_INTERNED ? "interned" : "v1", workerCount, compilerCount, paddingHeaders,
+          messages, seconds, messages / seconds);
+}
+
+int main(const int argc, char **argv)
+{
+    vector<uint32_t> compilerCounts{64, 256, 1024};
+    if (argc > 1)
+    {
+        compilerCounts = {static_cast<uint32_t>(std::stoul(argv[1]))};
+    }
+    const uint32_t requests = argc > 2 ? std::stoul(argv[2]) : 100;
+
+    // Build-system keeps 2 or 3 file descriptors per compiler.
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    for (const uint32_t compilerCount : compilerCounts)
+    {
+        benchmark(IOEngine::EPOLL, Framing::DELIMITER, compilerCount, requests);
+        benchmark(IOEngine::EPOLL, Framing::SEQPACKET, compilerCount, requests);
+        benchmark(IOEngine::IO_URING, Framing::DELIMITER, compilerCount, requests);
+        benchmark(IOEngine::EPOLL, Framing::DELIMITER, compilerCount, requests, 4);
+        benchmark(IOEngine::IO_URING, Framing::DELIMITER, compilerCount, requests, 4);
+        benchmark(IOEngine::EPOLL, Framing::DELIMITER, compilerCount, requests, 4, WireFormat::V1_INTERNED);
+        benchmark(IOEngine::IO_URING, Framing::DELIMITER, compilerCount, requests, 4, WireFormat::V1_INTERNED);
+
+        // Replies of about 100 KB each.
+        const uint32_t largeCount = std::min(compilerCount, 16u);
+        const uint32_t largeRequests = std::min(requests, 4u);
+        benchmark(IOEngine::EPOLL, Framing::DELIMITER, largeCount, largeRequests, 0, WireFormat::V1, 1536);
+        benchmark(IOEngine::EPOLL, Framing::SEQPACKET, largeCount, largeRequests, 0, WireFormat::V1, 1536);
+        benchmark(IOEngine::EPOLL, Framing::DELIMITER, largeCount, largeRequests, 4, WireFormat::V1, 1536);
+        benchmark(IOEngine::IO_URING, Framing::DELIMITER, largeCount, largeRequests, 4, WireFormat::V1, 1536);
+    }
+}
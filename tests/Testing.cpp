@@ -203,7 +203,8 @@ BTCModule getBTCModule(const CTBModule &ctbModule)
 BTCNonModule getBTCNonModule(const CTBNonModule &ctbNonModule)
 {
     BTCNonModule nonModule;
-    nonModule.isHeaderUnit = getRandomBool();
+    // Header-file might be replied with a header-unit, but not the other way.
+    nonModule.isHeaderUnit = ctbNonModule.isHeaderUnit || getRandomBool();
     nonModule.isSystem = getRandomBool();
 
     const uint32_t headerFilesSize = getRandomNumber(10);
@@ -232,7 +233,12 @@ BTCNonModule getBTCNonModule(const CTBNonModule &ctbNonModule)
     uint32_t logicalNameSize = getRandomNumber(2);
     for (uint32_t i = 0; i < logicalNameSize; ++i)
     {
+        // Logical-name might have the bytes of the delimiter. These do not end the message.
         string *s = new string(getRandomString());
+        if (i == 0 && getRandomBool())
+        {
+            s->insert(s->size() / 2, delimiter);
+        }
         buildTestallocations.emplace_back(s);
         const auto &it2 =
             tempTestFiles.emplace(*s, TestResponse{it.first->second.filePath, it.first->second.fileContent,
@@ -281,11 +287,8 @@ BTCNonModule getBTCNonModule(const CTBNonModule &ctbNonModule)
         huDep.file.filePath = *filePath;
         huDep.file.fileSize = fileContents->size();
 
+        // Might be 0. The compiler maps the BMI file still.
         logicalNameSize = getRandomNumber(10);
-        if (logicalNameSize == 0)
-        {
-            logicalNameSize = 1;
-        }
 
         for (uint32_t j = 0; j < logicalNameSize; ++j)
         {
@@ -333,6 +336,10 @@ void printMessage(const CTBLastMessage &lastMessage, const bool sent)
     printSendingOrReceiving(sent);
     print("CTBLastMessage\n\n");
     print("FileSize: {}\n\n", lastMessage.fileSize);
+    if (lastMessage.hashed)
+    {
+        print("Hash: {}\n\n", to16charHexString(lastMessage.hash));
+    }
 }
 
 void printMessage(const BTCModule &btcModule, const bool sent)
@@ -0,0 +1,171 @@
+
+// Measures the request/response round-trip time of the pipe transport against the Framing::SHARED_MEMORY transport.
+// Child process plays the compiler and sends a small request, while the parent plays the build-system and replies.
+
+#include "Manager.hpp"
+#include "SharedMemoryChannel.hpp"
+#include "fmt/printf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using fmt::print, std::string, std::vector;
+using namespace P2978;
+
+constexpr uint32_t iterations = 20000;
+constexpr uint32_t requestSize = 32;
+
+[[noreturn]] void exitFailure(const string &str)
+{
+    print(stderr, "{}\n", str);
+    exit(EXIT_FAILURE);
+}
+
+void readExactly(const int fd, char *buffer, const uint32_t count)
+{
+    uint32_t bytesRead = 0;
+    while (bytesRead != count)
+    {
+        const int32_t result = read(fd, buffer + bytesRead, count - bytesRead);
+        if (result <= 0)
+        {
+            exitFailure(getErrorString());
+        }
+        bytesRead += result;
+    }
+}
+
+void printPercentiles(const string &name, const uint32_t replySize, vector<double> &roundTrips)
+{
+    std::sort(roundTrips.begin(), roundTrips.end());
+    print("{:<14} reply {:>7} bytes   p50 {:>8.2f} us   p99 {:>8.2f} us\n", name, replySize,
+          roundTrips[roundTrips.size() / 2], roundTrips[roundTrips.size() * 99 / 100]);
+}
+
+void benchmarkPipe(const uint32_t replySize)
+{
+    int requestPipe[2];
+    int replyPipe[2];
+    if (pipe(requestPipe) == -1 || pipe(replyPipe) == -1)
+    {
+        exitFailure(getErrorString());
+    }
+
+    const string request(requestSize, 'r');
+    string reply(replySize, 'b');
+
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        // compiler
+        string received(replySize, '\0');
+        vector<double> roundTrips;
+        roundTrips.reserve(iterations);
+        for (uint32_t i = 0; i < iterations; ++i)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            if (const auto &r = Manager::writeAll(requestPipe[1], request.data(), requestSize); !r)
+            {
+                exitFailure(r.error());
+            }
+            readExactly(replyPipe[0], received.data(), replySize);
+            roundTrips.emplace_back(
+                std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+        printPercentiles("pipe", replySize, roundTrips);
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+
+    // build-system
+    char received[requestSize];
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        readExactly(requestPipe[0], received, requestSize);
+        if (const auto &r = Manager::writeAll(replyPipe[1], reply.data(), replySize); !r)
+        {
+            exitFailure(r.error());
+        }
+    }
+    waitpid(pid, nullptr, 0);
+    close(requestPipe[0]);
+    close(requestPipe[1]);
+    close(replyPipe[0]);
+    close(replyPipe[1]);
+}
+
+void benchmarkSharedMemory(const uint32_t replySize)
+{
+    auto r = SharedMemoryChannel::create();
+    if (!r)
+    {
+        exitFailure(r.error());
+    }
+    const SharedMemoryChannel channel = *r;
+
+    const string request(requestSize, 'r');
+    const string reply(replySize, 'b');
+
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        // compiler
+        auto r2 = SharedMemoryChannel::open(channel.fd);
+        if (!r2)
+        {
+            exitFailure(r2.error());
+        }
+        string received;
+        vector<double> roundTrips;
+        roundTrips.reserve(iterations);
+        for (uint32_t i = 0; i < iterations; ++i)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            if (const auto &r3 = r2->write(request); !r3)
+            {
+                exitFailure(r3.error());
+            }
+            if (const auto &r3 = r2->read(received); !r3)
+            {
+                exitFailure(r3.error());
+            }
+            roundTrips.emplace_back(
+                std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+        printPercentiles("shared-memory", replySize, roundTrips);
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+
+    // build-system
+    string received;
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        if (const auto &r2 = channel.read(received); !r2)
+        {
+            exitFailure(r2.error());
+        }
+        if (const auto &r2 = channel.write(reply); !r2)
+        {
+            exitFailure(r2.error());
+        }
+    }
+    waitpid(pid, nullptr, 0);
+    if (const auto &r2 = channel.unmap(); !r2)
+    {
+        exitFailure(r2.error());
+    }
+}
+
+int main()
+{
+    for (const uint32_t replySize : {256u, 16u * 1024, 256u * 1024})
+    {
+        benchmarkPipe(replySize);
+        benchmarkSharedMemory(replySize);
+    }
+}
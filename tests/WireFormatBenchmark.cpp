@@ -0,0 +1,146 @@
+
+// Compares the decoding of a large synthetic BTCModule in WireFormat::V1 with the Manager::read* functions against
+// the WireFormat::V2 in-place reads. Full walk reads every dependency, while the last dependency access reads only
+// the last one, which V1 can not do without parsing all the ones before it.
+
+#include "FlatMessages.hpp"
+#include "Manager.hpp"
+#include "Serialization.hpp"
+#include "fmt/printf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using fmt::print, std::string, std::string_view, std::vector;
+using namespace P2978;
+
+constexpr uint32_t iterations = 200;
+
+[[noreturn]] void exitFailure(const string &str)
+{
+    print(stderr, "{}\n", str);
+    exit(EXIT_FAILURE);
+}
+
+template <typename T> T value(const tl::expected<T, string> &r)
+{
+    if (!r)
+    {
+        exitFailure(r.error());
+    }
+    return *r;
+}
+
+// Returns the sum of the file-sizes and the sizes of the strings, so the compiler can not skip the reads.
+uint64_t walkV1(const string_view message, const bool lastOnly)
+{
+    uint64_t sum = 0;
+    uint32_t bytesRead = 0;
+    sum += value(Manager::readPath(message, bytesRead)).size();
+    sum += value(Manager::readUInt32(message, bytesRead));
+    sum += value(Manager::readBool(message, bytesRead));
+    const uint32_t modDepsSize = value(Manager::readUInt32(message, bytesRead));
+    for (uint32_t i = 0; i < modDepsSize; ++i)
+    {
+        const bool isHeaderUnit = value(Manager::readBool(message, bytesRead));
+        const string_view filePath = value(Manager::readPath(message, bytesRead));
+        const uint32_t fileSize = value(Manager::readUInt32(message, bytesRead));
+        const bool isSystem = value(Manager::readBool(message, bytesRead));
+        const uint32_t logicalNamesSize = value(Manager::readUInt32(message, bytesRead));
+        uint64_t namesSize = 0;
+        for (uint32_t j = 0; j < logicalNamesSize; ++j)
+        {
+            namesSize += value(Manager::readString(message, bytesRead)).size();
+        }
+        if (!lastOnly || i == modDepsSize - 1)
+        {
+            sum += isHeaderUnit + filePath.size() + fileSize + isSystem + namesSize;
+        }
+    }
+    return sum;
+}
+
+uint64_t walkV2(const string_view message, const bool lastOnly)
+{
+    const FlatMessage flat = value(FlatMessage::openBTCModule(message));
+    const auto &root = flat.root<FlatBTCModule>();
+    uint64_t sum = root.requested.filePath.size + root.requested.fileSize + root.isSystem;
+    for (uint32_t i = lastOnly ? root.modDeps.count - 1 : 0; i < root.modDeps.count; ++i)
+    {
+        const FlatModuleDep &dep = flat.get(root.modDeps, i);
+        sum += dep.isHeaderUnit + flat.get(dep.file.filePath).size() + dep.file.fileSize + dep.isSystem;
+        for (uint32_t j = 0; j < dep.logicalNames.count; ++j)
+        {
+            sum += flat.get(flat.get(dep.logicalNames, j)).size();
+        }
+    }
+    return sum;
+}
+
+template <typename Func> double median(Func func, uint64_t &sink)
+{
+    vector<double> times;
+    times.reserve(iterations);
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        sink += func();
+        times.emplace_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+int main()
+{
+    uint64_t sink = 0;
+    for (const uint32_t depsCount : {64u, 1024u, 16384u})
+    {
+        // Storage for the strings the message points to.
+        vector<string> strings;
+        strings.reserve(depsCount * 4);
+        BTCModule moduleFile;
+        moduleFile.requested = {"/home/user/project/build/modules/requested.ifc", 4096};
+        for (uint32_t i = 0; i < depsCount; ++i)
+        {
+            ModuleDep &dep = moduleFile.modDeps.emplace_back();
+            dep.isHeaderUnit = i % 4 == 0;
+            dep.file.filePath = strings.emplace_back(fmt::format("/home/user/project/build/modules/dep{}.ifc", i));
+            dep.file.fileSize = i;
+            dep.logicalNames.emplace_back(strings.emplace_back(fmt::format("project.module{}", i)));
+            if (dep.isHeaderUnit)
+            {
+                dep.logicalNames.emplace_back(strings.emplace_back(fmt::format("project/include/header{}.hpp", i)));
+                dep.logicalNames.emplace_back(strings.emplace_back(fmt::format("project/include/detail{}.hpp", i)));
+            }
+        }
+
+        string v1;
+        serialize(v1, moduleFile);
+        string v2;
+        writeFlat(v2, moduleFile);
+        if (walkV1(v1, false) != walkV2(v2, false) || walkV1(v1, true) != walkV2(v2, true))
+        {
+            exitFailure("V1 and V2 decoded differently");
+        }
+
+        print("{:>6} deps   V1 {:>8} bytes   V2 {:>8} bytes\n", depsCount, v1.size(), v2.size());
+
+        // Same reply sent twice on a connection. The second one refers to the strings of the first.
+        SessionDictionary dictionary;
+        string interned;
+        serialize(interned, moduleFile, &dictionary);
+        string repeated;
+        serialize(repeated, moduleFile, &dictionary);
+        print("    V1_INTERNED       first {:>8} bytes   repeated {:>8} bytes\n", interned.size(), repeated.size());
+        const double v1Full = median([&] { return walkV1(v1, false); }, sink);
+        const double v2Full = median([&] { return walkV2(v2, false); }, sink);
+        const double v1Last = median([&] { return walkV1(v1, true); }, sink);
+        const double v2Last = median([&] { return walkV2(v2, true); }, sink);
+        print("    full walk         V1 {:>9.2f} us   V2 {:>9.2f} us\n", v1Full, v2Full);
+        print("    last dependency   V1 {:>9.2f} us   V2 {:>9.2f} us\n", v1Last, v2Last);
+    }
+    return sink == 0;
+}